@@ -0,0 +1,486 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fat16.h"
+#include "blockdev_pio.h"
+#include "blockdev_trace.h"
+
+//
+// Benchmark suite for the FAT16 library.
+//
+// Generates a fresh image of given geometry for each test,
+// and reports throughput and latency of common operations.
+//
+
+
+/** Benchmark settings (command line) */
+typedef struct
+{
+	const char* path;      // image file
+	uint32_t size_mb;      // image size
+	uint8_t spc;           // sectors per cluster, 0 = auto
+	uint32_t avg_file_size; // file size hint for automatic cluster size
+	uint16_t root_entries; // root directory size
+	uint32_t seq_kb;       // size of the sequential read/write file
+	uint32_t seed;         // random seed
+	const char* trace;     // file to record a device trace into, or NULL
+} BenchOpts;
+
+
+static BenchOpts opts = {
+	.path = "imgs/bench.img",
+	.size_mb = 64,
+	.spc = 4,
+	.avg_file_size = 0,
+	.root_entries = 512,
+	.seq_kb = 4096,
+	.seed = 1,
+};
+
+static const BLOCKDEV* dev;
+static FAT16 fat;
+static FILE* trace_file;
+
+
+// ------------- timing ----------------
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+static int cmp_u64(const void* a, const void* b)
+{
+	const uint64_t x = *(const uint64_t*) a;
+	const uint64_t y = *(const uint64_t*) b;
+	return (x > y) - (x < y);
+}
+
+
+/**
+ * Print one result line.
+ *
+ * lat ... per-op latencies in ns (sorted in place), may be NULL
+ * bytes ... bytes transferred, 0 if not applicable
+ */
+static void report(const char* name, uint32_t ops, uint64_t total_ns, uint64_t* lat, uint64_t bytes)
+{
+	printf("%-24s %8u ops %10.2f ms", name, ops, total_ns / 1e6);
+
+	if (bytes > 0)
+		printf(" %9.2f MB/s", (bytes / 1048576.0) / (total_ns / 1e9));
+	else
+		printf(" %9s     ", "");
+
+	printf(" %10.2f us/op", ops ? total_ns / 1e3 / ops : 0);
+
+	if (lat != NULL && ops > 0)
+	{
+		qsort(lat, ops, sizeof(uint64_t), &cmp_u64);
+		printf("  p50 %8.2f us  p99 %8.2f us  max %8.2f us",
+			   lat[ops / 2] / 1e3, lat[(ops * 99) / 100] / 1e3, lat[ops - 1] / 1e3);
+	}
+
+	printf("\n");
+}
+
+
+// ------------- image generator ----------------
+
+/** Create an empty image file */
+static bool make_image(void)
+{
+	FILE* f = fopen(opts.path, "wb");
+	if (f == NULL) return false;
+
+	// sparse zero-filled image
+	const bool ok = (ftruncate(fileno(f), (off_t) opts.size_mb * 1048576) == 0);
+	fclose(f);
+
+	return ok;
+}
+
+
+static void trace_sink(const void* data, const uint16_t len)
+{
+	fwrite(data, len, 1, trace_file);
+}
+
+
+/** Make a fresh image and mount it */
+static bool fresh_volume(void)
+{
+	if (trace_file != NULL) trace_flush();
+	pio_close();
+
+	if (!make_image()) return false;
+
+	dev = pio_open(opts.path);
+	if (dev == NULL) return false;
+
+	const FFORMAT fmt = {
+		.sectors_per_cluster = opts.spc,
+		.root_entries = opts.root_entries,
+		.avg_file_size = opts.avg_file_size,
+		.label = "BENCH",
+	};
+
+	if (!ff_format(dev, opts.size_mb * 1048576, &fmt)) return false;
+
+	if (trace_file != NULL)
+	{
+		static bool started = false;
+		static const BLOCKDEV* traced;
+
+		if (!started)
+		{
+			traced = trace_wrap(dev, &trace_sink, 0);
+			started = true;
+		}
+
+		dev = traced;
+	}
+
+	return ff_init(dev, &fat);
+}
+
+
+/** Create a subdirectory of root, and leave the handle in it */
+static bool make_dir(FFILE* dir, const char* name)
+{
+	ff_root(&fat, dir);
+	return ff_mkdir(dir, name);
+}
+
+
+// ------------- benchmarks ----------------
+
+
+static uint8_t buf[4096];
+
+
+static void bench_seq(void)
+{
+	if (!fresh_volume()) return;
+
+	FFILE file;
+	ff_root(&fat, &file);
+	ff_newfile(&file, "SEQ.BIN");
+
+	const uint32_t chunks = opts.seq_kb / 4;
+
+	// sequential write
+	uint64_t t0 = now_ns();
+	for (uint32_t i = 0; i < chunks; i++)
+	{
+		memset(buf, i, sizeof(buf));
+		ff_write(&file, buf, sizeof(buf));
+	}
+	ff_flush_file(&file);
+	report("seq write 4k", chunks, now_ns() - t0, NULL, (uint64_t) chunks * sizeof(buf));
+
+	// sequential read
+	ff_seek(&file, 0);
+	t0 = now_ns();
+	for (uint32_t i = 0; i < chunks; i++)
+	{
+		ff_read(&file, buf, sizeof(buf));
+	}
+	report("seq read 4k", chunks, now_ns() - t0, NULL, (uint64_t) chunks * sizeof(buf));
+
+	// random seek + read
+	const uint32_t ops = 1000;
+	uint64_t* lat = malloc(ops * sizeof(uint64_t));
+	t0 = now_ns();
+	for (uint32_t i = 0; i < ops; i++)
+	{
+		const uint32_t pos = (uint32_t) rand() % (file.size - 512);
+		const uint64_t t1 = now_ns();
+		ff_seek(&file, pos);
+		ff_read(&file, buf, 512);
+		lat[i] = now_ns() - t1;
+	}
+	report("random seek+read 512", ops, now_ns() - t0, lat, (uint64_t) ops * 512);
+	free(lat);
+}
+
+
+static void bench_small_files(void)
+{
+	if (!fresh_volume()) return;
+
+	const uint32_t count = 200;
+	uint64_t* lat = malloc(count * sizeof(uint64_t));
+	char name[13];
+
+	FFILE dir;
+	make_dir(&dir, "SMALL");
+
+	memset(buf, 'x', 1024);
+
+	uint64_t t0 = now_ns();
+	for (uint32_t i = 0; i < count; i++)
+	{
+		FFILE file = dir;
+		sprintf(name, "F%05u.DAT", i);
+
+		const uint64_t t1 = now_ns();
+		ff_newfile(&file, name);
+		ff_write(&file, buf, 1024);
+		ff_flush_file(&file);
+		lat[i] = now_ns() - t1;
+	}
+	report("small file create 1k", count, now_ns() - t0, lat, count * 1024);
+
+	t0 = now_ns();
+	for (uint32_t i = 0; i < count; i++)
+	{
+		FFILE file = dir;
+		sprintf(name, "F%05u.DAT", i);
+
+		const uint64_t t1 = now_ns();
+		if (ff_find(&file, name)) ff_rmfile(&file);
+		lat[i] = now_ns() - t1;
+	}
+	report("small file delete", count, now_ns() - t0, lat, 0);
+
+	free(lat);
+}
+
+
+/**
+ * Fill a fresh directory with "count" entries, written directly
+ * into the directory clusters (creating them through the API
+ * would take far too long for large counts).
+ */
+static bool populate_dir(FFILE* dir, const char* name, uint32_t count)
+{
+	if (!make_dir(dir, name)) return false;
+
+	// Grow the directory, entries "." and ".." are already there
+	const uint32_t bytes = (count + 2) * 32;
+	FFILE chain = *dir;
+	chain.clu_start = dir->clu;
+	chain.size = bytes;
+	ff_seek(&chain, bytes); // allocates the clusters
+
+	uint8_t ent[32];
+	memset(ent, 0, 32);
+	ent[11] = FA_ARCHIVE;
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		char raw[12];
+		sprintf(raw, "E%07u", i);
+		memcpy(ent, raw, 8);
+		memcpy(ent + 8, "DAT", 3);
+
+		ff_seek(&chain, (i + 2) * 32);
+		dev->seek(chain.cur_abs);
+		dev->store(ent, 32);
+	}
+
+	ff_first(dir);
+	return true;
+}
+
+
+static void bench_listing(void)
+{
+	static const uint32_t counts[] = { 10, 1000, 10000 };
+
+	for (uint8_t c = 0; c < 3; c++)
+	{
+		if (!fresh_volume()) return;
+
+		FFILE dir;
+		if (!populate_dir(&dir, "LIST", counts[c])) continue;
+
+		const uint32_t reps = counts[c] < 1000 ? 100 : 3;
+
+		uint32_t seen = 0;
+		uint64_t t0 = now_ns();
+		for (uint32_t r = 0; r < reps; r++)
+		{
+			ff_first(&dir);
+			do
+			{
+				if (ff_is_regular(&dir)) seen++;
+			}
+			while (ff_next(&dir));
+		}
+
+		char name[32];
+		sprintf(name, "list dir %u", counts[c]);
+		report(name, seen, now_ns() - t0, NULL, 0);
+	}
+}
+
+
+static void bench_tree_delete(void)
+{
+	if (!fresh_volume()) return;
+
+	char name[13];
+
+	FFILE dir;
+	make_dir(&dir, "TREE");
+
+	// 10 subdirectories, 30 files each
+	for (uint8_t d = 0; d < 10; d++)
+	{
+		FFILE sub = dir;
+		sprintf(name, "D%u", d);
+		ff_mkdir(&sub, name);
+
+		for (uint8_t i = 0; i < 30; i++)
+		{
+			FFILE file = sub;
+			sprintf(name, "F%u.DAT", i);
+			ff_newfile(&file, name);
+			ff_write(&file, buf, 2048);
+			ff_flush_file(&file);
+		}
+	}
+
+	ff_root(&fat, &dir);
+	ff_find(&dir, "TREE");
+
+	const uint64_t t0 = now_ns();
+	ff_delete(&dir);
+	report("recursive delete 311", 311, now_ns() - t0, NULL, 0);
+}
+
+
+static void bench_fragmented_alloc(void)
+{
+	if (!fresh_volume()) return;
+
+	char name[13];
+
+	FFILE dir;
+	make_dir(&dir, "FRAG");
+
+	// Fill the start of the volume with one-cluster files,
+	// then delete every other one.
+	const uint32_t count = 400;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		FFILE file = dir;
+		sprintf(name, "F%u.DAT", i);
+		ff_newfile(&file, name);
+	}
+
+	for (uint32_t i = 0; i < count; i += 2)
+	{
+		FFILE file = dir;
+		sprintf(name, "F%u.DAT", i);
+		if (ff_find(&file, name)) ff_rmfile(&file);
+	}
+
+	// Now grow one file cluster by cluster
+	FFILE file = dir;
+	ff_newfile(&file, "GROW.DAT");
+
+	const uint32_t ops = 400;
+	uint64_t* lat = malloc(ops * sizeof(uint64_t));
+	const uint16_t bpc = fat.bs.bytes_per_cluster;
+
+	const uint64_t t0 = now_ns();
+	for (uint32_t i = 0; i < ops; i++)
+	{
+		const uint64_t t1 = now_ns();
+		ff_seek(&file, (i + 1) * bpc); // allocates one cluster
+		lat[i] = now_ns() - t1;
+	}
+	report("fragmented alloc", ops, now_ns() - t0, lat, 0);
+	free(lat);
+}
+
+
+// ------------- main ----------------
+
+static void usage(const char* prog)
+{
+	fprintf(stderr,
+			"Usage: %s [-f image] [-s size_MB] [-c sectors_per_cluster (0 = auto)]\n"
+			"          [-a avg_file_size] [-r root_entries] [-k seq_file_KB] [-x seed]\n"
+			"          [-t trace_file]\n", prog);
+}
+
+
+int main(int argc, char** argv)
+{
+	int c;
+	while ((c = getopt(argc, argv, "f:s:c:a:r:k:x:t:h")) != -1)
+	{
+		switch (c)
+		{
+			case 'f': opts.path = optarg; break;
+			case 's': opts.size_mb = atoi(optarg); break;
+			case 'c': opts.spc = atoi(optarg); break;
+			case 'a': opts.avg_file_size = atoi(optarg); break;
+			case 'r': opts.root_entries = atoi(optarg); break;
+			case 'k': opts.seq_kb = atoi(optarg); break;
+			case 'x': opts.seed = atoi(optarg); break;
+			case 't': opts.trace = optarg; break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	// written in 4 KB chunks, read back at random offsets within
+	if (opts.seq_kb < 4)
+	{
+		fprintf(stderr, "The sequential file must have at least 4 KB.\n");
+		return 1;
+	}
+
+	srand(opts.seed);
+
+	if (opts.trace != NULL)
+	{
+		trace_file = fopen(opts.trace, "wb");
+		if (trace_file == NULL)
+		{
+			perror(opts.trace);
+			return 1;
+		}
+	}
+
+	if (!fresh_volume())
+	{
+		fprintf(stderr, "Could not create the image.\n");
+		return 1;
+	}
+
+	printf("image %s, %u MB, %u B/cluster, %u root entries\n\n",
+		   opts.path, opts.size_mb, fat.bs.bytes_per_cluster, fat.bs.root_entries);
+
+	bench_seq();
+	bench_small_files();
+	bench_listing();
+	bench_tree_delete();
+	bench_fragmented_alloc();
+
+	if (trace_file != NULL)
+	{
+		trace_flush();
+		fclose(trace_file);
+	}
+
+	pio_close();
+	unlink(opts.path);
+
+	return 0;
+}
@@ -7,6 +7,10 @@
 
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /** Abstract block device interface
  *
  * Populate an instance of this with pointers to your I/O functions.
@@ -62,5 +66,19 @@ typedef struct
 	 */
 	void (*flush)(void);
 
+
+	/** Discard an area - its data is no longer needed (TRIM, hole punching).
+	 *
+	 * Optional, NULL if the device can't do it. The area may read back
+	 * as anything afterwards. The cursor is not moved.
+	 *
+	 * @param addr start address
+	 * @param len  number of bytes
+	 */
+	void (*discard)(const uint32_t addr, const uint32_t len);
+
 } BLOCKDEV;
 
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,211 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "blockdev_direct.h"
+
+
+static BLOCKDEV direct;
+static int direct_fd = -1;
+
+/** Set when a transfer failed, until the image is closed */
+static volatile bool direct_failed;
+
+/** Cursor, one per thread */
+static __thread uint32_t direct_cur;
+
+/** Bounce buffer, one per thread: the longest transfer, plus a block at each end */
+static __thread uint8_t direct_bounce[65536 + 2 * DIRECT_ALIGN] __attribute__((aligned(DIRECT_ALIGN)));
+
+
+/** Start of the block holding "addr" */
+static inline uint32_t block_floor(const uint32_t addr)
+{
+	return addr - addr % DIRECT_ALIGN;
+}
+
+
+/** End of the block holding byte "addr - 1" */
+static inline uint32_t block_ceil(const uint32_t addr)
+{
+	return block_floor(addr + DIRECT_ALIGN - 1);
+}
+
+
+/** Check if a transfer can use the caller's memory */
+static inline bool is_aligned(const void* buf, const uint32_t addr, const uint16_t len)
+{
+	return ((uintptr_t) buf % DIRECT_ALIGN) == 0 && (addr % DIRECT_ALIGN) == 0 && (len % DIRECT_ALIGN) == 0;
+}
+
+
+/** Read "len" bytes at "at"; what can't be read (past the end, errors) reads as zeros */
+static void read_full(void* dest, const uint32_t len, const uint32_t at)
+{
+	uint32_t done = 0;
+	while (done < len)
+	{
+		const ssize_t n = pread(direct_fd, (uint8_t*) dest + done, len - done, at + done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0)
+		{
+			if (n < 0) direct_failed = true;
+			memset((uint8_t*) dest + done, 0, len - done);
+			return;
+		}
+
+		done += n;
+	}
+}
+
+
+/** Write "len" bytes at "at" */
+static void write_full(const void* src, const uint32_t len, const uint32_t at)
+{
+	uint32_t done = 0;
+	while (done < len)
+	{
+		const ssize_t n = pwrite(direct_fd, (const uint8_t*) src + done, len - done, at + done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0)
+		{
+			direct_failed = true;
+			return;
+		}
+
+		done += n;
+	}
+}
+
+
+static void direct_seek(const uint32_t addr)
+{
+	direct_cur = addr;
+}
+
+
+static void direct_rseek(const int16_t offset)
+{
+	direct_cur += offset;
+}
+
+
+static void direct_load(void* dest, const uint16_t len)
+{
+	if (is_aligned(dest, direct_cur, len))
+	{
+		read_full(dest, len, direct_cur);
+	}
+	else
+	{
+		const uint32_t start = block_floor(direct_cur);
+		const uint32_t span = block_ceil(direct_cur + len) - start;
+
+		read_full(direct_bounce, span, start);
+		memcpy(dest, direct_bounce + (direct_cur - start), len);
+	}
+
+	direct_cur += len;
+}
+
+
+static void direct_store(const void* src, const uint16_t len)
+{
+	if (is_aligned(src, direct_cur, len))
+	{
+		write_full(src, len, direct_cur);
+	}
+	else
+	{
+		const uint32_t start = block_floor(direct_cur);
+		const uint32_t end = block_ceil(direct_cur + len);
+
+		const uint32_t last = end - DIRECT_ALIGN;
+
+		// Partial blocks at the ends keep their other bytes
+		const bool head = (direct_cur != start);
+		if (head)
+		{
+			read_full(direct_bounce, DIRECT_ALIGN, start);
+		}
+
+		if (direct_cur + len != end && !(head && last == start))
+		{
+			read_full(direct_bounce + (last - start), DIRECT_ALIGN, last);
+		}
+
+		memcpy(direct_bounce + (direct_cur - start), src, len);
+		write_full(direct_bounce, end - start, start);
+	}
+
+	direct_cur += len;
+}
+
+
+static uint8_t direct_read(void)
+{
+	uint8_t b = 0;
+	direct_load(&b, 1);
+	return b;
+}
+
+
+static void direct_write(const uint8_t b)
+{
+	direct_store(&b, 1);
+}
+
+
+static void direct_flush(void)
+{
+	// no buffer here, but the device may still cache the writes
+	if (fdatasync(direct_fd) != 0) direct_failed = true;
+}
+
+
+static void direct_discard(const uint32_t addr, const uint32_t len)
+{
+	fallocate(direct_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, addr, len);
+}
+
+
+const BLOCKDEV* direct_open(const char* path)
+{
+	if (direct_fd >= 0) return NULL; // already open
+
+	direct_fd = open(path, O_RDWR | O_DIRECT);
+	if (direct_fd < 0) return NULL;
+
+	direct_failed = false;
+
+	direct.load = &direct_load;
+	direct.store = &direct_store;
+	direct.read = &direct_read;
+	direct.write = &direct_write;
+	direct.seek = &direct_seek;
+	direct.rseek = &direct_rseek;
+	direct.flush = &direct_flush;
+	direct.discard = &direct_discard;
+
+	return &direct;
+}
+
+
+bool direct_failed_io(void)
+{
+	return direct_failed;
+}
+
+
+void direct_close(void)
+{
+	if (direct_fd < 0) return;
+
+	close(direct_fd);
+	direct_fd = -1;
+}
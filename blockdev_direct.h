@@ -0,0 +1,56 @@
+#pragma once
+
+//
+// Direct I/O block device backed by an image file or a disk (Linux).
+//
+// The file is opened with O_DIRECT, so nothing goes through the page
+// cache. Loads and stores that are aligned to DIRECT_ALIGN (buffer,
+// address and length) go straight to / from the caller's memory;
+// others go through a bounce buffer, with read-modify-write of the
+// partial blocks at both ends of a store.
+//
+// The cursor and the bounce buffer are thread-local, like in the
+// positional-I/O backend. Nothing is cached between calls, so small
+// metadata accesses each cost a device round trip - the backend pays
+// off for bulk file data, which ff_read() / ff_write() pass down in
+// runs of contiguous clusters.
+//
+
+#include <stdbool.h>
+
+#include "blockdev.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/** Alignment required by O_DIRECT (logical block size of the device) */
+#ifndef DIRECT_ALIGN
+#define DIRECT_ALIGN 4096
+#endif
+
+
+/**
+ * Open an image file (or a block device) for direct I/O.
+ * Returns the block device, or NULL on failure - also when the
+ * file system does not support O_DIRECT (eg. tmpfs).
+ *
+ * Only one image can be open at a time.
+ */
+const BLOCKDEV* direct_open(const char* path);
+
+
+/**
+ * Check if a load, store or flush failed since the image was opened.
+ * Loads that fail (or run past the end of the image) read as zeros.
+ */
+bool direct_failed_io(void);
+
+
+/** Close the image file. */
+void direct_close(void);
+
+#ifdef __cplusplus
+}
+#endif
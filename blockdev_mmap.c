@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "blockdev_mmap.h"
+
+
+static BLOCKDEV mm;
+static uint8_t* mm_base;
+static size_t mm_size;
+
+/** Cursor, one per thread */
+static __thread uint32_t mm_cur;
+
+
+static void mm_seek(const uint32_t addr)
+{
+	mm_cur = addr;
+}
+
+
+static void mm_rseek(const int16_t offset)
+{
+	mm_cur += offset;
+}
+
+
+static void mm_load(void* dest, const uint16_t len)
+{
+	if (mm_cur + len <= mm_size)
+		memcpy(dest, mm_base + mm_cur, len);
+
+	mm_cur += len;
+}
+
+
+static void mm_store(const void* src, const uint16_t len)
+{
+	if (mm_cur + len <= mm_size)
+		memcpy(mm_base + mm_cur, src, len);
+
+	mm_cur += len;
+}
+
+
+static uint8_t mm_read(void)
+{
+	uint8_t b = 0;
+	mm_load(&b, 1);
+	return b;
+}
+
+
+static void mm_write(const uint8_t b)
+{
+	mm_store(&b, 1);
+}
+
+
+static void mm_flush(void)
+{
+	// the page cache takes care of it
+}
+
+
+static void mm_discard(const uint32_t addr, const uint32_t len)
+{
+	// whole pages only - the partial ones at the ends are kept
+	const size_t page = sysconf(_SC_PAGESIZE);
+	const size_t start = (addr + page - 1) / page * page;
+	const size_t end = ((size_t) addr + len) / page * page;
+
+	if (end > start) madvise(mm_base + start, end - start, MADV_REMOVE);
+}
+
+
+const BLOCKDEV* mmap_open(const char* path)
+{
+	if (mm_base != NULL) return NULL; // already open
+
+	const int fd = open(path, O_RDWR);
+	if (fd < 0) return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	void* base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd); // the mapping keeps the file open
+
+	if (base == MAP_FAILED) return NULL;
+
+	mm_base = base;
+	mm_size = st.st_size;
+
+	mm.load = &mm_load;
+	mm.store = &mm_store;
+	mm.read = &mm_read;
+	mm.write = &mm_write;
+	mm.seek = &mm_seek;
+	mm.rseek = &mm_rseek;
+	mm.flush = &mm_flush;
+	mm.discard = &mm_discard;
+
+	return &mm;
+}
+
+
+void mmap_close(void)
+{
+	if (mm_base == NULL) return;
+
+	msync(mm_base, mm_size, MS_SYNC);
+	munmap(mm_base, mm_size);
+	mm_base = NULL;
+}
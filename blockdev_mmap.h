@@ -0,0 +1,32 @@
+#pragma once
+
+//
+// Memory-mapped block device backed by an image file (POSIX hosts).
+//
+// The cursor is thread-local, like in the positional-I/O backend.
+//
+
+#include <stdbool.h>
+
+#include "blockdev.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/**
+ * Map an image file.
+ * Returns the block device, or NULL on failure.
+ *
+ * Only one image can be mapped at a time.
+ */
+const BLOCKDEV* mmap_open(const char* path);
+
+
+/** Unmap the image, writing back changes. */
+void mmap_close(void);
+
+#ifdef __cplusplus
+}
+#endif
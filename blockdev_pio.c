@@ -0,0 +1,138 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "blockdev_pio.h"
+
+
+static BLOCKDEV pio;
+static int pio_fd = -1;
+
+/** Set when a transfer failed, until the image is closed */
+static volatile bool pio_failed;
+
+/** Cursor, one per thread */
+static __thread uint32_t pio_cur;
+
+
+static void pio_seek(const uint32_t addr)
+{
+	pio_cur = addr;
+}
+
+
+static void pio_rseek(const int16_t offset)
+{
+	pio_cur += offset;
+}
+
+
+static void pio_load(void* dest, const uint16_t len)
+{
+	uint16_t done = 0;
+	while (done < len)
+	{
+		const ssize_t n = pread(pio_fd, (uint8_t*) dest + done, len - done, pio_cur + done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0)
+		{
+			// past the end, or an error - don't leave the old bytes there
+			if (n < 0) pio_failed = true;
+			memset((uint8_t*) dest + done, 0, len - done);
+			break;
+		}
+
+		done += n;
+	}
+
+	pio_cur += len;
+}
+
+
+static void pio_store(const void* src, const uint16_t len)
+{
+	uint16_t done = 0;
+	while (done < len)
+	{
+		const ssize_t n = pwrite(pio_fd, (const uint8_t*) src + done, len - done, pio_cur + done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0)
+		{
+			pio_failed = true;
+			break;
+		}
+
+		done += n;
+	}
+
+	pio_cur += len;
+}
+
+
+static uint8_t pio_read(void)
+{
+	uint8_t b = 0;
+	pio_load(&b, 1);
+	return b;
+}
+
+
+static void pio_write(const uint8_t b)
+{
+	pio_store(&b, 1);
+}
+
+
+static void pio_flush(void)
+{
+	// no buffer, writes go straight to the file
+}
+
+
+static void pio_discard(const uint32_t addr, const uint32_t len)
+{
+	// punch a hole, the image stays the same size
+	fallocate(pio_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, addr, len);
+}
+
+
+const BLOCKDEV* pio_open(const char* path)
+{
+	if (pio_fd >= 0) return NULL; // already open
+
+	pio_fd = open(path, O_RDWR);
+	if (pio_fd < 0) return NULL;
+
+	pio_failed = false;
+
+	pio.load = &pio_load;
+	pio.store = &pio_store;
+	pio.read = &pio_read;
+	pio.write = &pio_write;
+	pio.seek = &pio_seek;
+	pio.rseek = &pio_rseek;
+	pio.flush = &pio_flush;
+	pio.discard = &pio_discard;
+
+	return &pio;
+}
+
+
+bool pio_failed_io(void)
+{
+	return pio_failed;
+}
+
+
+void pio_close(void)
+{
+	if (pio_fd < 0) return;
+
+	close(pio_fd);
+	pio_fd = -1;
+}
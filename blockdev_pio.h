@@ -0,0 +1,42 @@
+#pragma once
+
+//
+// Positional-I/O block device backed by an image file (POSIX hosts).
+//
+// All I/O is done with pread() / pwrite(), and the cursor is
+// thread-local, so every thread gets its own independent "handle"
+// on the shared image. This allows several threads to work with
+// one volume at once (eg. using ff_walk()).
+//
+
+#include <stdbool.h>
+
+#include "blockdev.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/**
+ * Open an image file.
+ * Returns the block device, or NULL on failure.
+ *
+ * Only one image can be open at a time.
+ */
+const BLOCKDEV* pio_open(const char* path);
+
+
+/**
+ * Check if a load or store failed since the image was opened.
+ * Loads that fail (or run past the end of the image) read as zeros.
+ */
+bool pio_failed_io(void);
+
+
+/** Close the image file. */
+void pio_close(void);
+
+#ifdef __cplusplus
+}
+#endif
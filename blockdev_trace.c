@@ -0,0 +1,167 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "blockdev_trace.h"
+
+
+static BLOCKDEV tr;
+static const BLOCKDEV* tr_inner;
+static TRACE_SINK tr_sink;
+static uint8_t tr_flags;
+
+/** Tracked cursor, for relative encoding of seeks */
+static uint32_t tr_cur;
+
+static uint8_t tr_buf[64];
+static uint8_t tr_len;
+
+
+void trace_flush(void)
+{
+	if (tr_len > 0)
+	{
+		tr_sink(tr_buf, tr_len);
+		tr_len = 0;
+	}
+}
+
+
+static void put_byte(const uint8_t b)
+{
+	if (tr_len == sizeof(tr_buf)) trace_flush();
+	tr_buf[tr_len++] = b;
+}
+
+
+static void put_varint(uint32_t v)
+{
+	while (v >= 0x80)
+	{
+		put_byte((v & 0x7F) | 0x80);
+		v >>= 7;
+	}
+
+	put_byte(v);
+}
+
+
+static void put_zigzag(const int32_t v)
+{
+	put_varint(((uint32_t) v << 1) ^ (uint32_t)(v >> 31));
+}
+
+
+static void tr_seek(const uint32_t addr)
+{
+	put_byte('s');
+	put_zigzag((int32_t)(addr - tr_cur));
+	tr_cur = addr;
+
+	tr_inner->seek(addr);
+}
+
+
+static void tr_rseek(const int16_t offset)
+{
+	put_byte('r');
+	put_zigzag(offset);
+	tr_cur += offset;
+
+	tr_inner->rseek(offset);
+}
+
+
+static void tr_load(void* dest, const uint16_t len)
+{
+	put_byte('l');
+	put_varint(len);
+	tr_cur += len;
+
+	tr_inner->load(dest, len);
+}
+
+
+static void tr_store(const void* src, const uint16_t len)
+{
+	put_byte('t');
+	put_varint(len);
+
+	if (tr_flags & TRACE_DATA)
+	{
+		for (uint16_t i = 0; i < len; i++)
+		{
+			put_byte(((const uint8_t*) src)[i]);
+		}
+	}
+
+	tr_cur += len;
+
+	tr_inner->store(src, len);
+}
+
+
+static uint8_t tr_read(void)
+{
+	put_byte('g');
+	tr_cur++;
+
+	return tr_inner->read();
+}
+
+
+static void tr_write(const uint8_t b)
+{
+	put_byte('p');
+	if (tr_flags & TRACE_DATA) put_byte(b);
+	tr_cur++;
+
+	tr_inner->write(b);
+}
+
+
+static void tr_flush_dev(void)
+{
+	put_byte('f');
+
+	tr_inner->flush();
+}
+
+
+static void tr_discard(const uint32_t addr, const uint32_t len)
+{
+	put_byte('d');
+	put_varint(addr);
+	put_varint(len);
+
+	tr_inner->discard(addr, len);
+}
+
+
+const BLOCKDEV* trace_wrap(const BLOCKDEV* inner, TRACE_SINK sink, const uint8_t flags)
+{
+	tr_inner = inner;
+	tr_sink = sink;
+	tr_flags = flags;
+	tr_cur = 0;
+	tr_len = 0;
+
+	tr.load = &tr_load;
+	tr.store = &tr_store;
+	tr.read = &tr_read;
+	tr.write = &tr_write;
+	tr.seek = &tr_seek;
+	tr.rseek = &tr_rseek;
+	tr.flush = &tr_flush_dev;
+	tr.discard = (inner->discard != NULL) ? &tr_discard : NULL;
+
+	// header
+	put_byte('F');
+	put_byte('F');
+	put_byte('T');
+	put_byte('R');
+	put_byte(TRACE_VERSION);
+	put_byte(flags);
+
+	return &tr;
+}
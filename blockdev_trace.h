@@ -0,0 +1,56 @@
+#pragma once
+
+//
+// Tracing block device - records all calls of another block device
+// into a compact binary trace, which can be replayed with "replay".
+//
+// Trace format:
+//
+//   header: "FFTR", version (1 byte), flags (1 byte)
+//
+//   records: opcode byte, followed by arguments:
+//     's' seek  - zigzag varint: address minus the current cursor
+//     'r' rseek - zigzag varint: offset
+//     'l' load  - varint: length
+//     't' store - varint: length, [data if TRACE_DATA]
+//     'g' read  - (no arguments)
+//     'p' write - [data byte if TRACE_DATA]
+//     'f' flush - (no arguments)
+//     'd' discard - varint: address, varint: length
+//
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "blockdev.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/** Flag: record data of writes, for exact replays */
+#define TRACE_DATA 0x01
+
+#define TRACE_VERSION 2
+
+
+/** Trace output, receives the trace in chunks */
+typedef void (*TRACE_SINK)(const void* data, const uint16_t len);
+
+
+/**
+ * Start tracing a block device.
+ * Returns the tracing device, to be used instead of "inner".
+ *
+ * Only one device can be traced at a time.
+ */
+const BLOCKDEV* trace_wrap(const BLOCKDEV* inner, TRACE_SINK sink, const uint8_t flags);
+
+
+/** Pass buffered records to the sink */
+void trace_flush(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -4,6 +4,14 @@
 
 #include "fat16.h"
 
+#if FF_USE_STATS
+#include <stdio.h>
+#endif
+
+#if FF_USE_SIMD && (defined(__AVX2__) || defined(__SSE2__))
+#include <immintrin.h>
+#endif
+
 
 
 // ============== INTERNAL PROTOTYPES ==================
@@ -11,32 +19,65 @@
 /** Read boot sector from given address */
 void read_bs(const BLOCKDEV* dev, Fat16BootSector* info, const uint32_t addr);
 
-/** Find absolute address of first BootSector. Returns 0 on failure. */
-uint32_t find_bs(const BLOCKDEV* dev);
+/** Find FAT partitions, or the one with given index (want != 0xFF) */
+uint8_t find_parts(const BLOCKDEV* dev, FFPART* parts, const uint8_t max, const uint8_t want);
 
 /** Get cluster's starting address */
-uint32_t clu_addr(const FAT16* fat, const uint16_t cluster);
+uint32_t clu_addr(const FAT16* fat, const uint32_t cluster);
 
 /** Find following cluster using FAT for jumps */
-uint16_t next_clu(const FAT16* fat, uint16_t cluster);
+uint32_t next_clu(const FAT16* fat, uint32_t cluster);
 
 /** Find relative address in a file, using FAT for cluster lookup */
-uint32_t clu_offs(const FAT16* fat, uint16_t cluster, uint32_t addr);
+uint32_t clu_offs(const FAT16* fat, uint32_t cluster, uint32_t addr);
+
+/**
+ * Measure a run of clusters contiguous on the device, following "clu".
+ * Returns how many bytes of "want" it covers (at most "room"), and the last cluster.
+ */
+uint32_t clu_run(const FAT16* fat, uint32_t clu, const uint32_t want, const uint32_t room, uint32_t* last);
 
 /** Read a file entry from directory (dir starting cluster, entry number) */
-void open_file(const FAT16* fat, FFILE* file, const uint16_t dir_cluster, const uint16_t num);
+void open_file(const FAT16* fat, FFILE* file, const uint32_t dir_cluster, const uint16_t num);
+
+/** Read a file entry, with the directory cluster holding it already known */
+void open_entry(const FAT16* fat, FFILE* file, const uint32_t dir_cluster, const uint16_t num, const uint32_t ent_clu);
+
+/** Find the directory cluster holding entry "num". Returns CLU_END past the chain end. */
+uint32_t dir_entry_clu(const FAT16* fat, uint32_t dir_cluster, const uint16_t num);
+
+/** Get absolute address of a directory entry in a known cluster */
+uint32_t dir_entry_addr(const FAT16* fat, const uint32_t dir_cluster, const uint16_t num, const uint32_t ent_clu);
 
-/** Allocate and chain new cluster to a chain starting at given cluster */
-bool append_cluster(const FAT16* fat, const uint16_t clu);
+/** Allocate and chain new cluster to a chain ending at given cluster */
+bool append_cluster(const FAT16* fat, const uint32_t clu);
 
-/** Allocate a new cluster, clean it, and mark with 0xFFFF in FAT */
-uint16_t alloc_cluster(const FAT16* fat);
+/**
+ * Move file cursor, allocating clusters as needed.
+ * With "at_end", a cursor at EOF right after the last cluster stays in that
+ * cluster; otherwise the cluster holding byte "addr" is always allocated.
+ */
+bool seek_file(FFILE* file, uint32_t addr, const bool at_end);
+
+/** Find a run of "len" free clusters, starting at "from" (wraps around) */
+uint32_t find_free_run(const FAT16* fat, const uint32_t len, const uint32_t from);
+
+#if FF_USE_SIDECAR
+/** Set or clear the clean bit of the volume (FAT[1]) */
+static void sc_set_clean(const FAT16* fat, const bool clean);
+
+/** Load the mount sidecar, or rebuild what it holds */
+static void sc_open(const FAT16* fat);
+#endif
+
+/** Allocate a new cluster, clean it, and mark it as the end of a chain */
+uint32_t alloc_cluster(const FAT16* fat);
 
 /** Zero out entire cluster. */
-void wipe_cluster(const FAT16* fat, const uint16_t clu);
+void wipe_cluster(const FAT16* fat, const uint32_t clu);
 
 /** Free cluster chain, starting at given number */
-bool free_cluster_chain(const FAT16* fat, uint16_t clu);
+bool free_cluster_chain(const FAT16* fat, uint32_t clu);
 
 /**
  * Check if there is already a file of given RAW name
@@ -44,1210 +85,6305 @@ bool free_cluster_chain(const FAT16* fat, uint16_t clu);
  */
 bool dir_find_file_raw(FFILE* dir, const char* fname);
 
-/** Write a value into FAT */
-void write_fat(const FAT16* fat, const uint16_t cluster, const uint16_t value);
-
-/** Read a value from FAT */
-uint16_t read_fat(const FAT16* fat, const uint16_t cluster);
-
+/** Find a file by display name (or long name) in an open directory */
+bool dir_find_name(FFILE* dir, const char* name);
 
-// =========== INTERNAL FUNCTION IMPLEMENTATIONS =========
+/** Write a value into FAT (CLU_END = end of chain) */
+void write_fat(const FAT16* fat, const uint32_t cluster, const uint32_t value);
 
+/** Read a value from FAT (end of chain marks are returned as CLU_END) */
+uint32_t read_fat(const FAT16* fat, const uint32_t cluster);
 
-uint16_t read16(const BLOCKDEV* dev)
-{
-	uint16_t a;
-	dev->load(&a, 2);
-	return a;
-}
+/** Number of data clusters of the volume */
+uint32_t cluster_count(const FAT16* fat);
 
+/** Start cluster of the root directory (0 = FAT16 fixed root directory) */
+uint32_t root_dir(const FAT16* fat);
 
-void write16(const BLOCKDEV* dev, const uint16_t val)
-{
-	dev->store(&val, 2);
-}
+#if FF_MAX_DIRTY > 0
+/** Store pending sizes of written files (no device flush) */
+uint16_t sync_dirty(const FAT16* fat);
+#endif
 
-/** Find absolute address of first boot sector. Returns 0 on failure. */
-uint32_t find_bs(const BLOCKDEV* dev)
-{
-	//  Reference structure:
-	//
-	//  typedef struct __attribute__((packed)) {
-	//      uint8_t first_byte;
-	//      uint8_t start_chs[3];
-	//      uint8_t partition_type;
-	//      uint8_t end_chs[3];
-	//      uint32_t start_sector;
-	//      uint32_t length_sectors;
-	//  } PartitionTable;
+/** Free all clusters of a detached directory tree, with the FAT in memory */
+bool delete_tree_batch(const FAT16* fat, const uint32_t top);
 
-	uint16_t addr = 0x1BE + 4; // fourth byte of structure is the type.
-	uint32_t tmp = 0;
-	uint16_t tmp2;
 
-	for (uint8_t i = 0; i < 4; i++, addr += 16)
-	{
-		// Read partition type
-		dev->seek(addr);
-		tmp = dev->read();
+/** End of a cluster chain, or no cluster (any FAT type) */
+#define CLU_END 0xFFFFFFFF
 
-		// Check if type is valid
-		if (tmp == 4 || tmp == 6 || tmp == 14)
-		{
-			// read MBR address
-			dev->rseek(3);// skip 3 bytes
-			dev->load(&tmp, 4);
+/** Bad cluster mark in the FAT */
+#define CLU_BAD(fat) ((fat)->bs.fat32 ? 0x0FFFFFF7 : 0xFFF7)
 
-			tmp = tmp << 9; // multiply address by 512 (sector size)
+/** Size of a FAT entry in bytes */
+#define FAT_ENT(fat) ((fat)->bs.fat32 ? 4 : 2)
 
-			// Verify that the boot sector has a valid signature mark
-			dev->seek(tmp + 510);
-			dev->load(&tmp2, 2);
-			if (tmp2 != 0xAA55)
-			{
-				continue; // continue to next entry
-			}
+/** Case bits of a short name entry (byte 12), as used by Windows NT */
+#define SFN_LOWER_BASE 0x08 // base name is lower case
+#define SFN_LOWER_EXT  0x10 // extension is lower case
 
-			// return absolute MBR address
-			return tmp;
-		}
-	}
 
-	return 0;
+static inline uint32_t get_le32(const uint8_t* p)
+{
+	return p[0] | (p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
 }
 
 
-/** Read the boot sector */
-void read_bs(const BLOCKDEV* dev, Fat16BootSector* info, const uint32_t addr)
+static inline void set_le32(uint8_t* p, const uint32_t v)
 {
-	dev->seek(addr + 13); // skip 13
-
-	dev->load(&(info->sectors_per_cluster), 6); // spc, rs, nf, re
-
-	info->total_sectors = 0;
-	dev->load(&(info->total_sectors), 2); // short sectors
-
-	dev->rseek(1); // md
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
 
-	dev->load(&(info->fat_size_sectors), 2);
 
-	dev->rseek(8); // spt, noh, hs
+#if FF_USE_JOURNAL || FF_USE_SIDECAR
 
-	// read or skip long sectors field
-	if (info->total_sectors == 0)
-	{
-		dev->load(&(info->total_sectors), 4);
-	}
-	else
+static uint32_t crc32_update(uint32_t crc, const uint8_t* buf, const uint32_t len)
+{
+	crc = ~crc;
+	for (uint32_t i = 0; i < len; i++)
 	{
-		dev->rseek(4); // tsl
+		crc ^= buf[i];
+		for (uint8_t k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
 	}
 
-	dev->rseek(7); // dn, ch, bs, vi
-
-	dev->load(&(info->volume_label), 11);
+	return ~crc;
 }
 
+#endif
 
-void write_fat(const FAT16* fat, const uint16_t cluster, const uint16_t value)
-{
-	fat->dev->seek(fat->fat_addr + (cluster * 2));
-	write16(fat->dev, value);
-}
 
+// =============== ACCESS COUNTERS ==================
 
-uint16_t read_fat(const FAT16* fat, const uint16_t cluster)
-{
-	fat->dev->seek(fat->fat_addr + (cluster * 2));
-	return read16(fat->dev);
-}
-
+#if FF_USE_STATS
 
-/** Get cluster starting address */
-uint32_t clu_addr(const FAT16* fat, const uint16_t cluster)
-{
-	if (cluster < 2) return fat->rd_addr;
-	return fat->data_addr + (cluster - 2) * fat->bs.bytes_per_cluster;
-}
+/** Add to a counter of the volume, and of the current operation */
+#define STAT_ADD(fat, field, n) do { \
+		FAT16* _f = (FAT16*) (fat); /* counters are runtime state */ \
+		_f->stats.field += (n); \
+		if (_f->op != FF_OP_NONE) { \
+			_f->op_stats[_f->op].field += (n); \
+			_f->last_stats.field += (n); \
+		} \
+	} while (0)
 
 
-uint16_t next_clu(const FAT16* fat, uint16_t cluster)
+/** Scope guard of a counted public call */
+typedef struct
 {
-	return read_fat(fat, cluster);
-}
+	FAT16* fat;
+	uint8_t prev;
+} StatGuard;
 
 
-/** Find file-relative address in fat table */
-uint32_t clu_offs(const FAT16* fat, uint16_t cluster, uint32_t addr)
+static StatGuard stat_enter(const FAT16* fat, const FF_OP op)
 {
-	while (addr >= fat->bs.bytes_per_cluster)
+	StatGuard g = { (FAT16*) fat, fat->op };
+
+	// nested calls count towards the outer one
+	if (fat->op == FF_OP_NONE)
 	{
-		cluster = next_clu(fat, cluster);
-		if (cluster == 0xFFFF) return 0xFFFF; // fail
-		addr -= fat->bs.bytes_per_cluster;
+		g.fat->op = op;
+		g.fat->last_op = op;
+		g.fat->op_stats[op].calls++;
+		g.fat->last_stats = (FFSTATS) { .calls = 1 };
 	}
 
-	return clu_addr(fat, cluster) + addr;
+	return g;
 }
 
 
-/**
- * Zero out entire cluster
- * This is important only for directory clusters, so we can
- * zero only every first byte of each file entry, to indicate
- * that it is unused (FT_NONE).
- */
-void wipe_cluster(const FAT16* fat, const uint16_t clu)
+static void stat_leave(StatGuard* g)
 {
-	uint32_t addr = clu_addr(fat, clu);
-
-	const BLOCKDEV* dev = fat->dev;
+	g->fat->op = g->prev;
+}
 
-	dev->seek(addr);
 
-	for (uint32_t b = 0; b < fat->bs.bytes_per_cluster; b += 32)
-	{
-		dev->write(0);
-		dev->rseek(32);
-	}
-}
+#define STAT_OP(fat, op) StatGuard _stat_guard __attribute__((cleanup(stat_leave))) = stat_enter((fat), (op))
 
+#else
 
-/** Allocate a new cluster, clean it, and mark with 0xFFFF in FAT */
-uint16_t alloc_cluster(const FAT16* fat)
-{
-	// find new unclaimed cluster that can be added to the chain.
-	uint16_t i, b;
-	for (i = 2; i < fat->bs.fat_size_sectors * 256; i++)
-	{
-		// read value from FAT
-		b = read_fat(fat, i);
-		if (b == 0) // unused cluster
-		{
-			// Write FFFF to "i", to mark end of file
-			write_fat(fat, i, 0xFFFF);
+#define STAT_ADD(fat, field, n)
+#define STAT_OP(fat, op)
 
-			// Wipe the cluster
-			wipe_cluster(fat, i);
+#endif
 
-			return i;
-		}
-	}
 
-	return 0xFFFF;//error code
-}
+// ============== JOURNAL ==================
 
+#if FF_USE_JOURNAL
 
-/** Allocate and chain new cluster to a chain starting at given cluster */
-bool append_cluster(const FAT16* fat, const uint16_t clu)
-{
-	uint16_t clu2 = alloc_cluster(fat);
-	if (clu2 == 0xFFFF) return false;
+//
+// Journal file layout:
+//   header sector: magic, commit number, records length, CRC32, state
+//   records: address (4), length (2), data
+//
 
-	// Write "i" to "clu"
-	write_fat(fat, clu, clu2);
+#define JR_MAGIC  0x524A4646 // "FFJR"
+#define JR_HEADER ((FF_PHYS_BLOCK > 512) ? FF_PHYS_BLOCK : 512) // records start on a block
+#define JR_REC    6   // record header size
 
-	return true;
-}
+/** Mutable runtime state of a volume */
+#define JR(fat) ((FAT16*) (fat))
 
 
-bool free_cluster_chain(const FAT16* fat, uint16_t clu)
+/**
+ * Merge pending records with a buffer at "addr".
+ * to_records = false: records are copied over the buffer (loaded data).
+ * to_records = true: the buffer is copied into the records (data written
+ * directly, so a replay won't put back the older bytes).
+ */
+static void jr_merge(const FAT16* fat, uint8_t* buf, const uint32_t addr, const uint16_t len, const bool to_records)
 {
-	if (clu < 2) return false;
+	uint8_t* rec = fat->jr_buf;
+	uint8_t* const end = rec + fat->jr_used;
 
-	do
+	while (rec < end)
 	{
-		// get address of the next cluster
-		const uint16_t clu2 = read_fat(fat, clu);
+		const uint32_t ra = get_le32(rec);
+		const uint16_t rl = rec[4] | (rec[5] << 8);
 
-		// mark cluster as unused
-		write_fat(fat, clu, 0x0000);
+		const uint32_t from = (addr > ra) ? addr : ra;
+		const uint32_t to = (addr + len < ra + rl) ? addr + len : ra + rl;
 
-		// advance
-		clu = clu2;
-	}
-	while (clu != 0xFFFF);
+		for (uint32_t a = from; a < to; a++)
+		{
+			uint8_t* r = rec + JR_REC + (a - ra);
 
-	return true;
+			if (to_records) *r = buf[a - addr];
+			else buf[a - addr] = *r;
+		}
+
+		rec += JR_REC + rl;
+	}
 }
 
 
-/**
- * Check if there is already a file of given RAW name
- * Raw name - name as found on disk, not "display name".
- */
-bool dir_find_file_raw(FFILE* dir, const char* fname)
+/** Write records to their places */
+static void jr_apply(const FAT16* fat, const uint8_t* rec, const uint32_t used)
 {
-	// rewind
-	ff_first(dir);
+	const uint8_t* const end = rec + used;
 
-	do
+	while (rec < end)
 	{
-		bool diff = false;
-		for (uint8_t i = 0; i < 11; i++)
-		{
-			if (dir->name[i] != fname[i])
-			{
-				diff = true;
-				break;
-			}
-		}
+		const uint16_t rl = rec[4] | (rec[5] << 8);
 
-		// found the right file?
-		if (!diff)
-		{
-			return true; // file is already open.
-		}
-	}
-	while (ff_next(dir));
+		fat->dev->seek(get_le32(rec));
+		fat->dev->store(rec + JR_REC, rl);
+		STAT_ADD(fat, bytes_stored, rl);
 
-	return false;
+		rec += JR_REC + rl;
+	}
 }
 
 
 /**
- * Read a file entry
- *
- * dir_cluster ... directory start cluster
- * num ... entry number in the directory
+ * Commit pending records: write them into the journal, flush,
+ * write them to their places, flush, and mark the journal clean.
  */
-void open_file(const FAT16* fat, FFILE* file, const uint16_t dir_cluster, const uint16_t num)
+static void jr_commit(const FAT16* fat)
 {
-	// Resolve starting address
-	uint32_t addr;
-	if (dir_cluster == 0)
-	{
-		addr = clu_addr(fat, dir_cluster) + num * 32; // root directory, max 512 entries.
-	}
-	else
-	{
-		addr = clu_offs(fat, dir_cluster, num * 32); // cluster + N (wrapping to next cluster if needed)
-	}
+	FAT16* f = JR(fat);
+	const BLOCKDEV* dev = fat->dev;
 
-	fat->dev->seek(addr);
-	fat->dev->load(file, 12); // name, ext, attribs
-	fat->dev->rseek(14); // skip 14 bytes
-	fat->dev->load(((void*)file) + 12, 6); // read remaining bytes
+	if (f->jr_used == 0) return;
 
-	file->clu = dir_cluster;
-	file->num = num;
+	f->jr_seq++;
 
-	// add a FAT pointer
-	file->fat = fat;
+	uint8_t head[20] = { 0 };
+	set_le32(head, JR_MAGIC);
+	set_le32(head + 4, f->jr_seq);
+	set_le32(head + 8, f->jr_used);
+	set_le32(head + 12, crc32_update(crc32_update(0, head + 4, 8), f->jr_buf, f->jr_used));
+	head[16] = 1; // committed
 
-	// Resolve filename & type
+	// 1. The journal. The CRC tells a torn commit from a complete one.
+	dev->seek(fat->jr_addr + JR_HEADER);
+	for (uint32_t done = 0; done < f->jr_used; done += 0x8000)
+	{
+		const uint32_t rest = f->jr_used - done;
+		dev->store(f->jr_buf + done, (rest < 0x8000) ? rest : 0x8000);
+	}
 
-	file->type = FT_FILE;
+	dev->seek(fat->jr_addr);
+	dev->store(head, sizeof(head));
+	dev->flush();
 
-	const uint8_t c = file->name[0];
-	switch (c)
-	{
-		case 0x00:
-			file->type = FT_NONE;
-			return;
+	STAT_ADD(fat, bytes_stored, f->jr_used + sizeof(head));
 
-		case 0xE5:
-			file->type = FT_DELETED;
-			return;
+	// 2. The changes
+	jr_apply(fat, f->jr_buf, f->jr_used);
+	dev->flush();
 
-		case 0x05: // Starting with 0xE5
-			file->type = FT_FILE;
-			file->name[0] = 0xE5; // convert to the real character
-			break;
+	// 3. Done, no need to replay
+	dev->seek(fat->jr_addr + 16);
+	dev->write(0);
 
-		case 0x2E:
-			if (file->name[1] == 0x2E)
-			{
-				// ".." directory
-				file->type = FT_PARENT;
-			}
-			else
-			{
-				// "." directory
-				file->type = FT_SELF;
-			}
-			break;
+	f->jr_used = 0;
+	f->jr_last = 0;
 
-		default:
-			if (c < 32)
-			{
-				file->type = FT_INVALID; // File is corrupt, treat it as invalid
-				return; // avoid trying to seek
-			}
-			else
-			{
-				file->type = FT_FILE;
-			}
-	}
+	// back to where the cursor should be
+	dev->seek(f->jr_pos);
+}
 
-	// handle subdir, label
-	if (file->attribs & FA_DIR && file->type == FT_FILE)
+
+/** Add a record of a store at the tracked cursor */
+static void jr_record(const FAT16* fat, const uint8_t* src, const uint16_t len)
+{
+	FAT16* f = JR(fat);
+	const uint32_t room = fat->jr_size - JR_HEADER;
+
+	if (JR_REC + (uint32_t) len > room)
 	{
-		file->type = FT_SUBDIR;
+		// can't be journaled, write it after the pending ones
+		jr_commit(fat);
+		fat->dev->store(src, len);
+		return;
 	}
-	else if (file->attribs == FA_LABEL)
+
+	// Continue the last record, if this store follows it
+	uint8_t* last = f->jr_buf + f->jr_last;
+	const uint16_t last_len = last[4] | (last[5] << 8);
+
+	if (f->jr_used > 0 && get_le32(last) + last_len == f->jr_pos &&
+			(uint32_t) last_len + len <= 0xFFFF && f->jr_used + len <= room)
 	{
-		file->type = FT_LABEL; // volume label special file
-		return; // do not seek
+		for (uint16_t i = 0; i < len; i++) f->jr_buf[f->jr_used + i] = src[i];
+
+		last[4] = (last_len + len) & 0xFF;
+		last[5] = (last_len + len) >> 8;
+		f->jr_used += len;
 	}
-	else if (file->attribs == 0x0F)
+	else
 	{
-		file->type = FT_LFN; // long name special file, can be ignored
-		return; // do not seek
+		if (f->jr_used + JR_REC + len > room)
+			jr_commit(fat); // full, commit what's there
+
+		uint8_t* rec = f->jr_buf + f->jr_used;
+		set_le32(rec, f->jr_pos);
+		rec[4] = len & 0xFF;
+		rec[5] = len >> 8;
+		for (uint16_t i = 0; i < len; i++) rec[JR_REC + i] = src[i];
+
+		f->jr_last = f->jr_used;
+		f->jr_used += JR_REC + len;
 	}
 
-	// Init cursors
-	ff_seek(file, 0);
+	// the device cursor moves as if it was written
+	fat->dev->seek(f->jr_pos + len);
 }
 
 
-
 /**
- * Write information into a file header.
- * "file" is an open handle.
+ * Check if a cluster, free in the pending records, is still used on
+ * the device (freed in the open transaction). It must not get new
+ * contents before the commit - a crash would bring the old file back.
  */
-void write_file_header(FFILE* file, const char* fname_raw, const uint8_t attribs, const uint16_t clu_start)
+static bool jr_held(const FAT16* fat, const uint32_t clu)
 {
-	const BLOCKDEV* dev = file->fat->dev;
+	uint32_t v = 0;
+	fat->dev->seek(fat->fat_addr + clu * FAT_ENT(fat));
+	fat->dev->load(&v, FAT_ENT(fat));
+	fat->dev->seek(fat->jr_pos);
 
-	const uint32_t entrystart = clu_offs(file->fat, file->clu, file->num * 32);
+	return (v & 0x0FFFFFFF) != 0;
+}
 
-	// store the file name
-	dev->seek(entrystart);
-	dev->store(fname_raw, 11);
 
-	// attributes
-	dev->write(attribs);
+/** Find the journal file, and complete an interrupted commit */
+static void jr_open(const FAT16* fat);
 
-	// 10 reserved, 2+2 date & time
-	// (could just skip, but better to fill with zeros)
-	for (uint8_t i = 0; i < 14; i++)
-	{
-		dev->write(0);
-	}
+#endif // FF_USE_JOURNAL
 
-	// addr of the first file cluster
-	write16(dev, clu_start);
 
-	// file size (uint32_t)
-	write16(dev, 0);
-	write16(dev, 0);
+// ============== DEVICE ACCESS ==================
 
-	// reopen file - load & parse the information just written
-	open_file(file->fat, file, file->clu, file->num);
+// During a transaction, the cursor is tracked, stores are kept in the
+// journal records, and loads see the pending records.
+
+static inline void dev_seek(const FAT16* fat, const uint32_t addr)
+{
+	STAT_ADD(fat, seeks, 1);
+#if FF_USE_JOURNAL
+	if (fat->jr_buf) JR(fat)->jr_pos = addr;
+#endif
+	fat->dev->seek(addr);
 }
 
 
+static inline void dev_rseek(const FAT16* fat, const int16_t offset)
+{
+	STAT_ADD(fat, seeks, 1);
+#if FF_USE_JOURNAL
+	if (fat->jr_buf) JR(fat)->jr_pos += offset;
+#endif
+	fat->dev->rseek(offset);
+}
 
-// =============== PUBLIC FUNCTION IMPLEMENTATIONS =================
 
-/** Initialize a FAT16 handle */
-bool ff_init(const BLOCKDEV* dev, FAT16* fat)
+static inline void dev_load(const FAT16* fat, void* dest, const uint16_t len)
 {
-	const uint32_t bs_a = find_bs(dev);
-
-	if (bs_a == 0) return false;
+	STAT_ADD(fat, bytes_loaded, len);
+	fat->dev->load(dest, len);
+#if FF_USE_JOURNAL
+	if (fat->jr_buf)
+	{
+		jr_merge(fat, dest, fat->jr_pos, len, false);
+		JR(fat)->jr_pos += len;
+	}
+#endif
+}
 
-	fat->dev = dev;
-	read_bs(dev, &(fat->bs), bs_a);
-	fat->fat_addr = bs_a + (fat->bs.reserved_sectors * 512);
-	fat->rd_addr = bs_a + (fat->bs.reserved_sectors + fat->bs.fat_size_sectors * fat->bs.num_fats) * 512;
-	fat->data_addr = fat->rd_addr + (fat->bs.root_entries * 32); // entry is 32B long
 
-	fat->bs.bytes_per_cluster = (fat->bs.sectors_per_cluster * 512);
+static inline void dev_store(const FAT16* fat, const void* src, const uint16_t len)
+{
+	STAT_ADD(fat, bytes_stored, len);
+#if FF_USE_JOURNAL
+	if (fat->jr_buf)
+	{
+		if (fat->jr_bypass)
+		{
+			jr_merge(fat, (uint8_t*) src, fat->jr_pos, len, true);
+			fat->dev->store(src, len);
+		}
+		else
+		{
+			jr_record(fat, src, len);
+		}
 
-	return true;
+		JR(fat)->jr_pos += len;
+		return;
+	}
+#endif
+	fat->dev->store(src, len);
 }
 
 
-/**
- * Move file cursor to a position relative to file start
- * Allows seek past end of file, will allocate new cluster if needed.
- */
-bool ff_seek(FFILE* file, uint32_t addr)
+static inline uint8_t dev_read(const FAT16* fat)
 {
-	const FAT16* fat = file->fat;
+#if FF_USE_JOURNAL
+	if (fat->jr_buf)
+	{
+		uint8_t b;
+		dev_load(fat, &b, 1);
+		return b;
+	}
+#endif
+	STAT_ADD(fat, bytes_loaded, 1);
+	return fat->dev->read();
+}
 
-	// Store as rel
-	file->cur_rel = addr;
-
-	// Rewind and resolve abs, clu, ofs
-	file->cur_clu = file->clu_start;
 
-	while (addr >= fat->bs.bytes_per_cluster)
+static inline void dev_write(const FAT16* fat, const uint8_t b)
+{
+#if FF_USE_JOURNAL
+	if (fat->jr_buf)
 	{
-		uint32_t next;
+		dev_store(fat, &b, 1);
+		return;
+	}
+#endif
+	STAT_ADD(fat, bytes_stored, 1);
+	fat->dev->write(b);
+}
 
-		// Go to next cluster, allocate if needed
-		do
-		{
-			next = next_clu(fat, file->cur_clu);
-			if (next == 0xFFFF)
-			{
-				// reached end of allocated space
-				// add one more cluster
-				if (!append_cluster(fat, file->cur_clu))
-				{
-					return false;
-				}
-			}
-		}
-		while (next == 0xFFFF);
 
-		file->cur_clu = next;
-		addr -= fat->bs.bytes_per_cluster;
+/** Store "len" zeros at the cursor, in bulk */
+static void dev_zero(const FAT16* fat, uint32_t len)
+{
+	static const uint8_t zeros[512];
+
+	while (len > 0)
+	{
+		const uint16_t chunk = (len > sizeof(zeros)) ? sizeof(zeros) : len;
+		dev_store(fat, zeros, chunk);
+		len -= chunk;
 	}
+}
 
-	file->cur_abs = clu_addr(fat, file->cur_clu) + addr;
-	file->cur_ofs = addr;
 
-	// Physically seek to that location
-	fat->dev->seek(file->cur_abs);
+// =========== INTERNAL FUNCTION IMPLEMENTATIONS =========
 
-	return true;
+
+uint16_t read16(const FAT16* fat)
+{
+	uint16_t a;
+	dev_load(fat, &a, 2);
+	return a;
 }
 
 
-/**
- * Check if file is a regular file or directory entry.
- * Those files can be shown to user.
- */
-bool ff_is_regular(const FFILE* file)
+void write16(const FAT16* fat, const uint16_t val)
 {
-	switch (file->type)
-	{
-		case FT_FILE:
-		case FT_SUBDIR:
-		case FT_SELF:
-		case FT_PARENT:
-			return true;
-
-		default:
-			return false;
-	}
+	dev_store(fat, &val, 2);
 }
 
+/** Check a partition table entry, and add it to the list if it holds a FAT16 or FAT32 volume */
+static bool add_part(const BLOCKDEV* dev, const uint8_t* pe, const uint32_t base, const uint8_t index,
+					 FFPART* parts, uint8_t* count, const uint8_t max, const uint8_t want)
+{
+	const uint8_t type = pe[4];
+
+	// Check if type is valid (FAT16: 4, 6, 14; FAT32: 11, 12)
+	if (type != 4 && type != 6 && type != 14 && type != 11 && type != 12)
+		return false;
 
-#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+	if (want != 0xFF && index != want)
+		return false;
 
-uint16_t ff_read(FFILE* file, void* target, uint16_t len)
-{
-	if (file->cur_abs == 0xFFFF)
-		return 0; // file at the end already
+	const uint32_t start = base + (pe[8] | (pe[9] << 8) | ((uint32_t) pe[10] << 16) | ((uint32_t) pe[11] << 24));
 
-	if (file->cur_rel + len > file->size)
+	// Verify that the boot sector has a valid signature mark
+	uint16_t sig;
+	dev->seek(start * FF_LBA_SIZE + 510);
+	dev->load(&sig, 2);
+	if (sig != 0xAA55)
+		return false;
+
+	if (*count < max)
 	{
-		if (file->cur_rel > file->size) return 0;
-		len = file->size - file->cur_rel;
-		//return false; // Attempt to read more than what is available
+		FFPART* p = &parts[*count];
+		p->index = index;
+		p->type = type;
+		p->start = start;
+		p->sectors = pe[12] | (pe[13] << 8) | ((uint32_t) pe[14] << 16) | ((uint32_t) pe[15] << 24);
 	}
 
-	const uint16_t len_orig = len;
+	(*count)++;
+	return true;
+}
 
-	const FAT16* fat = file->fat;
-	const BLOCKDEV* dev = fat->dev;
 
-	while (len > 0 && file->cur_rel < file->size)
+/**
+ * Find FAT partitions: primary ones (index 0-3) first, then logical
+ * ones in an extended partition (index 4 and up).
+ *
+ * want ... index of the one partition to find, or 0xFF for all
+ *
+ * Returns number found (can be more than "max", only "max" are stored).
+ */
+uint8_t find_parts(const BLOCKDEV* dev, FFPART* parts, const uint8_t max, const uint8_t want)
+{
+	//  Reference structure:
+	//
+	//  typedef struct __attribute__((packed)) {
+	//      uint8_t first_byte;
+	//      uint8_t start_chs[3];
+	//      uint8_t partition_type;
+	//      uint8_t end_chs[3];
+	//      uint32_t start_sector;
+	//      uint32_t length_sectors;
+	//  } PartitionTable;
+
+	uint8_t table[64];
+	uint8_t count = 0;
+	uint32_t ext = 0; // extended partition start
+
+	dev->seek(0x1BE);
+	dev->load(table, 64);
+
+	for (uint8_t i = 0; i < 4; i++)
 	{
-		// How much can be read from the cluster
-		uint16_t chunk = MIN(file->size - file->cur_rel, MIN(fat->bs.bytes_per_cluster - file->cur_ofs, len));
+		const uint8_t* pe = table + i * 16;
 
-		// read the chunk
-		dev->seek(file->cur_abs);
-		dev->load(target, chunk);
+		if (pe[4] == 0x05 || pe[4] == 0x0F)
+			ext = pe[8] | (pe[9] << 8) | ((uint32_t) pe[10] << 16) | ((uint32_t) pe[11] << 24);
+		else
+			add_part(dev, pe, 0, i, parts, &count, max, want);
+	}
 
-		// move the cursors
-		file->cur_abs += chunk;
-		file->cur_rel += chunk;
-		file->cur_ofs += chunk;
+	// Logical partitions: each EBR holds one, and a link to the next EBR
+	uint32_t ebr = ext;
+	for (uint8_t index = 4; ext != 0 && index < 64; index++)
+	{
+		dev->seek(ebr * FF_LBA_SIZE + 0x1BE);
+		dev->load(table, 32);
 
-		// move target pointer
-		target += chunk;
+		add_part(dev, table, ebr, index, parts, &count, max, want);
 
-		// reached end of cluster?
-		if (file->cur_ofs >= fat->bs.bytes_per_cluster)
-		{
-			file->cur_clu = next_clu(fat, file->cur_clu);
-			file->cur_abs = clu_addr(fat, file->cur_clu);
-			file->cur_ofs = 0;
-		}
+		const uint32_t next = table[24] | (table[25] << 8) | ((uint32_t) table[26] << 16) | ((uint32_t) table[27] << 24);
+		if (next == 0 || (table[20] != 0x05 && table[20] != 0x0F)) break;
 
-		// subtract read length
-		len -= chunk;
+		ebr = ext + next; // relative to the extended partition
 	}
 
-	return len_orig;
+	return count;
 }
 
 
-bool ff_write_str(FFILE* file, const char* source)
+/** Number of data clusters of a volume, from its boot sector */
+static uint32_t bs_clusters(const Fat16BootSector* bs)
 {
-	uint16_t len = 0;
-	for (; source[len] != 0; len++);
+	const uint16_t bps = bs->bytes_per_sector;
+	if (bps == 0 || bs->sectors_per_cluster == 0) return 0;
 
-	return ff_write(file, source, len);
+	const uint32_t root_secs = (bs->root_entries * 32 + bps - 1) / bps;
+	const uint32_t meta = bs->reserved_sectors + bs->fat_size_sectors * bs->num_fats + root_secs;
+	if (bs->total_sectors <= meta) return 0;
+
+	return (bs->total_sectors - meta) / bs->sectors_per_cluster;
 }
 
 
-bool ff_write(FFILE* file, const void* source, uint32_t len)
+/** Read the boot sector */
+void read_bs(const BLOCKDEV* dev, Fat16BootSector* info, const uint32_t addr)
 {
-	const FAT16* fat = file->fat;
-	const BLOCKDEV* dev = fat->dev;
+	uint8_t b[90];
 
+	dev->seek(addr);
+	dev->load(b, sizeof(b));
 
-	if (file->cur_abs == 0xFFFF)
-		return false; // file past it's end (rare)
+	info->bytes_per_sector = b[11] | (b[12] << 8);
+	info->sectors_per_cluster = b[13];
+	info->reserved_sectors = b[14] | (b[15] << 8);
+	info->num_fats = b[16];
+	info->root_entries = b[17] | (b[18] << 8);
 
-	// Attempt to write past end of file
-	if (file->cur_rel + len >= file->size)
-	{
-		const uint32_t pos_start = file->cur_rel;
+	// short sectors, or long if it's zero
+	info->total_sectors = b[19] | (b[20] << 8);
+	if (info->total_sectors == 0) info->total_sectors = get_le32(b + 32);
 
-		// Seek to the last position
-		// -> fseek will allocate clusters
-		if (!ff_seek(file, pos_start + len))
-			return false; // error in seek
+	// The 16-bit FAT size is zero in the FAT32 layout, which has
+	// the 32-bit size, root cluster and FSInfo sector after it.
+	info->fat_size_sectors = b[22] | (b[23] << 8);
 
-		// Write starts beyond EOF - creating a zero-filled "hole"
-		if (pos_start > file->size + 1)
-		{
-			// Seek to the end of valid data
-			ff_seek(file, file->size);
+	const bool layout32 = (info->fat_size_sectors == 0);
+	if (layout32)
+	{
+		info->fat_size_sectors = get_le32(b + 36);
+		info->root_cluster = get_le32(b + 44);
+		info->fsinfo_sector = b[48] | (b[49] << 8);
+	}
+	else
+	{
+		info->root_cluster = 0;
+		info->fsinfo_sector = 0;
+	}
 
-			// fill space between EOF and start-of-write with zeros
-			uint32_t fill = pos_start - file->size;
+	for (uint8_t i = 0; i < 11; i++)
+	{
+		info->volume_label[i] = b[(layout32 ? 71 : 43) + i];
+	}
 
-			// repeat until all "fill" zeros are stored
-			while (fill > 0)
-			{
-				// How much will fit into this cluster
-				const uint16_t chunk = MIN(fat->bs.bytes_per_cluster - file->cur_ofs, fill);
+	// the FAT type is given by the number of clusters
+	info->fat32 = (bs_clusters(info) >= 65525);
+}
 
-				// write the zeros
-				dev->seek(file->cur_abs);
-				for (uint16_t i = 0; i < chunk; i++)
-				{
-					dev->write(0);
-				}
 
-				// subtract from "needed" what was just placed
-				fill -= chunk;
+void write_fat(const FAT16* fat, const uint32_t cluster, const uint32_t value)
+{
+	STAT_ADD(fat, fat_writes, 1);
 
-				// advance cursors to the next cluster
-				file->cur_clu = next_clu(fat, file->cur_clu);
-				file->cur_abs = clu_addr(fat, file->cur_clu);
-				file->cur_ofs = 0;
-			}
-		}
+#if FF_USE_SIDECAR
+	if (fat->sc_clean) sc_set_clean(fat, false); // the sidecar is stale now
+#endif
 
-		// Store new size
-		file->size = pos_start + len;
+	if (fat->bs.fat32)
+	{
+		// the top 4 bits are reserved, and must be kept
+		uint32_t v;
+		dev_seek(fat, fat->fat_addr + (cluster * 4));
+		dev_load(fat, &v, 4);
+		v = (v & 0xF0000000) | (value & 0x0FFFFFFF);
+		dev_rseek(fat, -4);
+		dev_store(fat, &v, 4);
+		return;
+	}
 
-		// Seek back to where it was before
-		ff_seek(file, pos_start);
-	} // (end zerofill)
+	dev_seek(fat, fat->fat_addr + (cluster * 2));
+	write16(fat, value);
+}
 
 
-	// write the data
-	while (len > 0)
-	{
-		dev->seek(file->cur_abs);
-		uint16_t chunk;
+#if FF_MAX_DIRTY > 0
 
-		if (len == 1)
-		{
-			dev->write(*((uint8_t*)source));
-			file->cur_abs++;
-			file->cur_rel++;
-			file->cur_ofs++;
-			chunk = 1;
+/** Write up to 64 consecutive FAT entries, starting at "cluster", in one store */
+static void write_fat_run(const FAT16* fat, const uint32_t cluster, const uint32_t* values, const uint8_t count)
+{
+	STAT_ADD(fat, fat_writes, count);
 
-		}
-		else
-		{
-			// How much can be stored in this cluster
-			chunk = MIN(fat->bs.bytes_per_cluster - file->cur_ofs, len);
+#if FF_USE_SIDECAR
+	if (fat->sc_clean) sc_set_clean(fat, false); // the sidecar is stale now
+#endif
 
-			dev->store(source, chunk);
+	uint8_t buf[64 * 4];
+	const uint16_t len = count * FAT_ENT(fat);
 
-			// advance cursors
-			file->cur_abs += chunk;
-			file->cur_rel += chunk;
-			file->cur_ofs += chunk;
+	dev_seek(fat, fat->fat_addr + cluster * FAT_ENT(fat));
 
-			// Pointer arith!
-			source += chunk; // advance the source pointer
-		}
+	if (fat->bs.fat32)
+	{
+		// the top 4 bits are reserved, and must be kept
+		dev_load(fat, buf, len);
+		dev_rseek(fat, -len);
 
-		// detect cluster overflow
-		if (file->cur_ofs >= fat->bs.bytes_per_cluster)
+		for (uint8_t i = 0; i < count; i++)
+			set_le32(buf + i * 4, (get_le32(buf + i * 4) & 0xF0000000) | (values[i] & 0x0FFFFFFF));
+	}
+	else
+	{
+		for (uint8_t i = 0; i < count; i++)
 		{
-			// advance to following cluster
-			file->cur_clu = next_clu(fat, file->cur_clu);
-			file->cur_abs = clu_addr(fat, file->cur_clu);
-			file->cur_ofs = 0;
+			buf[i * 2] = values[i] & 0xFF;
+			buf[i * 2 + 1] = (values[i] >> 8) & 0xFF;
 		}
-
-		// subtract written length
-		len -= chunk;
 	}
 
-	return true;
+	dev_store(fat, buf, len);
 }
 
+#endif
 
 
-/** Open next file in the directory */
-bool ff_next(FFILE* file)
+uint32_t read_fat(const FAT16* fat, const uint32_t cluster)
 {
-	const FAT16* fat = file->fat;
-	const BLOCKDEV* dev = fat->dev;
-
-	if (file->clu == 0 && file->num >= fat->bs.root_entries)
-		return false; // attempt to read outside root directory.
-
-	const uint32_t addr = clu_offs(fat, file->clu, (file->num + 1) * 32);
-	if (addr == 0xFFFF)
-		return false; // next file is out of the directory cluster
+	STAT_ADD(fat, fat_reads, 1);
 
-	// read first byte of the file entry
-	dev->seek(addr);
-	if (dev->read() == 0)
-		return false; // can't read (file is NONE)
-
-	open_file(fat, file, file->clu, file->num + 1);
+	if (fat->bs.fat32)
+	{
+		uint32_t v;
+		dev_seek(fat, fat->fat_addr + (cluster * 4));
+		dev_load(fat, &v, 4);
+		v &= 0x0FFFFFFF;
+		return (v >= 0x0FFFFFF8) ? CLU_END : v;
+	}
 
-	return true;
+	dev_seek(fat, fat->fat_addr + (cluster * 2));
+	const uint16_t v = read16(fat);
+	return (v >= 0xFFF8) ? CLU_END : v;
 }
 
 
-/** Open previous file in the directory */
-bool ff_prev(FFILE* file)
+uint32_t root_dir(const FAT16* fat)
 {
-	if (file->num == 0)
-		return false; // first file already
-
-	open_file(file->fat, file, file->clu, file->num - 1);
-
-	return true;
+	return fat->bs.fat32 ? fat->bs.root_cluster : 0;
 }
 
 
-/** Rewind to first file in directory */
-void ff_first(FFILE* file)
+/** Start cluster of a raw directory entry */
+static uint32_t ent_start(const FAT16* fat, const uint8_t* ent)
 {
-	open_file(file->fat, file, file->clu, 0);
+	uint32_t clu = ent[26] | (ent[27] << 8);
+	if (fat->bs.fat32) clu |= ((uint32_t) ent[20] << 16) | ((uint32_t) ent[21] << 24);
+	return clu;
 }
 
 
-/** Open a directory denoted by the file. */
-bool ff_opendir(FFILE* dir)
+/** Store the start cluster of a directory entry at "addr" */
+static void write_ent_start(const FAT16* fat, const uint32_t addr, const uint32_t clu)
 {
-	// Don't open non-dirs and "." directory.
-	if (!(dir->attribs & FA_DIR) || dir->type == FT_SELF)
-		return false;
+	if (fat->bs.fat32)
+	{
+		dev_seek(fat, addr + 20);
+		write16(fat, clu >> 16);
+	}
 
-	open_file(dir->fat, dir, dir->clu_start, 0);
-	return true;
+	dev_seek(fat, addr + 26);
+	write16(fat, clu & 0xFFFF);
 }
 
 
-void ff_root(const FAT16* fat, FFILE* file)
+/** Start cluster to store in a ".." entry (the root directory is 0) */
+static inline uint32_t parent_ref(const FAT16* fat, const uint32_t dir)
 {
-	open_file(fat, file, 0, 0);
+	return (dir == root_dir(fat)) ? 0 : dir;
 }
 
 
-/**
- * Find a file with given "display name" in this directory.
- * If file is found, "dir" will contain it's handle.
- */
-bool ff_find(FFILE* file, const char* name)
+/** Get cluster starting address */
+uint32_t clu_addr(const FAT16* fat, const uint32_t cluster)
 {
-	// save orig pos
-	FSAVEPOS orig = ff_savepos(file);
-
-	char fname[11];
-	ff_rawname(name, fname);
-	bool ret = dir_find_file_raw(file, fname);
+	if (cluster < 2) return fat->rd_addr;
+	return fat->data_addr + (cluster - 2) * fat->bs.bytes_per_cluster;
+}
 
-	if (!ret)
-		ff_reopen(file, &orig);
 
-	return ret;
+uint32_t next_clu(const FAT16* fat, uint32_t cluster)
+{
+	STAT_ADD(fat, chain_steps, 1);
+	return read_fat(fat, cluster);
 }
 
 
-/** Go through a directory, and "open" first FT_NONE or FT_DELETED file entry. */
-bool find_empty_file_slot(FFILE* file)
+/** Find file-relative address in fat table */
+uint32_t clu_offs(const FAT16* fat, uint32_t cluster, uint32_t addr)
 {
-	const uint16_t clu = file->clu;
-	const FAT16* fat = file->fat;
+	while (addr >= fat->bs.bytes_per_cluster)
+	{
+		cluster = next_clu(fat, cluster);
+		if (cluster == CLU_END) return CLU_END; // fail
+		addr -= fat->bs.bytes_per_cluster;
+	}
+
+	return clu_addr(fat, cluster) + addr;
+}
+
+
+uint32_t clu_run(const FAT16* fat, uint32_t clu, const uint32_t want, const uint32_t room, uint32_t* last)
+{
+	const uint32_t limit = (want < room) ? want : room;
+	uint32_t got = 0;
 
-	// Find free directory entry that can be used
-	for (uint16_t num = 0; num < 0xFFFF; num++)
+	while (got < limit)
 	{
-		// root directory has fewer entries, error if trying
-		// to add one more.
-		if (file->clu == 0 && num >= fat->bs.root_entries)
-			return false;
+		const uint32_t next = next_clu(fat, clu);
+		if (next != clu + 1) break; // not adjacent
 
-		// Resolve addres of next file entry
-		uint32_t addr;
-		do
+		clu = next;
+		got += (limit - got < fat->bs.bytes_per_cluster) ? (limit - got) : fat->bs.bytes_per_cluster;
+	}
+
+	*last = clu;
+	return got;
+}
+
+
+/**
+ * Zero out entire cluster
+ * This is important only for directory clusters (all entries
+ * become FT_NONE). Stored in bulk, the whole cluster costs
+ * about as much as marking the entries one by one.
+ */
+void wipe_cluster(const FAT16* fat, const uint32_t clu)
+{
+	uint32_t addr = clu_addr(fat, clu);
+
+	dev_seek(fat, addr);
+
+#if FF_USE_JOURNAL
+	// the cluster is not in use yet, no need to journal it
+	JR(fat)->jr_bypass = true;
+#endif
+
+	dev_zero(fat, fat->bs.bytes_per_cluster);
+
+#if FF_USE_JOURNAL
+	JR(fat)->jr_bypass = false;
+#endif
+}
+
+
+#if FF_DISCARD_RANGES > 0
+
+/** Remember a freed cluster for discarding, merged with its neighbours */
+static void discard_add(const FAT16* fat, const uint32_t clu)
+{
+	if (fat->dev->discard == NULL) return;
+
+	FAT16* f = (FAT16*) fat; // runtime state
+
+	FFDISCARD* hit = NULL;
+
+	for (uint16_t i = 0; i < f->discard_count; i++)
+	{
+		FFDISCARD* r = &f->discard[i];
+
+		if (clu >= r->start && clu < r->start + r->count)
+			return; // already there
+
+		if (clu == r->start + r->count || clu + 1 == r->start)
+		{
+			if (clu < r->start) r->start = clu;
+			r->count++;
+			hit = r;
+			break;
+		}
+	}
+
+	if (hit != NULL)
+	{
+		// the gap between two ranges may be closed now
+		for (uint16_t i = 0; i < f->discard_count; i++)
 		{
-			addr = clu_offs(fat, file->clu, num * 32);
+			FFDISCARD* r = &f->discard[i];
+			if (r == hit) continue;
 
-			if (addr == 0xFFFF)
+			if (r->start == hit->start + hit->count || r->start + r->count == hit->start)
 			{
-				// end of chain of allocated clusters for the directory
-				// append new cluster, return false on failure
-				if (!append_cluster(fat, file->clu)) return false;
+				if (r->start < hit->start) hit->start = r->start;
+				hit->count += r->count;
+
+				*r = f->discard[--f->discard_count];
+				break;
 			}
+		}
+
+		return;
+	}
+
+	if (f->discard_count < FF_DISCARD_RANGES)
+	{
+		f->discard[f->discard_count++] = (FFDISCARD) { clu, 1 };
+		return;
+	}
+
+	// Full, the shortest range is left out (the chain being freed
+	// likely continues next to this cluster)
+	uint16_t min = 0;
+	for (uint16_t i = 1; i < FF_DISCARD_RANGES; i++)
+	{
+		if (f->discard[i].count < f->discard[min].count) min = i;
+	}
+
+	f->discard[min] = (FFDISCARD) { clu, 1 };
+}
+
+
+/** Forget clusters that are taken again, they must not be discarded */
+static void discard_remove(const FAT16* fat, const uint32_t clu, const uint32_t count)
+{
+	FAT16* f = (FAT16*) fat; // runtime state
 
-			// if new cluster was just added, repeat.
+	const uint32_t end = clu + count;
+
+	uint16_t i = 0;
+	while (i < f->discard_count)
+	{
+		FFDISCARD* r = &f->discard[i];
+		const uint32_t r_end = r->start + r->count;
+
+		if (end <= r->start || clu >= r_end)
+		{
+			i++;
+			continue; // no overlap
 		}
-		while (addr == 0xFFFF);
 
-		// Open the file entry
-		open_file(fat, file, clu, num);
+		if (clu <= r->start && end >= r_end)
+		{
+			// all of it
+			*r = f->discard[--f->discard_count];
+			continue;
+		}
 
-		// Check if can be overwritten
-		if (file->type == FT_DELETED || file->type == FT_NONE)
+		if (clu > r->start && end < r_end)
 		{
-			return true;
+			// from the middle, the tail is kept if there's room
+			if (f->discard_count < FF_DISCARD_RANGES)
+				f->discard[f->discard_count++] = (FFDISCARD) { end, r_end - end };
+
+			r->count = clu - r->start;
+		}
+		else if (clu > r->start)
+		{
+			r->count = clu - r->start;
+		}
+		else
+		{
+			r->start = end;
+			r->count = r_end - end;
 		}
-	}
 
-	return false; // not found.
+		i++;
+	}
 }
 
 
-
-bool ff_newfile(FFILE* file, const char* name)
+/**
+ * Discard the remembered clusters.
+ * The device is flushed first, so the FAT never points to discarded data.
+ */
+static void discard_issue(const FAT16* fat)
 {
-	const FSAVEPOS orig = ff_savepos(file);
+	FAT16* f = (FAT16*) fat; // runtime state
 
-	// Convert filename to zero padded raw string
-	char fname[11];
-	ff_rawname(name, fname);
+	if (f->discard_count == 0) return;
 
-	// Abort if file already exists
-	bool exists = dir_find_file_raw(file, fname);
-	ff_first(file); // rewind dir
-	if (exists)
+#if FF_USE_JOURNAL
+	if (fat->jr_buf != NULL)
+		return; // the frees are not committed yet
+#endif
+
+	fat->dev->flush();
+
+	for (uint16_t i = 0; i < f->discard_count; i++)
 	{
-		ff_reopen(file, &orig);
-		return false; // file already exists in the dir.
+		const FFDISCARD* r = &f->discard[i];
+		fat->dev->discard(clu_addr(fat, r->start), r->count * fat->bs.bytes_per_cluster);
 	}
 
+	f->discard_count = 0;
+}
+
+#endif
+
+
+/** Note that a cluster was freed, for the free space hints */
+static void note_free(const FAT16* fat, const uint32_t clu, const uint32_t count)
+{
+	FAT16* f = (FAT16*) fat; // hints are runtime state
+
+	if (clu < f->next_free) f->next_free = clu;
+	if (f->free_count != 0xFFFFFFFF) f->free_count += count;
+	f->fsi_dirty = true;
+	f->no_window = false;
 
-	if (!find_empty_file_slot(file))
+#if FF_DISCARD_RANGES > 0
+	for (uint32_t i = 0; i < count; i++)
 	{
-		ff_reopen(file, &orig);
-		return false; // error finding a slot
+		discard_add(fat, clu + i);
 	}
+#endif
+}
+
+
+/** Note that clusters were taken, for the free space hints */
+static void note_alloc(const FAT16* fat, const uint32_t clu, const uint32_t count)
+{
+	FAT16* f = (FAT16*) fat; // hints are runtime state
+
+	if (f->free_count != 0xFFFFFFFF) f->free_count = (f->free_count > count) ? f->free_count - count : 0;
+	f->fsi_dirty = true;
+
+#if FF_DISCARD_RANGES > 0
+	discard_remove(fat, clu, count);
+#else
+	(void) clu;
+#endif
+}
 
-	// Write into the new slot
-	const uint16_t newclu = alloc_cluster(file->fat);
-	write_file_header(file, fname, 0, newclu);
+
+/** Check if a cluster is free, and can be taken */
+static bool cluster_usable(const FAT16* fat, const uint32_t clu)
+{
+	STAT_ADD(fat, alloc_scan, 1);
+
+	if (read_fat(fat, clu) != 0) return false;
+
+#if FF_USE_JOURNAL
+	if (fat->jr_buf && jr_held(fat, clu)) return false;
+#endif
 
 	return true;
 }
 
 
+/** Take a free cluster: mark it as the end of a chain, and clean it */
+static uint32_t claim_cluster(const FAT16* fat, const uint32_t clu)
+{
+	FAT16* f = (FAT16*) fat; // hints are runtime state
+
+	write_fat(fat, clu, CLU_END);
+
+	if (f->next_free == clu) f->next_free = clu + 1;
+	note_alloc(fat, clu, 1);
+
+	wipe_cluster(fat, clu);
+
+	return clu;
+}
+
+
 /**
- * Create a sub-directory of given name.
- * Directory is allocated and populated with entries "." and ".."
+ * Allocate a new cluster, clean it, and mark it as the end of a chain.
+ *
+ * The search starts at the "next free" hint, and wraps around.
+ * Frees move the hint down, so the lowest free clusters are used first.
  */
-bool ff_mkdir(FFILE* file, const char* name)
+uint32_t alloc_cluster(const FAT16* fat)
 {
-	const FSAVEPOS orig = ff_savepos(file);
+	FAT16* f = (FAT16*) fat; // hints are runtime state
 
-	// Convert filename to zero padded raw string
-	char fname[11];
-	ff_rawname(name, fname);
+	const uint32_t end = cluster_count(fat) + 2;
+	uint32_t start = f->next_free;
+	if (start < 2 || start >= end) start = 2;
 
-	// Abort if file already exists
-	bool exists = dir_find_file_raw(file, fname);
-	ff_first(file); // rewind dir
-	if (exists)
+	// first cluster skipped because it's held, the hint can't pass it
+	uint32_t held = CLU_END;
+
+	// find new unclaimed cluster that can be added to the chain.
+	uint32_t i = start;
+	do
 	{
-		ff_reopen(file, &orig);
-		return false; // file already exusts in the dir.
+		// read value from FAT
+		STAT_ADD(fat, alloc_scan, 1);
+		uint32_t b = read_fat(fat, i);
+#if FF_USE_JOURNAL
+		if (b == 0 && fat->jr_buf && jr_held(fat, i))
+		{
+			if (held == CLU_END) held = i;
+			b = 1; // not usable yet
+		}
+#endif
+		if (b == 0) // unused cluster
+		{
+			f->next_free = (held < i) ? held : i + 1;
+			return claim_cluster(fat, i);
+		}
+
+		if (++i == end) i = 2;
 	}
+	while (i != start);
+
+	return CLU_END; // error code
+}
+
+
+/**
+ * Allocate and chain new cluster to a chain ending at given cluster.
+ *
+ * The cluster right after it is preferred. If that one is taken, the
+ * chain continues FF_ALLOC_WINDOW clusters into a free run twice as long,
+ * so that chains growing at the same time don't interleave (the skipped
+ * clusters are left to the chain ending before the run).
+ * The search for the run continues where the last one ended, so the
+ * filled part of the volume is not scanned again for every window.
+ * Otherwise, any free cluster is used.
+ */
+bool append_cluster(const FAT16* fat, const uint32_t clu)
+{
+	uint32_t clu2 = CLU_END;
 
-	if (!find_empty_file_slot(file))
+	if (clu + 1 < cluster_count(fat) + 2 && cluster_usable(fat, clu + 1))
 	{
-		ff_reopen(file, &orig);
-		return false; // error finding a slot
+		clu2 = claim_cluster(fat, clu + 1);
 	}
+#if FF_ALLOC_WINDOW > 0
+	else if (!fat->no_window)
+	{
+		FAT16* f = (FAT16*) fat; // hints are runtime state
 
-	// Write into the new slot
-	const uint16_t newclu = alloc_cluster(file->fat);
-	write_file_header(file, fname, FA_DIR, newclu);
+		const uint32_t run = find_free_run(fat, 2 * FF_ALLOC_WINDOW, f->next_run);
 
-	const uint32_t parent_clu = file->clu;
-	open_file(file->fat, file, file->clu_start, 0);
+		if (run != CLU_END)
+		{
+			f->next_run = run + 2 * FF_ALLOC_WINDOW;
+			clu2 = claim_cluster(fat, run + FF_ALLOC_WINDOW);
+		}
+		else f->no_window = true; // until clusters are freed
+	}
+#endif
 
-	write_file_header(file, ".          ", FA_DIR, newclu);
+	if (clu2 == CLU_END) clu2 = alloc_cluster(fat);
+	if (clu2 == CLU_END) return false;
 
-	// Advance to next file slot
-	find_empty_file_slot(file);
+	// Write "i" to "clu"
+	write_fat(fat, clu, clu2);
+
+	return true;
+}
 
-	write_file_header(file, "..         ", FA_DIR, parent_clu);
 
-	// rewind.
-	ff_first(file);
+bool free_cluster_chain(const FAT16* fat, uint32_t clu)
+{
+	if (clu < 2) return false;
+
+	do
+	{
+		// get address of the next cluster
+		STAT_ADD(fat, chain_steps, 1);
+		const uint32_t clu2 = read_fat(fat, clu);
+
+		// mark cluster as unused
+		write_fat(fat, clu, 0x0000);
+		note_free(fat, clu, 1);
+
+		// advance
+		clu = clu2;
+	}
+	while (clu != CLU_END);
 
 	return true;
 }
 
 
-char* ff_disk_label(const FAT16* fat, char* label_out)
+/**
+ * Check if there is already a file of given RAW name
+ * Raw name - name as found on disk, not "display name".
+ */
+bool dir_find_file_raw(FFILE* dir, const char* fname)
 {
-	FFILE first;
-	ff_root(fat, &first);
+	// rewind
+	ff_first(dir);
 
-	if (first.type == FT_LABEL)
+	do
 	{
-		return ff_dispname(&first, label_out);
+		bool diff = false;
+		for (uint8_t i = 0; i < 11; i++)
+		{
+			if (dir->name[i] != fname[i])
+			{
+				diff = true;
+				break;
+			}
+		}
+
+		// found the right file?
+		if (!diff)
+		{
+			return true; // file is already open.
+		}
 	}
+	while (ff_next(dir));
 
-	// find where spaces end
-	int8_t j = 10;
-	for (; j >= 0; j--)
+	return false;
+}
+
+
+/** Find the directory cluster holding entry "num" */
+uint32_t dir_entry_clu(const FAT16* fat, uint32_t dir_cluster, const uint16_t num)
+{
+	if (dir_cluster == 0) return 0; // FAT16 root directory is not a cluster chain
+
+	uint32_t addr = num * 32;
+	while (addr >= fat->bs.bytes_per_cluster)
 	{
-		if (fat->bs.volume_label[j] != ' ') break;
+		dir_cluster = next_clu(fat, dir_cluster);
+		if (dir_cluster == CLU_END) return CLU_END; // fail
+		addr -= fat->bs.bytes_per_cluster;
 	}
 
-	// copy all until spaces
-	uint8_t i;
-	for (i = 0; i <= j; i++)
+	return dir_cluster;
+}
+
+
+/** Get absolute address of a directory entry in a known cluster */
+uint32_t dir_entry_addr(const FAT16* fat, const uint32_t dir_cluster, const uint16_t num, const uint32_t ent_clu)
+{
+	if (dir_cluster == 0)
 	{
-		label_out[i] = fat->bs.volume_label[i];
+		return fat->rd_addr + num * 32; // root directory, max 512 entries.
 	}
 
-	label_out[i] = 0; // ender
+	return clu_addr(fat, ent_clu) + (num * 32) % fat->bs.bytes_per_cluster;
+}
+
+
+/**
+ * Read a file entry
+ *
+ * dir_cluster ... directory start cluster
+ * num ... entry number in the directory
+ */
+void open_file(const FAT16* fat, FFILE* file, const uint32_t dir_cluster, const uint16_t num)
+{
+	open_entry(fat, file, dir_cluster, num, dir_entry_clu(fat, dir_cluster, num));
+}
+
+
+/**
+ * Read a file entry
+ *
+ * dir_cluster ... directory start cluster
+ * num ... entry number in the directory
+ * ent_clu ... cluster of the directory where the entry is
+ */
+void open_entry(const FAT16* fat, FFILE* file, const uint32_t dir_cluster, const uint16_t num, const uint32_t ent_clu)
+{
+	// Resolve starting address
+	const uint32_t addr = dir_entry_addr(fat, dir_cluster, num, ent_clu);
+
+	// Free slot hint belongs to the directory
+	if (file->clu != dir_cluster)
+	{
+		file->free_dir = dir_cluster;
+		file->free_num = 0;
+	}
+
+	uint8_t ent[32];
+	dev_seek(fat, addr);
+	dev_load(fat, ent, 32);
+
+	for (uint8_t i = 0; i < 11; i++) file->name[i] = ent[i];
+	file->attribs = ent[11];
+	file->clu_start = ent_start(fat, ent);
+	file->size = get_le32(ent + 28);
+
+	file->clu = dir_cluster;
+	file->num = num;
+	file->ent_clu = ent_clu;
+
+	// add a FAT pointer
+	file->fat = fat;
+
+	// Resolve filename & type
+
+	file->type = FT_FILE;
+
+	const uint8_t c = file->name[0];
+	switch (c)
+	{
+		case 0x00:
+			file->type = FT_NONE;
+			return;
+
+		case 0xE5:
+			file->type = FT_DELETED;
+			return;
+
+		case 0x05: // Starting with 0xE5
+			file->type = FT_FILE;
+			file->name[0] = 0xE5; // convert to the real character
+			break;
+
+		case 0x2E:
+			if (file->name[1] == 0x2E)
+			{
+				// ".." directory, 0 if it's the root
+				file->type = FT_PARENT;
+				if (file->clu_start == 0) file->clu_start = root_dir(fat);
+			}
+			else
+			{
+				// "." directory
+				file->type = FT_SELF;
+			}
+			break;
+
+		default:
+			if (c < 32)
+			{
+				file->type = FT_INVALID; // File is corrupt, treat it as invalid
+				return; // avoid trying to seek
+			}
+			else
+			{
+				file->type = FT_FILE;
+			}
+	}
+
+	// handle subdir, label
+	if (file->attribs & FA_DIR && file->type == FT_FILE)
+	{
+		file->type = FT_SUBDIR;
+	}
+	else if (file->attribs == FA_LABEL)
+	{
+		file->type = FT_LABEL; // volume label special file
+		return; // do not seek
+	}
+	else if (file->attribs == 0x0F)
+	{
+		file->type = FT_LFN; // long name special file, can be ignored
+		return; // do not seek
+	}
+
+	// Init cursors
+	ff_seek(file, 0);
+}
+
+
+
+/**
+ * Write information into a file header.
+ * "file" is an open handle.
+ */
+void write_file_header(FFILE* file, const char* fname_raw, const uint8_t attribs, const uint32_t clu_start)
+{
+	const FAT16* fat = file->fat;
+
+	const uint32_t entrystart = dir_entry_addr(fat, file->clu, file->num, file->ent_clu);
+
+	// name, attributes, reserved, date & time (zeros),
+	// first cluster (high half on FAT32), size 0
+	uint8_t ent[32] = { 0 };
+	for (uint8_t i = 0; i < 11; i++) ent[i] = fname_raw[i];
+	ent[11] = attribs;
+	if (fat->bs.fat32)
+	{
+		ent[20] = clu_start >> 16;
+		ent[21] = clu_start >> 24;
+	}
+	ent[26] = clu_start;
+	ent[27] = clu_start >> 8;
+
+	dev_seek(fat, entrystart);
+	dev_store(fat, ent, 32);
+
+	// reopen file - load & parse the information just written
+	open_entry(fat, file, file->clu, file->num, file->ent_clu);
+}
+
+
+
+// =============== LONG FILE NAMES =================
+
+#if FF_USE_LFN
+
+/** Max entries of one long name sequence */
+#define LFN_MAX_ENTRIES 20
+
+/** Offsets of the 13 UCS-2 characters in a long name entry */
+static const uint8_t lfn_char_offs[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+
+
+/** Checksum of a raw 8.3 name, stored in its long name entries */
+static uint8_t lfn_checksum(const uint8_t* fname_raw)
+{
+	uint8_t sum = 0;
+	for (uint8_t i = 0; i < 11; i++)
+	{
+		uint8_t c = fname_raw[i];
+		if (i == 0 && c == 0xE5) c = 0x05; // stored escaped on disk
+
+		sum = ((sum & 1) << 7) + (sum >> 1) + c;
+	}
+
+	return sum;
+}
+
+
+/** ASCII case folding of a name character */
+static inline uint16_t lfn_fold(const uint16_t c)
+{
+	return (c >= 'a' && c <= 'z') ? c - 32 : c;
+}
+
+
+/** Hash of a case-folded long name */
+static uint16_t lfn_hash(const uint16_t* ucs, const uint16_t len)
+{
+	uint32_t h = 2166136261u; // FNV-1a
+	for (uint16_t i = 0; i < len; i++)
+	{
+		h = (h ^ lfn_fold(ucs[i])) * 16777619u;
+	}
+
+	return (h >> 16) ^ (h & 0xFFFF);
+}
+
+
+/** Compare two long names, ignoring ASCII case */
+static bool lfn_equal(const uint16_t* a, const uint16_t alen, const uint16_t* b, const uint16_t blen)
+{
+	if (alen != blen) return false;
+
+	for (uint16_t i = 0; i < alen; i++)
+	{
+		if (lfn_fold(a[i]) != lfn_fold(b[i])) return false;
+	}
+
+	return true;
+}
+
+
+/** Convert UTF-8 to UCS-2. Returns length, 0 if invalid or too long. */
+static uint16_t utf8_to_ucs(const char* in, uint16_t* out)
+{
+	uint16_t len = 0;
+	const uint8_t* p = (const uint8_t*) in;
+
+	while (*p)
+	{
+		uint16_t c;
+		if (p[0] < 0x80)
+		{
+			c = p[0];
+			p += 1;
+		}
+		else if ((p[0] & 0xE0) == 0xC0 && (p[1] & 0xC0) == 0x80)
+		{
+			c = ((p[0] & 0x1F) << 6) | (p[1] & 0x3F);
+			p += 2;
+		}
+		else if ((p[0] & 0xF0) == 0xE0 && (p[1] & 0xC0) == 0x80 && (p[2] & 0xC0) == 0x80)
+		{
+			c = ((p[0] & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+			p += 3;
+		}
+		else
+		{
+			return 0; // not representable in UCS-2
+		}
+
+		if (len == FF_LFN_MAX) return 0;
+		out[len++] = c;
+	}
+
+	return len;
+}
+
+
+/** Convert UCS-2 to UTF-8. Returns false if it doesn't fit. */
+static bool ucs_to_utf8(const uint16_t* in, const uint16_t len, char* out, const uint16_t size)
+{
+	uint16_t w = 0;
+
+	for (uint16_t i = 0; i < len; i++)
+	{
+		const uint16_t c = in[i];
+		const uint8_t n = (c < 0x80) ? 1 : (c < 0x800) ? 2 : 3;
+
+		if (w + n >= size) return false; // keep space for the terminator
+
+		if (n == 1)
+		{
+			out[w++] = c;
+		}
+		else if (n == 2)
+		{
+			out[w++] = 0xC0 | (c >> 6);
+			out[w++] = 0x80 | (c & 0x3F);
+		}
+		else
+		{
+			out[w++] = 0xE0 | (c >> 12);
+			out[w++] = 0x80 | ((c >> 6) & 0x3F);
+			out[w++] = 0x80 | (c & 0x3F);
+		}
+	}
+
+	out[w] = 0;
+	return true;
+}
+
+
+/**
+ * Assemble the long name of a file from the entries preceding it.
+ * The sequence must be complete, and match the checksum of the short name.
+ *
+ * Returns length in UCS-2 characters, 0 if there is no valid long name.
+ * "entries" receives the number of long name entries (can be NULL).
+ */
+static uint16_t lfn_read(const FFILE* file, uint16_t* ucs, uint8_t* entries)
+{
+	const FAT16* fat = file->fat;
+
+	if (file->type != FT_FILE && file->type != FT_SUBDIR)
+		return 0;
+
+	const uint8_t sum = lfn_checksum(file->name);
+	const uint16_t per_clu = fat->bs.bytes_per_cluster / 32;
+
+	uint32_t clu = file->ent_clu;
+	uint8_t ent[32];
+
+	for (uint8_t ord = 1; ord <= LFN_MAX_ENTRIES && ord <= file->num; ord++)
+	{
+		const uint16_t num = file->num - ord;
+
+		// stepped back into the previous cluster of the directory
+		if (file->clu != 0 && num % per_clu == per_clu - 1)
+			clu = dir_entry_clu(fat, file->clu, num);
+
+		dev_seek(fat, dir_entry_addr(fat, file->clu, num, clu));
+		dev_load(fat, ent, 32);
+
+		if (ent[11] != 0x0F || ent[0] == 0xE5 || (ent[0] & 0x1F) != ord || ent[13] != sum)
+			return 0; // not a part of this name
+
+		for (uint8_t i = 0; i < 13; i++)
+		{
+			const uint8_t* p = ent + lfn_char_offs[i];
+			const uint16_t c = p[0] | (p[1] << 8);
+
+			if (c == 0x0000)
+			{
+				// terminator, allowed only in the last entry
+				if (!(ent[0] & 0x40)) return 0;
+				if (entries) *entries = ord;
+				return (ord - 1) * 13 + i;
+			}
+
+			ucs[(ord - 1) * 13 + i] = c;
+		}
+
+		if (ent[0] & 0x40)
+		{
+			if (entries) *entries = ord;
+			return ord * 13; // full last entry, no terminator
+		}
+	}
+
+	return 0; // sequence incomplete
+}
+
+
+/**
+ * Write long name entries in front of a short name entry.
+ * "file" is open at the first free slot of the run; it's left
+ * open at the slot for the short name entry.
+ */
+static void lfn_write(FFILE* file, const uint16_t* ucs, const uint16_t len, const char* fname_raw)
+{
+	const FAT16* fat = file->fat;
+	const uint16_t per_clu = fat->bs.bytes_per_cluster / 32;
+	const uint8_t count = (len + 12) / 13;
+	const uint8_t sum = lfn_checksum((const uint8_t*) fname_raw);
+
+	uint16_t num = file->num;
+	uint32_t clu = file->ent_clu;
+	uint8_t ent[32];
+
+	// stored in reverse order, the first entry holds the end of the name
+	for (uint8_t ord = count; ord >= 1; ord--)
+	{
+		for (uint8_t i = 0; i < 32; i++) ent[i] = 0;
+
+		ent[0] = ord | (ord == count ? 0x40 : 0);
+		ent[11] = 0x0F;
+		ent[13] = sum;
+
+		for (uint8_t i = 0; i < 13; i++)
+		{
+			const uint16_t pos = (ord - 1) * 13 + i;
+			const uint16_t c = (pos < len) ? ucs[pos] : (pos == len) ? 0x0000 : 0xFFFF;
+
+			ent[lfn_char_offs[i]] = c & 0xFF;
+			ent[lfn_char_offs[i] + 1] = c >> 8;
+		}
+
+		dev_seek(fat, dir_entry_addr(fat, file->clu, num, clu));
+		dev_store(fat, ent, 32);
+
+		// next slot; the whole run is already allocated
+		num++;
+		if (file->clu != 0 && num % per_clu == 0)
+			clu = next_clu(fat, clu);
+	}
+
+	open_entry(fat, file, file->clu, num, clu);
+}
+
+
+/** Mark the long name entries of a file as deleted. Returns their count. */
+static uint8_t lfn_erase(const FFILE* file)
+{
+	const FAT16* fat = file->fat;
+	uint16_t ucs[LFN_MAX_ENTRIES * 13];
+	uint8_t count = 0;
+
+	if (lfn_read(file, ucs, &count) == 0) return 0;
+
+	for (uint8_t ord = 1; ord <= count; ord++)
+	{
+		const uint16_t num = file->num - ord;
+		dev_seek(fat, dir_entry_addr(fat, file->clu, num, dir_entry_clu(fat, file->clu, num)));
+		dev_write(fat, 0xE5);
+	}
+
+	return count;
+}
+
+
+/** Long name being assembled while reading a directory forwards */
+typedef struct
+{
+	uint16_t ucs[LFN_MAX_ENTRIES * 13];
+	uint16_t len;
+	uint8_t expect; // ordinal of the next entry, 0 = none / complete
+	uint8_t sum;
+	bool valid;     // a sequence is complete
+} LfnAcc;
+
+
+/**
+ * Feed a raw directory entry to the assembler.
+ * Returns false if it's not a long name entry.
+ */
+static bool lfn_acc_feed(LfnAcc* acc, const uint8_t* ent)
+{
+	if (ent[11] != 0x0F || ent[0] == 0xE5)
+	{
+		return false;
+	}
+
+	const uint8_t ord = ent[0] & 0x1F;
+
+	if (ent[0] & 0x40)
+	{
+		// last part of the name comes first
+		acc->expect = ord;
+		acc->sum = ent[13];
+		acc->len = ord * 13;
+	}
+
+	if (ord == 0 || ord > LFN_MAX_ENTRIES || ord != acc->expect || ent[13] != acc->sum)
+	{
+		acc->expect = 0;
+		acc->valid = false;
+		return true; // broken sequence
+	}
+
+	for (uint8_t i = 0; i < 13; i++)
+	{
+		const uint8_t* p = ent + lfn_char_offs[i];
+		const uint16_t c = p[0] | (p[1] << 8);
+
+		if (c == 0x0000 && (ent[0] & 0x40))
+		{
+			acc->len = (ord - 1) * 13 + i;
+			break;
+		}
+
+		acc->ucs[(ord - 1) * 13 + i] = c;
+	}
+
+	acc->expect--;
+	acc->valid = (acc->expect == 0);
+	return true;
+}
+
+
+/**
+ * Finish a sequence at a short name entry.
+ * Returns the long name length, 0 if there's no valid long name for it.
+ */
+static uint16_t lfn_acc_finish(LfnAcc* acc, const uint8_t* ent)
+{
+	const uint16_t len = (acc->valid && lfn_checksum(ent) == acc->sum) ? acc->len : 0;
+
+	acc->expect = 0;
+	acc->valid = false;
+
+	return (len <= FF_LFN_MAX) ? len : 0;
+}
+
+
+/** Check if a character can be used in a short name */
+static bool sfn_char_ok(const char c)
+{
+	if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))
+		return true;
+
+	for (const char* p = "$%'-_@~`!(){}^#&"; *p; p++)
+	{
+		if (*p == c) return true;
+	}
+
+	return false;
+}
+
+
+/**
+ * Check if a name can be stored as 8.3 without a long name.
+ * The base name and the extension can each be all lower case
+ * (see sfn_name()), but not mixed case, unless "any_case" (lookups).
+ */
+static bool name_fits_sfn(const char* name, const bool any_case)
+{
+	uint8_t base = 0, ext = 0;
+	bool dot = false;
+	uint8_t lower = 0, upper = 0; // bit 0 = base, bit 1 = extension
+
+	for (const char* p = name; *p; p++)
+	{
+		if (*p == '.')
+		{
+			if (dot || base == 0) return false;
+			dot = true;
+			continue;
+		}
+
+		if (!sfn_char_ok(*p)) return false;
+
+		if (*p >= 'a' && *p <= 'z') lower |= dot ? 2 : 1;
+		if (*p >= 'A' && *p <= 'Z') upper |= dot ? 2 : 1;
+
+		if (dot) ext++;
+		else base++;
+	}
+
+	return base >= 1 && base <= 8 && ext <= 3 && !(dot && ext == 0) && (any_case || (lower & upper) == 0);
+}
+
+
+/**
+ * Raw 8.3 name of a name that fits (name_fits_sfn()), in upper case.
+ * Returns the case bits for the entry, for parts that were lower case.
+ */
+static uint8_t sfn_name(const char* name, char* fname_raw)
+{
+	ff_rawname(name, fname_raw);
+
+	uint8_t lcase = 0;
+	for (uint8_t i = 0; i < 11; i++)
+	{
+		if (fname_raw[i] >= 'a' && fname_raw[i] <= 'z')
+		{
+			fname_raw[i] -= 32;
+			lcase |= (i < 8) ? SFN_LOWER_BASE : SFN_LOWER_EXT;
+		}
+	}
+
+	return lcase;
+}
+
+
+/**
+ * Build the short alias number "n" of a long name, eg. "LONGFI~1TXT".
+ * Returns false if "n" is out of range.
+ */
+static bool make_alias(const char* name, const uint16_t n, char* fname_raw)
+{
+	if (n == 0 || n > 9999) return false;
+
+	// last dot starts the extension, unless it's leading
+	const char* ext = NULL;
+	for (const char* p = name + 1; *p; p++)
+	{
+		if (*p == '.') ext = p;
+	}
+
+	char base[8];
+	uint8_t base_len = 0;
+
+	for (const char* p = name; *p && p != ext && base_len < 8; p++)
+	{
+		if (*p == ' ' || *p == '.') continue;
+		const char c = (*p >= 'a' && *p <= 'z') ? *p - 32 : *p;
+		base[base_len++] = sfn_char_ok(c) ? c : '_';
+	}
+
+	if (base_len == 0) base[base_len++] = '_';
+
+	// "~N" suffix, digits reversed
+	char tail[5];
+	uint8_t tail_len = 0;
+	for (uint16_t v = (n > 4) ? n - 4 : n; v > 0; v /= 10) tail[tail_len++] = '0' + v % 10;
+	tail[tail_len++] = '~';
+
+	// Past a few collisions, mix a hash of the whole name into the alias,
+	// so names with a common prefix don't have to try every number.
+	if (n > 4)
+	{
+		uint16_t h = 0;
+		for (const char* p = name; *p; p++) h = (h << 5) + h + (uint8_t) *p;
+
+		if (base_len > 2) base_len = 2;
+		for (uint8_t i = 0; i < 4; i++, h >>= 4)
+			base[base_len++] = "0123456789ABCDEF"[h & 0xF];
+	}
+
+	const uint8_t keep = (base_len < 8 - tail_len) ? base_len : 8 - tail_len;
+
+	uint8_t i = 0;
+	for (; i < keep; i++) fname_raw[i] = base[i];
+	while (tail_len > 0) fname_raw[i++] = tail[--tail_len];
+	for (; i < 11; i++) fname_raw[i] = ' ';
+
+	if (ext != NULL)
+	{
+		i = 8;
+		for (const char* p = ext + 1; *p && i < 11; p++)
+		{
+			if (*p == ' ' || *p == '.') continue;
+			const char c = (*p >= 'a' && *p <= 'z') ? *p - 32 : *p;
+			fname_raw[i++] = sfn_char_ok(c) ? c : '_';
+		}
+	}
+
+	return true;
+}
+
+
+/** Forget the long name index, if it's for the given directory (CLU_END = any) */
+static void lfn_index_drop(const FAT16* fat, const uint32_t dir)
+{
+#if FF_LFN_INDEX > 0
+	FAT16* f = (FAT16*) fat; // index is runtime state
+
+	if (dir == CLU_END || f->lfn_dir == dir)
+		f->lfn_dir = CLU_END;
+#else
+	(void) fat;
+	(void) dir;
+#endif
+}
+
+
+/**
+ * Find a file by long name. "dir" is an open directory.
+ *
+ * Names of the directory are hashed into the index on the first scan;
+ * later lookups only read the entries whose hash matches. If the index
+ * is full, a miss scans only the entries past the last indexed one.
+ */
+static bool lfn_find(FFILE* dir, const char* name)
+{
+	uint16_t want[LFN_MAX_ENTRIES * 13];
+	uint16_t have[LFN_MAX_ENTRIES * 13];
+
+	const uint16_t want_len = utf8_to_ucs(name, want);
+	if (want_len == 0) return false;
+
+	const uint16_t hash = lfn_hash(want, want_len);
+
+#if FF_LFN_INDEX > 0
+	FAT16* fat = (FAT16*) dir->fat; // index is runtime state
+
+	if (fat->lfn_dir == dir->clu)
+	{
+		for (uint16_t i = 0; i < fat->lfn_used; i++)
+		{
+			if (fat->lfn_index[i].hash != hash) continue;
+
+			open_file(fat, dir, dir->clu, fat->lfn_index[i].num);
+
+			const uint16_t len = lfn_read(dir, have, NULL);
+			if (len > 0 && lfn_equal(have, len, want, want_len))
+				return true;
+		}
+
+		if (!fat->lfn_partial)
+			return false; // all names are indexed
+
+		// Scan the rest
+		open_file(fat, dir, dir->clu, fat->lfn_next);
+	}
+	else
+	{
+		// Scan the directory, and build the index
+		fat->lfn_dir = dir->clu;
+		fat->lfn_used = 0;
+		fat->lfn_partial = false;
+		ff_first(dir);
+	}
+#else
+	ff_first(dir);
+#endif
+
+	bool found = false;
+	FSAVEPOS hit = { 0 };
+
+	do
+	{
+		if (dir->type != FT_FILE && dir->type != FT_SUBDIR)
+			continue;
+
+		const uint16_t len = lfn_read(dir, have, NULL);
+		if (len == 0) continue;
+
+		const uint16_t h = lfn_hash(have, len);
+
+#if FF_LFN_INDEX > 0
+		if (fat->lfn_partial)
+		{
+			// past the index
+		}
+		else if (fat->lfn_used < FF_LFN_INDEX)
+		{
+			fat->lfn_index[fat->lfn_used].hash = h;
+			fat->lfn_index[fat->lfn_used].num = dir->num;
+			fat->lfn_used++;
+		}
+		else
+		{
+			fat->lfn_partial = true;
+			fat->lfn_next = dir->num;
+		}
+#endif
+
+		if (!found && h == hash && lfn_equal(have, len, want, want_len))
+		{
+			found = true;
+			hit = ff_savepos(dir);
+#if FF_LFN_INDEX == 0
+			break;
+#endif
+		}
+	}
+	while (ff_next(dir));
+
+	if (found)
+		ff_reopen(dir, &hit);
+
+	return found;
+}
+
+
+char* ff_longname(const FFILE* file, char* out, uint16_t size)
+{
+	uint16_t ucs[LFN_MAX_ENTRIES * 13];
+
+	const uint16_t len = lfn_read(file, ucs, NULL);
+	if (len == 0 || len > FF_LFN_MAX)
+	{
+		// no long name, use the short one
+		char disp[13];
+		if (ff_dispname(file, disp) == NULL) return NULL;
+
+		// in the case it was given in
+		dev_seek(file->fat, dir_entry_addr(file->fat, file->clu, file->num, file->ent_clu) + 12);
+		const uint8_t lcase = dev_read(file->fat);
+
+		bool ext = false;
+		uint16_t i = 0;
+		for (; disp[i] && i + 1 < size; i++)
+		{
+			if (disp[i] == '.') ext = true;
+
+			const bool lower = lcase & (ext ? SFN_LOWER_EXT : SFN_LOWER_BASE);
+			out[i] = (lower && disp[i] >= 'A' && disp[i] <= 'Z') ? disp[i] + 32 : disp[i];
+		}
+		out[i] = 0;
+
+		return disp[i] ? NULL : out;
+	}
+
+	if (!ucs_to_utf8(ucs, len, out, size)) return NULL;
+
+	return out;
+}
+
+#endif // FF_USE_LFN
+
+
+
+// =============== DIRECTORY ENTRY CACHE =================
+
+#if FF_DCACHE_SIZE > 0
+
+/** Hash of a name (case sensitive), 0 means an unused slot */
+static uint32_t dcache_hash(const char* name, const uint16_t len)
+{
+	uint32_t h = 2166136261u; // FNV-1a
+	for (uint16_t i = 0; i < len; i++)
+	{
+		h = (h ^ (uint8_t) name[i]) * 16777619u;
+	}
+
+	return h ? h : 1;
+}
+
+
+/** Check if a "not found" slot holds the given name, not just its hash */
+static bool dcache_missing(const FFDENTRY* e, const char* name, const uint16_t len)
+{
+#if FF_DCACHE_NAME > 0
+	if (len > FF_DCACHE_NAME) return false;
+
+	for (uint16_t i = 0; i < len; i++)
+	{
+		if (e->name[i] != name[i]) return false;
+	}
+
+	return true;
+#else
+	(void) e;
+	(void) name;
+	(void) len;
+	return false;
+#endif
+}
+
+
+/** Look up a name in the cache. Returns NULL if not cached. */
+static FFDENTRY* dcache_get(const FAT16* fat, const uint32_t dir, const char* name, const uint32_t hash,
+							const uint16_t len)
+{
+	FAT16* f = (FAT16*) fat; // cache is runtime state
+
+	for (uint16_t i = 0; i < FF_DCACHE_SIZE; i++)
+	{
+		FFDENTRY* e = &f->dcache[i];
+
+		if (e->hash == hash && e->dir == dir && e->len == len)
+		{
+			// a colliding name is as good as not cached
+			if (e->num == 0xFFFF && !dcache_missing(e, name, len))
+				return NULL;
+
+			e->used = ++f->dcache_clock;
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+
+/** Store a lookup result, replacing the least recently used slot */
+static void dcache_put(const FAT16* fat, const uint32_t dir, const char* name, const uint32_t hash,
+					   const uint16_t len, const uint16_t num, const uint32_t ent_clu)
+{
+	FAT16* f = (FAT16*) fat; // cache is runtime state
+
+	if (num == 0xFFFF && len > FF_DCACHE_NAME)
+		return; // can't keep the name, so "not found" can't be trusted
+
+	FFDENTRY* victim = &f->dcache[0];
+
+	for (uint16_t i = 0; i < FF_DCACHE_SIZE; i++)
+	{
+		FFDENTRY* e = &f->dcache[i];
+
+		if (e->hash == 0 || (e->hash == hash && e->dir == dir && e->len == len))
+		{
+			victim = e; // free, or the same name
+			break;
+		}
+
+		// oldest stamp (wraps around)
+		if ((uint16_t)(f->dcache_clock - e->used) > (uint16_t)(f->dcache_clock - victim->used))
+			victim = e;
+	}
+
+	victim->hash = hash;
+	victim->dir = dir;
+	victim->len = len;
+	victim->num = num;
+	victim->ent_clu = ent_clu;
+	victim->used = ++f->dcache_clock;
+
+#if FF_DCACHE_NAME > 0
+	if (num == 0xFFFF)
+	{
+		for (uint16_t i = 0; i < len; i++)
+			victim->name[i] = name[i];
+	}
+#else
+	(void) name;
+#endif
+}
+
+#endif // FF_DCACHE_SIZE
+
+
+/**
+ * Forget cached lookups in a directory (CLU_END = in all directories),
+ * after its entries changed.
+ *
+ * moved ... entries were moved, or the directory is gone. Otherwise
+ *           only "not found" results are dropped; found entries are
+ *           verified when used.
+ */
+static void dir_changed(const FAT16* fat, const uint32_t dir, const bool moved)
+{
+#if FF_USE_LFN
+	lfn_index_drop(fat, dir);
+#endif
+
+#if FF_DCACHE_SIZE > 0
+	FAT16* f = (FAT16*) fat; // cache is runtime state
+
+	for (uint16_t i = 0; i < FF_DCACHE_SIZE; i++)
+	{
+		FFDENTRY* e = &f->dcache[i];
+
+		if ((dir == CLU_END || e->dir == dir) && (moved || e->num == 0xFFFF))
+			e->hash = 0;
+	}
+#else
+	(void) fat;
+	(void) dir;
+	(void) moved;
+#endif
+}
+
+
+#if FF_DCACHE_SIZE > 0
+
+/** Check if an open entry has the given display name (or long name) */
+static bool entry_has_name(const FFILE* file, const char* name)
+{
+	// "." and ".." entries
+	if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+		return file->type == (name[1] ? FT_PARENT : FT_SELF);
+
+	if (file->type != FT_FILE && file->type != FT_SUBDIR)
+		return false;
+
+	char fname[11];
+	bool raw = true;
+
+#if FF_USE_LFN
+	raw = name_fits_sfn(name, true);
+#endif
+
+	if (raw)
+	{
+#if FF_USE_LFN
+		sfn_name(name, fname);
+#else
+		ff_rawname(name, fname);
+#endif
+
+		bool same = true;
+		for (uint8_t i = 0; i < 11; i++)
+		{
+			if (file->name[i] != (uint8_t) fname[i]) same = false;
+		}
+
+		if (same) return true;
+	}
+
+#if FF_USE_LFN
+	uint16_t want[LFN_MAX_ENTRIES * 13];
+	uint16_t have[LFN_MAX_ENTRIES * 13];
+
+	const uint16_t want_len = utf8_to_ucs(name, want);
+	const uint16_t have_len = lfn_read(file, have, NULL);
+
+	return want_len > 0 && lfn_equal(have, have_len, want, want_len);
+#else
+	return false;
+#endif
+}
+
+#endif
+
+
+
+// =============== DIRTY FILES =================
+
+#if FF_MAX_DIRTY > 0
+
+static int dirty_by_entry(const void* a, const void* b)
+{
+	const uint32_t x = ((const FFDIRTY*) a)->entry;
+	const uint32_t y = ((const FFDIRTY*) b)->entry;
+	return (x > y) - (x < y);
+}
+
+
+/** A pending FAT entry change of sync_dirty() */
+typedef struct
+{
+	uint32_t clu;
+	uint32_t value;
+} FatUpdate;
+
+
+static int update_by_clu(const void* a, const void* b)
+{
+	const uint32_t x = ((const FatUpdate*) a)->clu;
+	const uint32_t y = ((const FatUpdate*) b)->clu;
+	return (x > y) - (x < y);
+}
+
+
+/**
+ * Collect the FAT changes that cut a chain after "tail":
+ * the tail becomes the end, the rest is freed.
+ * Returns false if the list could not grow (nothing is added then).
+ */
+static bool collect_trim(const FAT16* fat, FatUpdate** list, uint32_t* n, uint32_t* cap, const uint32_t tail)
+{
+	const uint32_t end = cluster_count(fat) + 2;
+	const uint32_t first = *n;
+
+	uint32_t clu = tail;
+	uint32_t value = CLU_END;
+
+	// a broken chain can loop, it can't be longer than the volume
+	for (uint32_t steps = 0; clu >= 2 && clu < end && steps < end; steps++)
+	{
+		if (*n == *cap)
+		{
+			const uint32_t c = *cap ? *cap * 2 : 64;
+			FatUpdate* l = realloc(*list, c * sizeof(FatUpdate));
+			if (l == NULL)
+			{
+				*n = first;
+				return false;
+			}
+
+			*list = l;
+			*cap = c;
+		}
+
+		STAT_ADD(fat, chain_steps, 1);
+		const uint32_t next = read_fat(fat, clu);
+
+		(*list)[(*n)++] = (FatUpdate) { clu, value };
+
+		clu = next;
+		value = 0;
+	}
+
+	return true;
+}
+
+
+/**
+ * Store all pending file sizes, and free clusters past the file ends.
+ *
+ * Sizes are written in order of the directory entries. The FAT changes
+ * of all files are collected, and written in order of the FAT entries,
+ * consecutive entries in one store.
+ *
+ * The device is not flushed. Returns the number of files stored.
+ */
+uint16_t sync_dirty(const FAT16* fat)
+{
+	FAT16* f = (FAT16*) fat; // dirty list is runtime state
+	const uint16_t count = f->dirty_count;
+
+	// Sizes, in order of the directory entries
+	qsort(f->dirty, count, sizeof(FFDIRTY), dirty_by_entry);
+
+	for (uint16_t i = 0; i < count; i++)
+	{
+		dev_seek(fat, f->dirty[i].entry + 28);
+		dev_store(fat, &(f->dirty[i].size), 4);
+	}
+
+	// Chains to trim
+	FatUpdate* list = NULL;
+	uint32_t n = 0, cap = 0;
+
+	for (uint16_t i = 0; i < count; i++)
+	{
+		const uint32_t tail = f->dirty[i].tail;
+		const uint32_t next = next_clu(fat, tail);
+
+		if (next == CLU_END) continue;
+
+		if (!collect_trim(fat, &list, &n, &cap, tail))
+		{
+			// out of memory, this one right away
+			free_cluster_chain(fat, next);
+			write_fat(fat, tail, CLU_END);
+		}
+	}
+
+	// FAT changes, in order of the entries
+	if (n > 1) qsort(list, n, sizeof(FatUpdate), update_by_clu);
+
+	uint32_t values[64];
+	uint32_t i = 0;
+	while (i < n)
+	{
+		const uint32_t start = list[i].clu;
+		uint8_t run = 0;
+
+		while (i < n && run < 64 && list[i].clu == start + run)
+		{
+			values[run++] = list[i].value;
+			if (list[i].value == 0) note_free(fat, list[i].clu, 1);
+			i++;
+		}
+
+		// a cluster listed twice (cross-linked files) is written once
+		while (i < n && list[i].clu < start + run) i++;
+
+		write_fat_run(fat, start, values, run);
+	}
+
+	free(list);
+
+	f->dirty_count = 0;
+
+	return count;
+}
+
+
+/** Remember the new size of a written file */
+static void dirty_mark(const FFILE* file, const uint32_t tail)
+{
+	const FAT16* fat = file->fat;
+	FAT16* f = (FAT16*) fat; // dirty list is runtime state
+
+	const uint32_t entry = dir_entry_addr(fat, file->clu, file->num, file->ent_clu);
+
+	uint16_t i = 0;
+	while (i < f->dirty_count && f->dirty[i].entry != entry) i++;
+
+	if (i == FF_MAX_DIRTY)
+	{
+		// list is full, store what's pending
+		sync_dirty(fat);
+		i = 0;
+	}
+
+	if (i == f->dirty_count)
+	{
+		f->dirty[i].entry = entry;
+		f->dirty_count++;
+	}
+
+	f->dirty[i].size = file->size;
+	f->dirty[i].tail = tail;
+}
+
+
+/** Forget pending metadata of a file entry */
+static void dirty_drop(const FFILE* file)
+{
+	FAT16* f = (FAT16*) file->fat; // dirty list is runtime state
+
+	const uint32_t entry = dir_entry_addr(file->fat, file->clu, file->num, file->ent_clu);
+
+	for (uint16_t i = 0; i < f->dirty_count; i++)
+	{
+		if (f->dirty[i].entry == entry)
+		{
+			f->dirty[i] = f->dirty[--f->dirty_count];
+			return;
+		}
+	}
+}
+
+#endif // FF_MAX_DIRTY
+
+
+
+// =============== FSINFO =================
+
+// On FAT32, the free cluster count and the next free cluster hint are
+// kept in the FSInfo sector, so they don't have to be found by a FAT scan.
+
+#define FSI_LEAD  0x41615252
+#define FSI_STRUC 0x61417272
+#define FSI_TRAIL 0xAA550000
+
+
+/** Read the hints from the FSInfo sector, if it's valid */
+static void fsi_load(FAT16* fat, const uint32_t addr)
+{
+	uint8_t b[28];
+
+	fat->dev->seek(addr);
+	fat->dev->load(b, 4);
+	if (get_le32(b) != FSI_LEAD) return;
+
+	fat->dev->seek(addr + 484);
+	fat->dev->load(b, 28);
+	if (get_le32(b) != FSI_STRUC || get_le32(b + 24) != FSI_TRAIL) return;
+
+	fat->fsi_addr = addr;
+
+	// the values are only hints, ignore those out of range
+	const uint32_t count = cluster_count(fat);
+	const uint32_t free = get_le32(b + 4);
+	const uint32_t next = get_le32(b + 8);
+
+	if (free <= count) fat->free_count = free;
+	if (next >= 2 && next < count + 2) fat->next_free = next;
+}
+
+
+/** Store the hints into the FSInfo sector, if they changed */
+static void fsi_store(const FAT16* fat)
+{
+	FAT16* f = (FAT16*) fat; // hints are runtime state
+
+	if (!f->fsi_dirty || f->fsi_addr == 0) return;
+
+	uint8_t b[8];
+	set_le32(b, f->free_count);
+	set_le32(b + 4, f->next_free);
+
+	dev_seek(fat, f->fsi_addr + 488);
+	dev_store(fat, b, 8);
+
+	f->fsi_dirty = false;
+}
+
+
+
+// =============== FAT SCAN KERNELS =================
+
+// A group of up to 64 FAT entries is classified into bit masks
+// (one bit per entry), so the rest of a scan works on whole words.
+
+
+/** Classes of a group of FAT entries, bit i = entry i of the group */
+typedef struct
+{
+	uint64_t free; // entry is 0
+	uint64_t end;  // end of chain mark
+	uint64_t bad;  // bad cluster mark
+	uint64_t seq;  // link to the following cluster
+} FatMasks;
+
+
+/** Classify "n" FAT entries, the first one is of cluster "clu" (portable) */
+static void classify_scalar(const FAT16* fat, const uint8_t* buf, const uint32_t clu, const uint8_t n, FatMasks* m)
+{
+	const uint32_t end = fat->bs.fat32 ? 0x0FFFFFF8 : 0xFFF8;
+	const uint32_t bad = CLU_BAD(fat);
+
+	*m = (FatMasks) { 0 };
+
+	for (uint8_t i = 0; i < n; i++)
+	{
+		const uint32_t v = fat->bs.fat32 ? get_le32(buf + i * 4) & 0x0FFFFFFF
+						   : (uint32_t)(buf[i * 2] | (buf[i * 2 + 1] << 8));
+		const uint64_t bit = (uint64_t) 1 << i;
+
+		if (v == 0) m->free |= bit;
+		else if (v >= end) m->end |= bit;
+		else if (v == bad) m->bad |= bit;
+		else if (v == clu + i + 1) m->seq |= bit;
+	}
+}
+
+
+#if FF_USE_SIMD && defined(__AVX2__)
+
+// Packed compare results (-1 / 0 per entry) to bits at "i"
+#define PACK16(x, y, i) ((uint64_t)(uint32_t) _mm256_movemask_epi8(_mm256_permute4x64_epi64(_mm256_packs_epi16((x), (y)), 0xD8)) << (i))
+#define PACK32(x, i) ((uint64_t) _mm256_movemask_ps(_mm256_castsi256_ps(x)) << (i))
+
+/** Classify 64 FAT16 entries (AVX2) */
+static void classify16_simd(const uint8_t* buf, const uint32_t clu, FatMasks* m)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i flip = _mm256_set1_epi16((short) 0x8000);
+	const __m256i end = _mm256_set1_epi16(0x7FF7); // 0xFFF7, sign flipped
+	const __m256i bad = _mm256_set1_epi16((short) 0xFFF7);
+	const __m256i step = _mm256_set1_epi16(16);
+
+	// following cluster numbers (mod 65536 - 0 is free anyway)
+	__m256i next = _mm256_add_epi16(_mm256_set1_epi16((short)(clu + 1)),
+									_mm256_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+
+	*m = (FatMasks) { 0 };
+
+	for (uint8_t i = 0; i < 64; i += 32)
+	{
+		const __m256i a = _mm256_loadu_si256((const __m256i*)(buf + i * 2));
+		const __m256i b = _mm256_loadu_si256((const __m256i*)(buf + i * 2 + 32));
+		const __m256i next_b = _mm256_add_epi16(next, step);
+
+		m->free |= PACK16(_mm256_cmpeq_epi16(a, zero), _mm256_cmpeq_epi16(b, zero), i);
+		m->end |= PACK16(_mm256_cmpgt_epi16(_mm256_xor_si256(a, flip), end),
+						 _mm256_cmpgt_epi16(_mm256_xor_si256(b, flip), end), i);
+		m->bad |= PACK16(_mm256_cmpeq_epi16(a, bad), _mm256_cmpeq_epi16(b, bad), i);
+		m->seq |= PACK16(_mm256_cmpeq_epi16(a, next), _mm256_cmpeq_epi16(b, next_b), i);
+
+		next = _mm256_add_epi16(next_b, step);
+	}
+}
+
+/** Classify 64 FAT32 entries (AVX2) */
+static void classify32_simd(const uint8_t* buf, const uint32_t clu, FatMasks* m)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i low = _mm256_set1_epi32(0x0FFFFFFF);
+	const __m256i bad = _mm256_set1_epi32(0x0FFFFFF7); // end marks are above
+	const __m256i step = _mm256_set1_epi32(8);
+
+	__m256i next = _mm256_add_epi32(_mm256_set1_epi32(clu + 1), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+
+	*m = (FatMasks) { 0 };
+
+	for (uint8_t i = 0; i < 64; i += 8)
+	{
+		const __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(buf + i * 4)), low);
+
+		m->free |= PACK32(_mm256_cmpeq_epi32(v, zero), i);
+		m->end |= PACK32(_mm256_cmpgt_epi32(v, bad), i);
+		m->bad |= PACK32(_mm256_cmpeq_epi32(v, bad), i);
+		m->seq |= PACK32(_mm256_cmpeq_epi32(v, next), i);
+
+		next = _mm256_add_epi32(next, step);
+	}
+}
+
+#elif FF_USE_SIMD && defined(__SSE2__)
+
+// Packed compare results (-1 / 0 per entry) to bits at "i"
+#define PACK16(x, y, i) ((uint64_t)(uint16_t) _mm_movemask_epi8(_mm_packs_epi16((x), (y))) << (i))
+#define PACK32(x, i) ((uint64_t) _mm_movemask_ps(_mm_castsi128_ps(x)) << (i))
+
+/** Classify 64 FAT16 entries (SSE2) */
+static void classify16_simd(const uint8_t* buf, const uint32_t clu, FatMasks* m)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i flip = _mm_set1_epi16((short) 0x8000);
+	const __m128i end = _mm_set1_epi16(0x7FF7); // 0xFFF7, sign flipped
+	const __m128i bad = _mm_set1_epi16((short) 0xFFF7);
+	const __m128i step = _mm_set1_epi16(8);
+
+	// following cluster numbers (mod 65536 - 0 is free anyway)
+	__m128i next = _mm_add_epi16(_mm_set1_epi16((short)(clu + 1)), _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7));
+
+	*m = (FatMasks) { 0 };
+
+	for (uint8_t i = 0; i < 64; i += 16)
+	{
+		const __m128i a = _mm_loadu_si128((const __m128i*)(buf + i * 2));
+		const __m128i b = _mm_loadu_si128((const __m128i*)(buf + i * 2 + 16));
+		const __m128i next_b = _mm_add_epi16(next, step);
+
+		m->free |= PACK16(_mm_cmpeq_epi16(a, zero), _mm_cmpeq_epi16(b, zero), i);
+		m->end |= PACK16(_mm_cmpgt_epi16(_mm_xor_si128(a, flip), end),
+						 _mm_cmpgt_epi16(_mm_xor_si128(b, flip), end), i);
+		m->bad |= PACK16(_mm_cmpeq_epi16(a, bad), _mm_cmpeq_epi16(b, bad), i);
+		m->seq |= PACK16(_mm_cmpeq_epi16(a, next), _mm_cmpeq_epi16(b, next_b), i);
+
+		next = _mm_add_epi16(next_b, step);
+	}
+}
+
+/** Classify 64 FAT32 entries (SSE2) */
+static void classify32_simd(const uint8_t* buf, const uint32_t clu, FatMasks* m)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i low = _mm_set1_epi32(0x0FFFFFFF);
+	const __m128i bad = _mm_set1_epi32(0x0FFFFFF7); // end marks are above
+	const __m128i step = _mm_set1_epi32(4);
+
+	__m128i next = _mm_add_epi32(_mm_set1_epi32(clu + 1), _mm_setr_epi32(0, 1, 2, 3));
+
+	*m = (FatMasks) { 0 };
+
+	for (uint8_t i = 0; i < 64; i += 4)
+	{
+		const __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(buf + i * 4)), low);
+
+		m->free |= PACK32(_mm_cmpeq_epi32(v, zero), i);
+		m->end |= PACK32(_mm_cmpgt_epi32(v, bad), i);
+		m->bad |= PACK32(_mm_cmpeq_epi32(v, bad), i);
+		m->seq |= PACK32(_mm_cmpeq_epi32(v, next), i);
+
+		next = _mm_add_epi32(next, step);
+	}
+}
+
+#endif
+
+
+/** Classify "n" (up to 64) FAT entries, the first one is of cluster "clu" */
+static inline void fat_classify(const FAT16* fat, const uint8_t* buf, const uint32_t clu, const uint8_t n, FatMasks* m)
+{
+#if FF_USE_SIMD && (defined(__AVX2__) || defined(__SSE2__))
+	if (n == 64)
+	{
+		if (fat->bs.fat32) classify32_simd(buf, clu, m);
+		else classify16_simd(buf, clu, m);
+		return;
+	}
+#endif
+
+	classify_scalar(fat, buf, clu, n, m);
+}
+
+
+/**
+ * Extend free run tracking by a group of 64 entries.
+ * run ... free entries at the end of the previous groups
+ * best ... longest run so far (includes "run")
+ */
+static void track_runs(uint64_t free, uint32_t* run, uint32_t* best)
+{
+	if (free == ~(uint64_t) 0)
+	{
+		*run += 64;
+		if (*run > *best) *best = *run;
+		return;
+	}
+
+	const uint32_t carry = *run;
+	*run = 0;
+
+	while (free)
+	{
+		const uint8_t at = __builtin_ctzll(free);
+		const uint8_t len = __builtin_ctzll(~(free >> at));
+		const uint32_t total = len + (at == 0 ? carry : 0);
+
+		if (total > *best) *best = total;
+
+		if (at + len == 64)
+		{
+			*run = total; // continues in the next group
+			break;
+		}
+
+		free &= ~((((uint64_t) 1 << len) - 1) << at);
+	}
+}
+
+
+// =============== PUBLIC FUNCTION IMPLEMENTATIONS =================
+
+/** List the FAT partitions on a device */
+uint8_t ff_list_partitions(const BLOCKDEV* dev, FFPART* parts, uint8_t max)
+{
+	const uint8_t count = find_parts(dev, parts, max, 0xFF);
+	return (count < max) ? count : max;
+}
+
+
+/** Initialize a FAT16 handle */
+bool ff_init(const BLOCKDEV* dev, FAT16* fat)
+{
+	// the first partition found
+	FFPART part;
+	if (find_parts(dev, &part, 1, 0xFF) == 0)
+		return false;
+
+	return ff_init_part(dev, fat, part.index);
+}
+
+
+bool ff_init_part(const BLOCKDEV* dev, FAT16* fat, uint8_t index)
+{
+	FFPART part;
+	if (find_parts(dev, &part, 1, index) == 0)
+		return false;
+
+	const uint32_t bs_a = part.start * FF_LBA_SIZE;
+
+	fat->dev = dev;
+	read_bs(dev, &(fat->bs), bs_a);
+
+	const uint16_t bps = fat->bs.bytes_per_sector;
+	if (bps < 512 || bps > 4096 || (bps & (bps - 1)) != 0)
+		return false; // not a sector size
+
+	if (fat->bs.sectors_per_cluster == 0 || (uint32_t) fat->bs.sectors_per_cluster * bps > 32768)
+		return false; // clusters up to 32k
+
+#if FF_USE_STATS
+	ff_reset_stats(fat);
+#endif
+#if FF_USE_LFN && FF_LFN_INDEX > 0
+	fat->lfn_dir = CLU_END; // nothing indexed
+#endif
+#if FF_MAX_DIRTY > 0
+	fat->dirty_count = 0;
+#endif
+#if FF_DISCARD_RANGES > 0
+	fat->discard_count = 0;
+#endif
+#if FF_DCACHE_SIZE > 0
+	for (uint16_t i = 0; i < FF_DCACHE_SIZE; i++)
+	{
+		fat->dcache[i].hash = 0; // empty
+	}
+
+	fat->dcache_clock = 0;
+#endif
+	fat->fat_addr = bs_a + (fat->bs.reserved_sectors * bps);
+	fat->rd_addr = bs_a + (fat->bs.reserved_sectors + fat->bs.fat_size_sectors * fat->bs.num_fats) * (uint32_t) bps;
+	fat->data_addr = fat->rd_addr + (fat->bs.root_entries * 32); // entry is 32B long
+
+	fat->bs.bytes_per_cluster = (fat->bs.sectors_per_cluster * bps);
+
+	fat->free_count = 0xFFFFFFFF; // unknown
+	fat->next_free = 2;
+	fat->next_run = 2;
+	fat->fsi_addr = 0;
+	fat->fsi_dirty = false;
+	fat->no_window = false;
+
+	if (fat->bs.fat32)
+	{
+		// the root directory is a cluster chain
+		if (fat->bs.root_entries != 0 || fat->bs.root_cluster < 2 || fat->bs.root_cluster >= cluster_count(fat) + 2)
+			return false;
+
+		fat->rd_addr = clu_addr(fat, fat->bs.root_cluster);
+
+		if (fat->bs.fsinfo_sector != 0 && fat->bs.fsinfo_sector < fat->bs.reserved_sectors)
+			fsi_load(fat, bs_a + fat->bs.fsinfo_sector * (uint32_t) bps);
+	}
+
+#if FF_USE_JOURNAL
+	fat->jr_addr = 0;
+	fat->jr_buf = NULL;
+	fat->jr_bypass = false;
+	jr_open(fat);
+#endif
+
+#if FF_USE_SIDECAR
+	sc_open(fat);
+#endif
+
+	return true;
+}
+
+
+/** Fill a device area with zeros */
+void zero_fill(const BLOCKDEV* dev, const uint32_t addr, uint32_t len)
+{
+	static const uint8_t zeros[64];
+
+	dev->seek(addr);
+
+	while (len > 0)
+	{
+		const uint16_t chunk = (len > sizeof(zeros)) ? sizeof(zeros) : len;
+		dev->store(zeros, chunk);
+		len -= chunk;
+	}
+}
+
+
+/** Store a little-endian value into a buffer */
+void put_le(uint8_t* buf, uint32_t val, uint8_t bytes)
+{
+	for (uint8_t i = 0; i < bytes; i++, val >>= 8)
+	{
+		buf[i] = val & 0xFF;
+	}
+}
+
+
+/**
+ * Count clusters of a volume with given geometry, and compute the FAT size.
+ * fixed ... sectors before the data area, except the FATs
+ * align ... FAT size is rounded up to a multiple of this (sectors)
+ * ent   ... size of a FAT entry (2 or 4 bytes)
+ */
+uint32_t format_clusters(const uint32_t sectors, const uint8_t spc, const uint16_t bps,
+						 const uint32_t fixed, const uint16_t align, const uint8_t ent, uint32_t* fat_secs)
+{
+	// Iterate until the FAT size settles (it shrinks the data area)
+	uint32_t fs = align, clusters = 0;
+	for (uint8_t i = 0; i < 8; i++)
+	{
+		if (sectors <= fixed + 2 * fs) return 0;
+
+		clusters = (sectors - fixed - 2 * fs) / spc;
+		uint32_t need = ((clusters + 2) * ent + bps - 1) / bps;
+		need = (need + align - 1) / align * align;
+		if (need == fs) break;
+		fs = need;
+	}
+
+	// (if it didn't settle, don't use more clusters than the FAT holds)
+	if (clusters > fs * (bps / ent) - 2) clusters = fs * (bps / ent) - 2;
+
+	*fat_secs = fs;
+	return clusters;
+}
+
+
+bool ff_format(const BLOCKDEV* dev, uint32_t total_size, const FFORMAT* opts)
+{
+	FFJOB job;
+	if (!ff_job_format(&job, dev, total_size, opts))
+		return false;
+
+	while (ff_step(&job, 0));
+
+	return true;
+}
+
+
+bool ff_job_format(FFJOB* job, const BLOCKDEV* dev, uint32_t total_size, const FFORMAT* opts)
+{
+	static const FFORMAT defaults = { 0 };
+	if (opts == NULL) opts = &defaults;
+
+	const uint16_t bps = opts->bytes_per_sector ? opts->bytes_per_sector : 512;
+	if (bps < 512 || bps > 4096 || (bps & (bps - 1)) != 0) return false;
+
+	// FATs, root directory and clusters start on physical blocks
+	const uint16_t align = (FF_PHYS_BLOCK > bps) ? FF_PHYS_BLOCK / bps : 1;
+
+	// keeps the volume 4k-aligned
+	const uint32_t part_bytes = (FF_PHYS_BLOCK > 4096) ? FF_PHYS_BLOCK : 4096;
+	if (total_size / bps <= part_bytes / bps) return false;
+
+	const uint32_t sectors = total_size / bps - part_bytes / bps;
+
+	// FAT16: root directory fills whole sectors (blocks)
+	uint16_t root_secs = ((opts->root_entries ? opts->root_entries : 512) * 32 + bps - 1) / bps;
+	root_secs = (root_secs + align - 1) / align * align;
+	const uint16_t root_entries = root_secs * (bps / 32);
+
+	// FAT32: the root directory is a cluster, the reserved area has
+	// the FSInfo sector (1) and the backup boot sector (6)
+	const uint16_t reserved32 = (32 + align - 1) / align * align;
+
+	const uint8_t max_spc = 32768 / bps; // 32k clusters
+
+	uint8_t type = opts->fat_type;
+	if (type != 0 && type != 16 && type != 32) return false;
+
+	uint8_t spc = opts->sectors_per_cluster;
+	uint32_t fat_secs = 0;
+	uint32_t clusters;
+
+	if (spc == 0 && type != 32)
+	{
+		// Smallest cluster that keeps the cluster count in FAT16 range
+		for (spc = 1; spc < max_spc; spc <<= 1)
+		{
+			if (format_clusters(sectors, spc, bps, align + root_secs, align, 2, &fat_secs) <= 65524) break;
+		}
+
+		// Too large for FAT16 with clusters up to 4k, use FAT32
+		if (type == 0 && (uint32_t) spc * bps > 4096)
+		{
+			type = 32;
+			spc = 0; // chosen below
+		}
+		else
+		{
+			type = 16;
+
+			// Grow clusters to about 1/8 of a typical file, to keep
+			// chains short, while not wasting more than a few % on slack.
+			if (opts->avg_file_size > 0)
+			{
+				while (spc < max_spc && spc * bps * 8 < opts->avg_file_size) spc <<= 1;
+			}
+
+			// ...but keep enough clusters to be FAT16 (not FAT12)
+			while (spc > 1 && format_clusters(sectors, spc, bps, align + root_secs, align, 2, &fat_secs) < 4085) spc >>= 1;
+		}
+	}
+
+	if (spc == 0)
+	{
+		// FAT32: 4k clusters, or the typical file size as above
+		spc = (bps < 4096) ? 4096 / bps : 1;
+
+		if (opts->avg_file_size > 0)
+		{
+			while (spc < max_spc && spc * bps * 8 < opts->avg_file_size) spc <<= 1;
+		}
+
+		// ...but keep enough clusters to be FAT32
+		while (spc > 1 && format_clusters(sectors, spc, bps, reserved32, align, 4, &fat_secs) < 65525) spc >>= 1;
+	}
+
+	if (spc > max_spc || (spc & (spc - 1)) != 0) return false; // not a power of two
+
+	// Given cluster size: FAT16 if it has few enough clusters
+	if (type == 0)
+		type = (format_clusters(sectors, spc, bps, align + root_secs, align, 2, &fat_secs) <= 65524) ? 16 : 32;
+
+	const bool fat32 = (type == 32);
+	const uint16_t reserved = fat32 ? reserved32 : align; // boot sector, padded
+	const uint32_t fixed = fat32 ? reserved : reserved + root_secs;
+
+	clusters = format_clusters(sectors, spc, bps, fixed, align, fat32 ? 4 : 2, &fat_secs);
+	if (fat32 && (clusters < 65525 || clusters > 0x0FFFFFF5)) return false;
+	if (!fat32 && (clusters < 4085 || clusters > 65524)) return false; // fewer would be FAT12
+
+	uint8_t sec[90];
+
+	// --- MBR partition table entry (in device blocks) ---
+	for (uint8_t i = 0; i < 16; i++) sec[i] = 0;
+	if (fat32)
+		sec[4] = 0x0C; // FAT32, LBA
+	else
+		sec[4] = (sectors * (bps / 512) < 65536) ? 4 : 6; // FAT16 < 32M, FAT16
+	put_le(sec + 8, part_bytes / FF_LBA_SIZE, 4);
+	put_le(sec + 12, sectors * (bps / FF_LBA_SIZE), 4);
+
+	zero_fill(dev, 0, 512);
+	dev->seek(0x1BE);
+	dev->store(sec, 16);
+	dev->seek(510);
+	dev->write(0x55);
+	dev->write(0xAA);
+
+	// --- Boot sector ---
+	const uint32_t bs_a = part_bytes;
+	zero_fill(dev, bs_a, bps);
+
+	for (uint8_t i = 0; i < 90; i++) sec[i] = 0;
+	sec[0] = 0xEB; // jump to boot code
+	sec[1] = fat32 ? 0x58 : 0x3C;
+	sec[2] = 0x90;
+	for (uint8_t i = 0; i < 8; i++) sec[3 + i] = "MSWIN4.1"[i];
+	put_le(sec + 11, bps, 2); // bytes per sector
+	sec[13] = spc;
+	put_le(sec + 14, reserved, 2); // reserved sectors
+	sec[16] = 2; // number of FATs
+	if (!fat32)
+		put_le(sec + 17, root_entries, 2);
+	if (sectors < 65536 && !fat32)
+		put_le(sec + 19, sectors, 2);
+	else
+		put_le(sec + 32, sectors, 4);
+	sec[21] = 0xF8; // media: fixed disk
+	put_le(sec + 24, 32, 2); // sectors per track
+	put_le(sec + 26, 64, 2); // heads
+	put_le(sec + 28, part_bytes / bps, 4); // hidden sectors
+
+	// extended boot record, after the FAT32 fields
+	uint8_t* ext = sec + 36;
+	if (fat32)
+	{
+		put_le(sec + 36, fat_secs, 4);
+		put_le(sec + 44, 2, 4); // root directory cluster
+		put_le(sec + 48, 1, 2); // FSInfo sector
+		put_le(sec + 50, 6, 2); // backup boot sector
+		ext = sec + 64;
+	}
+	else
+	{
+		put_le(sec + 22, fat_secs, 2);
+	}
+
+	ext[0] = 0x80; // drive number
+	ext[2] = 0x29; // extended boot signature
+	put_le(ext + 3, total_size ^ (spc << 16) ^ 0x464D5431, 4); // volume serial
+
+	bool ended = (opts->label == NULL);
+	for (uint8_t i = 0; i < 11; i++)
+	{
+		if (!ended && opts->label[i] == 0) ended = true;
+		ext[7 + i] = ended ? ' ' : opts->label[i];
+	}
+
+	for (uint8_t i = 0; i < 8; i++) ext[18 + i] = (fat32 ? "FAT32   " : "FAT16   ")[i];
+
+	dev->seek(bs_a);
+	dev->store(sec, fat32 ? 90 : 62);
+
+	// The boot sector signature is written last (format_unit),
+	// so an unfinished format is not mounted.
+
+	// --- Reserved sectors, FATs and root directory, cleared by ff_step() ---
+	// (the FAT32 root directory is the first cluster)
+	job->kind = FJ_FORMAT;
+	job->fat = NULL;
+	job->dev = dev;
+	job->base = bs_a;
+	job->pos = bs_a + bps;
+	job->end = bs_a + (fixed + 2 * fat_secs + (fat32 ? spc : 0)) * bps;
+	job->depth = 0;
+	job->result = 0;
+
+	return true;
+}
+
+
+/** Clear 512 bytes of a volume being formatted, finish at the end */
+static bool format_unit(FFJOB* job)
+{
+	const BLOCKDEV* dev = job->dev;
+
+	if (job->pos < job->end)
+	{
+		zero_fill(dev, job->pos, 512);
+		job->pos += 512;
+		job->result++;
+		return true;
+	}
+
+	// geometry, from the boot sector written at the start
+	Fat16BootSector bs;
+	read_bs(dev, &bs, job->base);
+
+	const uint16_t bps = bs.bytes_per_sector;
+	const uint32_t fat_a = job->base + bs.reserved_sectors * bps;
+
+	uint8_t sec[12];
+	if (bs.fat32)
+	{
+		put_le(sec, 0x0FFFFFF8, 4); // media descriptor
+		put_le(sec + 4, 0x0FFFFFFF, 4); // clean shutdown, no errors
+		put_le(sec + 8, 0x0FFFFFFF, 4); // root directory, one cluster
+	}
+	else
+	{
+		put_le(sec, 0xFFF8, 2); // media descriptor
+		put_le(sec + 2, 0xFFFF, 2); // clean shutdown, no errors
+	}
+
+	for (uint8_t i = 0; i < 2; i++)
+	{
+		dev->seek(fat_a + (uint32_t) i * bs.fat_size_sectors * bps);
+		dev->store(sec, bs.fat32 ? 12 : 4);
+	}
+
+	if (bs.fat32)
+	{
+		// FSInfo and its backup: all clusters but the root directory are free
+		uint8_t lead[4];
+		uint8_t fsi[28] = { 0 };
+		put_le(lead, FSI_LEAD, 4);
+		put_le(fsi, FSI_STRUC, 4);
+		put_le(fsi + 4, bs_clusters(&bs) - 1, 4);
+		put_le(fsi + 8, 3, 4); // next free
+		put_le(fsi + 24, FSI_TRAIL, 4);
+
+		const uint16_t at[2] = { bs.fsinfo_sector, 7 };
+		for (uint8_t i = 0; i < 2; i++)
+		{
+			dev->seek(job->base + at[i] * bps);
+			dev->store(lead, 4);
+			dev->rseek(480);
+			dev->store(fsi, 28);
+		}
+
+		// Backup boot sector
+		uint8_t copy[90];
+		dev->seek(job->base);
+		dev->load(copy, 90);
+		dev->seek(job->base + 6 * bps);
+		dev->store(copy, 90);
+		dev->seek(job->base + 6 * bps + 510);
+		dev->write(0x55);
+		dev->write(0xAA);
+	}
+
+	dev->seek(job->base + 510);
+	dev->write(0x55);
+	dev->write(0xAA);
+
+	dev->flush();
+
+	return false;
+}
+
+
+/**
+ * Move file cursor to a position relative to file start
+ * Allows seek past end of file, will allocate new cluster if needed.
+ */
+bool ff_seek(FFILE* file, uint32_t addr)
+{
+	return seek_file(file, addr, true);
+}
+
+
+bool seek_file(FFILE* file, uint32_t addr, const bool at_end)
+{
+	STAT_OP(file->fat, FF_OP_SEEK);
+
+	const FAT16* fat = file->fat;
+
+	// Store as rel
+	file->cur_rel = addr;
+
+	// Rewind and resolve abs, clu, ofs
+	file->cur_clu = file->clu_start;
+
+	while (addr >= fat->bs.bytes_per_cluster)
+	{
+		uint32_t next;
+
+		// Go to next cluster, allocate if needed
+		do
+		{
+			next = next_clu(fat, file->cur_clu);
+			if (at_end && next == CLU_END && file->cur_rel == file->size && addr == fat->bs.bytes_per_cluster)
+			{
+				// EOF right at the end of the last cluster -
+				// stay there, a write will allocate when needed.
+				file->cur_abs = clu_addr(fat, file->cur_clu) + addr;
+				file->cur_ofs = addr;
+				dev_seek(fat, file->cur_abs);
+				return true;
+			}
+
+			if (next == CLU_END)
+			{
+				// reached end of allocated space
+				// add one more cluster
+				if (!append_cluster(fat, file->cur_clu))
+				{
+					return false;
+				}
+			}
+		}
+		while (next == CLU_END);
+
+		file->cur_clu = next;
+		addr -= fat->bs.bytes_per_cluster;
+	}
+
+	file->cur_abs = clu_addr(fat, file->cur_clu) + addr;
+	file->cur_ofs = addr;
+
+	// Physically seek to that location
+	dev_seek(fat, file->cur_abs);
+
+	return true;
+}
+
+
+/**
+ * Check if file is a regular file or directory entry.
+ * Those files can be shown to user.
+ */
+bool ff_is_regular(const FFILE* file)
+{
+	switch (file->type)
+	{
+		case FT_FILE:
+		case FT_SUBDIR:
+		case FT_SELF:
+		case FT_PARENT:
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+uint16_t ff_read(FFILE* file, void* target, uint16_t len)
+{
+	STAT_OP(file->fat, FF_OP_READ);
+
+	if (file->cur_rel + len > file->size)
+	{
+		if (file->cur_rel > file->size) return 0;
+		len = file->size - file->cur_rel;
+		//return false; // Attempt to read more than what is available
+	}
+
+	const uint16_t len_orig = len;
+
+	const FAT16* fat = file->fat;
+
+	while (len > 0 && file->cur_rel < file->size)
+	{
+		// How much can be read from the cluster
+		uint16_t chunk = MIN(file->size - file->cur_rel, MIN(fat->bs.bytes_per_cluster - file->cur_ofs, len));
+
+		// Extend it over following clusters that are adjacent on the device
+		uint32_t last = file->cur_clu;
+		uint16_t more = 0;
+		if (file->cur_ofs + chunk == fat->bs.bytes_per_cluster && len > chunk)
+		{
+			more = clu_run(fat, file->cur_clu, len - chunk, 0xFFFF - chunk, &last);
+		}
+
+		// read the chunk
+		dev_seek(fat, file->cur_abs);
+		dev_load(fat, target, chunk + more);
+
+		// move the cursors
+		if (more > 0)
+		{
+			const uint16_t tail = ((more - 1) % fat->bs.bytes_per_cluster) + 1;
+
+			file->cur_clu = last;
+			file->cur_abs = clu_addr(fat, last) + tail;
+			file->cur_ofs = tail;
+		}
+		else
+		{
+			file->cur_abs += chunk;
+			file->cur_ofs += chunk;
+		}
+
+		chunk += more;
+		file->cur_rel += chunk;
+
+		// move target pointer
+		target += chunk;
+
+		// reached end of cluster?
+		if (file->cur_ofs >= fat->bs.bytes_per_cluster)
+		{
+			file->cur_clu = next_clu(fat, file->cur_clu);
+			file->cur_abs = clu_addr(fat, file->cur_clu);
+			file->cur_ofs = 0;
+		}
+
+		// subtract read length
+		len -= chunk;
+	}
+
+	return len_orig;
+}
+
+
+bool ff_write_str(FFILE* file, const char* source)
+{
+	uint16_t len = 0;
+	for (; source[len] != 0; len++);
+
+	return ff_write(file, source, len);
+}
+
+
+bool ff_write(FFILE* file, const void* source, uint32_t len)
+{
+	STAT_OP(file->fat, FF_OP_WRITE);
+
+	const FAT16* fat = file->fat;
+
+
+	if (len == 0)
+		return true;
+
+	// Attempt to write past end of file
+	if (file->cur_rel + len >= file->size)
+	{
+		const uint32_t pos_start = file->cur_rel;
+
+		// Seek to the last written byte
+		// -> allocates clusters, also the one of a byte right at EOF
+		if (!seek_file(file, pos_start + len - 1, false))
+		{
+			// disk full - put the cursor back, so a flush can trim the chain
+			ff_seek(file, pos_start);
+			return false;
+		}
+
+		const uint32_t tail = file->cur_clu;
+
+		// Write starts beyond EOF - creating a zero-filled "hole"
+		if (pos_start > file->size + 1)
+		{
+			// Seek to the end of valid data (the clusters are there now)
+			seek_file(file, file->size, false);
+
+			// fill space between EOF and start-of-write with zeros
+			uint32_t fill = pos_start - file->size;
+
+			// repeat until all "fill" zeros are stored
+			while (fill > 0)
+			{
+				// How much will fit into this cluster
+				const uint16_t chunk = MIN(fat->bs.bytes_per_cluster - file->cur_ofs, fill);
+
+				// write the zeros
+				dev_seek(fat, file->cur_abs);
+#if FF_USE_JOURNAL
+				JR(fat)->jr_bypass = true; // file contents are not journaled
+#endif
+				dev_zero(fat, chunk);
+#if FF_USE_JOURNAL
+				JR(fat)->jr_bypass = false;
+#endif
+
+				// subtract from "needed" what was just placed
+				fill -= chunk;
+
+				// advance cursors to the next cluster
+				file->cur_clu = next_clu(fat, file->cur_clu);
+				file->cur_abs = clu_addr(fat, file->cur_clu);
+				file->cur_ofs = 0;
+			}
+		}
+
+		// Store new size
+		if (pos_start + len > file->size)
+		{
+			file->size = pos_start + len;
+#if FF_MAX_DIRTY > 0
+			dirty_mark(file, tail);
+#else
+			(void) tail;
+#endif
+		}
+
+		// Seek back to where it was before
+		ff_seek(file, pos_start);
+	} // (end zerofill)
+
+
+#if FF_USE_JOURNAL
+	JR(fat)->jr_bypass = true; // file contents are not journaled
+#endif
+
+	// write the data
+	while (len > 0)
+	{
+		uint16_t chunk;
+
+		if (len == 1)
+		{
+			dev_seek(fat, file->cur_abs);
+			dev_write(fat, *((uint8_t*)source));
+			file->cur_abs++;
+			file->cur_rel++;
+			file->cur_ofs++;
+			chunk = 1;
+
+		}
+		else
+		{
+			// How much can be stored in this cluster
+			chunk = MIN(fat->bs.bytes_per_cluster - file->cur_ofs, len);
+
+			// Extend it over following clusters that are adjacent on the device
+			// (all are allocated by now)
+			uint32_t last = file->cur_clu;
+			uint16_t more = 0;
+			if (file->cur_ofs + chunk == fat->bs.bytes_per_cluster && len > chunk)
+			{
+				more = clu_run(fat, file->cur_clu, len - chunk, 0xFFFF - chunk, &last);
+			}
+
+			dev_seek(fat, file->cur_abs);
+			dev_store(fat, source, chunk + more);
+
+			// advance cursors
+			if (more > 0)
+			{
+				const uint16_t tail = ((more - 1) % fat->bs.bytes_per_cluster) + 1;
+
+				file->cur_clu = last;
+				file->cur_abs = clu_addr(fat, last) + tail;
+				file->cur_ofs = tail;
+			}
+			else
+			{
+				file->cur_abs += chunk;
+				file->cur_ofs += chunk;
+			}
+
+			chunk += more;
+			file->cur_rel += chunk;
+
+			// Pointer arith!
+			source += chunk; // advance the source pointer
+		}
+
+		// detect cluster overflow
+		if (file->cur_ofs >= fat->bs.bytes_per_cluster)
+		{
+			// advance to following cluster
+			file->cur_clu = next_clu(fat, file->cur_clu);
+			file->cur_abs = clu_addr(fat, file->cur_clu);
+			file->cur_ofs = 0;
+		}
+
+		// subtract written length
+		len -= chunk;
+	}
+
+#if FF_USE_JOURNAL
+	JR(fat)->jr_bypass = false;
+#endif
+
+	return true;
+}
+
+
+
+/** Open next file in the directory */
+bool ff_next(FFILE* file)
+{
+	STAT_OP(file->fat, FF_OP_NEXT);
+
+	const FAT16* fat = file->fat;
+
+	const uint16_t num = file->num + 1;
+
+	if (file->clu == 0 && num >= fat->bs.root_entries)
+		return false; // attempt to read outside root directory.
+
+	// Continue from the cluster of the current entry, instead of
+	// walking the directory chain from its start.
+	uint32_t ent_clu = file->ent_clu;
+	if (file->clu != 0 && (num * 32) % fat->bs.bytes_per_cluster == 0)
+	{
+		ent_clu = next_clu(fat, ent_clu);
+		if (ent_clu == CLU_END)
+			return false; // next file is out of the directory cluster
+	}
+
+	// read first byte of the file entry
+	dev_seek(fat, dir_entry_addr(fat, file->clu, num, ent_clu));
+	if (dev_read(fat) == 0)
+		return false; // can't read (file is NONE)
+
+	open_entry(fat, file, file->clu, num, ent_clu);
+
+	return true;
+}
+
+
+/** Open previous file in the directory */
+bool ff_prev(FFILE* file)
+{
+	STAT_OP(file->fat, FF_OP_PREV);
+
+	if (file->num == 0)
+		return false; // first file already
+
+	open_file(file->fat, file, file->clu, file->num - 1);
+
+	return true;
+}
+
+
+/** Rewind to first file in directory */
+void ff_first(FFILE* file)
+{
+	STAT_OP(file->fat, FF_OP_FIRST);
+
+	open_file(file->fat, file, file->clu, 0);
+}
+
+
+/** Open a directory denoted by the file. */
+bool ff_opendir(FFILE* dir)
+{
+	STAT_OP(dir->fat, FF_OP_OPENDIR);
+
+	// Don't open non-dirs and "." directory.
+	if (!(dir->attribs & FA_DIR) || dir->type == FT_SELF)
+		return false;
+
+	open_file(dir->fat, dir, dir->clu_start, 0);
+	return true;
+}
+
+
+void ff_root(const FAT16* fat, FFILE* file)
+{
+	STAT_OP(fat, FF_OP_ROOT);
+
+	open_file(fat, file, root_dir(fat), 0);
+}
+
+
+/** Find a file by display name (or long name) in an open directory, and open it. */
+bool dir_find_name(FFILE* dir, const char* name)
+{
+	char fname[11];
+
+	// "." and ".." entries
+	if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+		return dir_find_file_raw(dir, name[1] ? "..         " : ".          ");
+
+#if FF_USE_LFN
+	if (name_fits_sfn(name, true))
+	{
+		sfn_name(name, fname);
+		if (dir_find_file_raw(dir, fname)) return true;
+	}
+
+	return lfn_find(dir, name);
+#else
+	ff_rawname(name, fname);
+	return dir_find_file_raw(dir, fname);
+#endif
+}
+
+
+/**
+ * Find a file with given "display name" in this directory.
+ * If file is found, "dir" will contain it's handle.
+ */
+bool ff_find(FFILE* file, const char* name)
+{
+	STAT_OP(file->fat, FF_OP_FIND);
+
+	// save orig pos
+	FSAVEPOS orig = ff_savepos(file);
+
+	bool ret = dir_find_name(file, name);
+
+	if (!ret)
+		ff_reopen(file, &orig);
+
+	return ret;
+}
+
+
+/**
+ * Find a file in the directory open in "file", using the entry cache.
+ * If not found, the handle is unchanged.
+ */
+static bool dir_lookup(FFILE* file, const char* name, const uint16_t len)
+{
+#if FF_DCACHE_SIZE > 0
+	const FAT16* fat = file->fat;
+	const uint32_t dir = file->clu;
+	const uint32_t hash = dcache_hash(name, len);
+	FFDENTRY* e = dcache_get(fat, dir, name, hash, len);
+
+	if (e != NULL)
+	{
+		if (e->num == 0xFFFF)
+			return false; // known to be missing
+
+		open_entry(fat, file, dir, e->num, e->ent_clu);
+		if (entry_has_name(file, name))
+			return true;
+
+		// stale, look it up again
+		e->hash = 0;
+		open_file(fat, file, dir, 0);
+	}
+#endif
+
+	const bool found = ff_find(file, name);
+
+#if FF_DCACHE_SIZE > 0
+	dcache_put(fat, dir, name, hash, len, found ? file->num : 0xFFFF, file->ent_clu);
+#else
+	(void) len;
+#endif
+
+	return found;
+}
+
+
+/** Longest path component */
+#if FF_USE_LFN
+#define PATH_NAME_MAX (FF_LFN_MAX * 3)
+#else
+#define PATH_NAME_MAX 12
+#endif
+
+
+bool ff_open_path(const FAT16* fat, const char* path, FFILE* file)
+{
+	STAT_OP(fat, FF_OP_OPENPATH);
+
+	ff_root(fat, file);
+
+	char name[PATH_NAME_MAX + 1];
+	bool in_dir = true; // "file" is a directory listing
+
+	const char* p = path;
+	while (true)
+	{
+		while (*p == '/' || *p == '\\') p++; // separators
+
+		if (*p == 0)
+			return true; // end of path
+
+		uint16_t len = 0;
+		for (; p[len] != 0 && p[len] != '/' && p[len] != '\\'; len++)
+		{
+			if (len == PATH_NAME_MAX) return false; // too long
+			name[len] = p[len];
+		}
+
+		name[len] = 0;
+		p += len;
+
+		if (len == 1 && name[0] == '.')
+			continue; // this directory
+
+		// descend into the last found entry
+		if (!in_dir && !ff_opendir(file))
+			return false; // not a directory
+
+		if (!dir_lookup(file, name, len))
+			return false;
+
+		in_dir = false;
+	}
+}
+
+
+/**
+ * Go through a directory, and "open" the first of "count" consecutive
+ * FT_NONE or FT_DELETED file entries. The directory is extended if needed.
+ *
+ * The search starts at the free slot hint of the handle, if it's for this
+ * directory; the hint is then moved past the used slots.
+ */
+bool find_empty_slots(FFILE* file, const uint8_t count)
+{
+	const uint32_t clu = file->clu;
+	const FAT16* fat = file->fat;
+	const uint16_t per_clu = fat->bs.bytes_per_cluster / 32;
+
+	// Where to start. The hint is usable only if the entry before it
+	// is not the end of the directory (it could be stale after compaction).
+	uint16_t num = 0;
+	if (file->free_dir == clu && file->free_num > 0 &&
+			!(clu == 0 && file->free_num > fat->bs.root_entries))
+	{
+		const uint16_t last = file->free_num - 1;
+		const uint32_t last_clu = dir_entry_clu(fat, clu, last);
+
+		if (last_clu != CLU_END)
+		{
+			dev_seek(fat, dir_entry_addr(fat, clu, last, last_clu));
+			if (dev_read(fat) != 0x00) num = file->free_num;
+		}
+	}
+
+	uint32_t ent_clu = dir_entry_clu(fat, clu, num);
+	if (ent_clu == CLU_END)
+	{
+		// hint is just past the last cluster
+		if (!append_cluster(fat, dir_entry_clu(fat, clu, num - 1))) return false;
+		ent_clu = dir_entry_clu(fat, clu, num);
+	}
+
+	uint16_t run = 0; // free entries found in a row
+	uint16_t run_num = 0; // first of them
+	uint32_t run_clu = 0;
+	uint16_t first_free = 0xFFFF; // first free entry seen
+
+	// Find free directory entries that can be used
+	for (const uint16_t start = num; num < 0xFFFF; num++)
+	{
+		// root directory has fewer entries, error if trying
+		// to add one more.
+		if (clu == 0 && num >= fat->bs.root_entries)
+			return false;
+
+		// Step to the next cluster of the directory
+		if (clu != 0 && num > start && num % per_clu == 0)
+		{
+			const uint32_t prev = ent_clu;
+			ent_clu = next_clu(fat, prev);
+
+			if (ent_clu == CLU_END)
+			{
+				// end of chain of allocated clusters for the directory
+				// append new cluster to the last one, return false on failure
+				if (!append_cluster(fat, prev)) return false;
+				ent_clu = next_clu(fat, prev);
+			}
+		}
+
+		// Check if can be overwritten
+		dev_seek(fat, dir_entry_addr(fat, clu, num, ent_clu));
+		const uint8_t c = dev_read(fat);
+
+		if (c == 0x00 || c == 0xE5)
+		{
+			if (first_free == 0xFFFF) first_free = num;
+
+			if (run++ == 0)
+			{
+				run_num = num;
+				run_clu = ent_clu;
+			}
+
+			if (run == count)
+			{
+				// Open the file entry
+				open_entry(fat, file, clu, run_num, run_clu);
+
+				// a shorter gap before the run can still take a short name
+				file->free_dir = clu;
+				file->free_num = (first_free < run_num) ? first_free : run_num + count;
+				return true;
+			}
+		}
+		else
+		{
+			run = 0;
+		}
+	}
+
+	return false; // not found.
+}
+
+
+/**
+ * Reserve slots for a new name in the directory the handle is in,
+ * and write its long name entries. The handle is left at the slot
+ * of the short entry, its raw name is stored into "fname" and its
+ * case bits (byte 12 of the entry) into "lcase".
+ *
+ * self ... an entry that may have the name already (rename), or NULL
+ *
+ * Returns false if the name exists, is not valid, or there is no room.
+ */
+static bool place_name(FFILE* file, const char* name, const FFILE* self, char* fname, uint8_t* lcase)
+{
+	const FSAVEPOS orig = ff_savepos(file);
+
+	// Abort if file already exists
+	bool exists = dir_find_name(file, name);
+	if (exists && self != NULL && file->clu == self->clu && file->num == self->num)
+		exists = false; // only a new spelling of the same name
+
+	ff_first(file); // rewind dir
+	if (exists)
+	{
+		ff_reopen(file, &orig);
+		return false; // file already exists in the dir.
+	}
+
+	// Convert filename to zero padded raw string
+	uint8_t lfn_count = 0;
+	*lcase = 0;
+
+#if FF_USE_LFN
+	uint16_t ucs[LFN_MAX_ENTRIES * 13];
+	uint16_t len = 0;
+
+	if (name_fits_sfn(name, false))
+	{
+		*lcase = sfn_name(name, fname);
+	}
+	else
+	{
+		len = utf8_to_ucs(name, ucs);
+
+		// find a free alias
+		uint16_t n = 1;
+		while (len > 0 && make_alias(name, n, fname) && dir_find_file_raw(file, fname))
+			n++;
+
+		if (len == 0 || n > 9999)
+		{
+			ff_reopen(file, &orig);
+			return false; // bad name, or out of aliases
+		}
+
+		lfn_count = (len + 12) / 13;
+	}
+#else
+	ff_rawname(name, fname);
+#endif
+
+	if (!find_empty_slots(file, lfn_count + 1))
+	{
+		ff_reopen(file, &orig);
+		return false; // error finding a slot
+	}
+
+#if FF_USE_LFN
+	if (lfn_count > 0)
+		lfn_write(file, ucs, len, fname);
+#endif
+
+	dir_changed(file->fat, file->clu, false);
+
+	return true;
+}
+
+
+/** Store the case bits of an entry just written */
+static void store_lcase(const FFILE* file, const uint8_t lcase)
+{
+	dev_seek(file->fat, dir_entry_addr(file->fat, file->clu, file->num, file->ent_clu) + 12);
+	dev_write(file->fat, lcase);
+}
+
+
+/**
+ * Give back the slots of a name placed by place_name(), when the file
+ * can't be created after all. "file" is at the slot of the short entry,
+ * which is still free; its long name entries are marked deleted.
+ */
+static void release_name(FFILE* file, const char* fname)
+{
+#if FF_USE_LFN
+	FFILE named = *file;
+	named.type = FT_FILE;
+	for (uint8_t i = 0; i < 11; i++) named.name[i] = fname[i];
+
+	const uint8_t lfn_count = lfn_erase(&named);
+#else
+	(void) fname;
+	const uint8_t lfn_count = 0;
+#endif
+
+	// Move the free slot hint back to them
+	if (file->free_dir == file->clu && file->num - lfn_count < file->free_num)
+		file->free_num = file->num - lfn_count;
+}
+
+
+/**
+ * Create a file entry with a new cluster, in the directory open in "file".
+ * If successful, the new entry is opened into "file"; otherwise it's unchanged.
+ */
+bool create_entry(FFILE* file, const char* name, const uint8_t attribs)
+{
+	const FSAVEPOS orig = ff_savepos(file);
+
+	char fname[11];
+	uint8_t lcase;
+	if (!place_name(file, name, NULL, fname, &lcase))
+		return false;
+
+	// Write into the new slot
+	const uint32_t newclu = alloc_cluster(file->fat);
+	if (newclu == CLU_END)
+	{
+		// disk full
+		release_name(file, fname);
+		ff_reopen(file, &orig);
+		return false;
+	}
+
+	write_file_header(file, fname, attribs, newclu);
+	if (lcase) store_lcase(file, lcase);
+
+	return true;
+}
+
+
+
+bool ff_newfile(FFILE* file, const char* name)
+{
+	STAT_OP(file->fat, FF_OP_NEWFILE);
+
+	return create_entry(file, name, 0);
+}
+
+
+/**
+ * Create a sub-directory of given name.
+ * Directory is allocated and populated with entries "." and ".."
+ */
+bool ff_mkdir(FFILE* file, const char* name)
+{
+	STAT_OP(file->fat, FF_OP_MKDIR);
+
+	if (!create_entry(file, name, FA_DIR))
+		return false;
+
+	const uint32_t newclu = file->clu_start;
+	const uint32_t parent_clu = file->clu;
+	open_file(file->fat, file, newclu, 0);
+
+	write_file_header(file, ".          ", FA_DIR, newclu);
+
+	// Advance to next file slot
+	find_empty_slots(file, 1);
+
+	write_file_header(file, "..         ", FA_DIR, parent_ref(file->fat, parent_clu));
+
+	// rewind.
+	ff_first(file);
+
+	return true;
+}
+
+
+/** Name table of ff_newfiles() - hashes of the names in a directory */
+typedef struct
+{
+	uint32_t* keys; // name hash, 0 = empty slot
+	uint16_t* nums; // entry holding the name
+	uint32_t cap;   // power of two
+	uint32_t used;
+} NameTable;
+
+
+/** Hash of a raw name, or of a case-folded long name (kind 1) */
+static uint32_t name_key(const void* name, const uint16_t len, const uint8_t kind)
+{
+	uint32_t h = 2166136261u ^ kind; // FNV-1a
+	for (uint16_t i = 0; i < len; i++)
+	{
+		const uint16_t c = (kind == 0) ? ((const uint8_t*) name)[i] : ((const uint16_t*) name)[i];
+		h = (h ^ ((kind == 0) ? c : (c >= 'a' && c <= 'z' ? c - 32 : c))) * 16777619u;
+	}
+
+	return h ? h : 1;
+}
+
+
+static bool names_add(NameTable* t, const uint32_t key, const uint16_t num)
+{
+	if ((t->used + 1) * 2 > t->cap)
+	{
+		// grow & rehash
+		NameTable g = { .cap = t->cap ? t->cap * 2 : 256 };
+		g.keys = calloc(g.cap, sizeof(uint32_t));
+		g.nums = malloc(g.cap * sizeof(uint16_t));
+
+		if (g.keys == NULL || g.nums == NULL)
+		{
+			free(g.keys);
+			free(g.nums);
+			return false;
+		}
+
+		for (uint32_t i = 0; i < t->cap; i++)
+		{
+			if (t->keys[i] != 0) names_add(&g, t->keys[i], t->nums[i]);
+		}
+
+		free(t->keys);
+		free(t->nums);
+		*t = g;
+	}
+
+	uint32_t i = key & (t->cap - 1);
+	while (t->keys[i] != 0) i = (i + 1) & (t->cap - 1);
+
+	t->keys[i] = key;
+	t->nums[i] = num;
+	t->used++;
+	return true;
+}
+
+
+/**
+ * Check if a name is in the table. Hash matches are verified
+ * on the disk - "dir" is used for that (it's moved).
+ */
+static bool names_has(const NameTable* t, FFILE* dir, const void* name, const uint16_t len, const uint8_t kind)
+{
+	if (t->cap == 0) return false;
+
+	const uint32_t key = name_key(name, len, kind);
+
+	for (uint32_t i = key & (t->cap - 1); t->keys[i] != 0; i = (i + 1) & (t->cap - 1))
+	{
+		if (t->keys[i] != key) continue;
+
+		open_file(dir->fat, dir, dir->clu, t->nums[i]);
+
+		if (kind == 0)
+		{
+			uint8_t raw[11];
+			for (uint8_t j = 0; j < 11; j++) raw[j] = dir->name[j];
+			if (raw[0] == 0xE5) raw[0] = 0x05; // the table has it as on disk
+
+			bool same = true;
+			for (uint8_t j = 0; j < 11; j++)
+			{
+				if (raw[j] != ((const uint8_t*) name)[j]) same = false;
+			}
+
+			if (same) return true;
+		}
+#if FF_USE_LFN
+		else
+		{
+			uint16_t have[LFN_MAX_ENTRIES * 13];
+			const uint16_t have_len = lfn_read(dir, have, NULL);
+			if (lfn_equal(have, have_len, name, len)) return true;
+		}
+#endif
+	}
+
+	return false;
+}
+
+
+uint16_t ff_newfiles(FFILE* dir, const char* const* names, const uint16_t count, FSAVEPOS* created)
+{
+	STAT_OP(dir->fat, FF_OP_NEWFILES);
+
+	const FAT16* fat = dir->fat;
+	const uint32_t first = dir->clu;
+	const uint16_t per_clu = fat->bs.bytes_per_cluster / 32;
+	const uint16_t limit = (first == 0) ? fat->bs.root_entries : 0xFFFF;
+	const FSAVEPOS orig = ff_savepos(dir);
+	const bool orig_cursor = (dir->type == FT_FILE || dir->type == FT_SUBDIR ||
+								dir->type == FT_SELF || dir->type == FT_PARENT);
+
+	NameTable table = { 0 };
+	uint16_t done = 0;
+	bool ok = true;
+
+	// 1. Read the directory once, collecting names of the existing files
+	uint8_t ent[32];
+	uint32_t ent_clu = first;
+
+#if FF_USE_LFN
+	LfnAcc* acc = calloc(1, sizeof(LfnAcc));
+	ok = (acc != NULL);
+#endif
+
+	for (uint16_t num = 0; ok && num < limit; num++)
+	{
+		if (first != 0 && num > 0 && num % per_clu == 0)
+		{
+			ent_clu = next_clu(fat, ent_clu);
+			if (ent_clu == CLU_END) break; // end of chain
+		}
+
+		dev_seek(fat, dir_entry_addr(fat, first, num, ent_clu));
+		dev_load(fat, ent, 32);
+
+		if (ent[0] == 0x00) break; // end of directory
+		if (ent[0] == 0xE5) continue; // deleted
+
+#if FF_USE_LFN
+		if (lfn_acc_feed(acc, ent)) continue;
+
+		const uint16_t len = lfn_acc_finish(acc, ent);
+		if (len > 0)
+			ok = names_add(&table, name_key(acc->ucs, len, 1), num);
+#endif
+
+		ok = ok && names_add(&table, name_key(ent, 11, 0), num);
+	}
+
+	for (uint16_t i = 0; created && i < count; i++)
+	{
+		created[i].num = 0xFFFF; // not created
+	}
+
+	// 2. Create the files, continuing from the free slot hint
+	for (uint16_t i = 0; ok && i < count; i++)
+	{
+		char fname[11];
+		uint8_t lfn_count = 0;
+		uint8_t lcase = 0;
+
+#if FF_USE_LFN
+		uint16_t ucs[LFN_MAX_ENTRIES * 13];
+		uint16_t len = 0;
+
+		if (name_fits_sfn(names[i], false))
+		{
+			lcase = sfn_name(names[i], fname);
+			if (fname[0] == (char) 0xE5) fname[0] = 0x05;
+			if (names_has(&table, dir, fname, 11, 0)) continue; // exists
+		}
+		else
+		{
+			len = utf8_to_ucs(names[i], ucs);
+			if (len == 0 || names_has(&table, dir, ucs, len, 1)) continue; // bad name, or exists
+
+			if (name_fits_sfn(names[i], true))
+			{
+				sfn_name(names[i], fname);
+				if (names_has(&table, dir, fname, 11, 0)) continue; // exists in another case
+			}
+
+			uint16_t n = 1;
+			while (make_alias(names[i], n, fname) && names_has(&table, dir, fname, 11, 0))
+				n++;
+
+			if (n > 9999) continue; // out of aliases
+
+			lfn_count = (len + 12) / 13;
+		}
+#else
+		ff_rawname(names[i], fname);
+		if (fname[0] == (char) 0xE5) fname[0] = 0x05;
+		if (names_has(&table, dir, fname, 11, 0)) continue; // exists
+#endif
+
+		// Hint from the previous file makes this cheap
+		if (!find_empty_slots(dir, lfn_count + 1))
+			break; // directory or disk full
+
+#if FF_USE_LFN
+		if (lfn_count > 0)
+			lfn_write(dir, ucs, len, fname);
+#endif
+
+		const uint32_t newclu = alloc_cluster(fat);
+		if (newclu == CLU_END)
+		{
+			release_name(dir, fname);
+			break; // disk full
+		}
+
+		write_file_header(dir, fname, 0, newclu);
+		if (lcase) store_lcase(dir, lcase);
+
+		ok = names_add(&table, name_key(fname, 11, 0), dir->num);
+#if FF_USE_LFN
+		if (ok && lfn_count > 0)
+			ok = names_add(&table, name_key(ucs, len, 1), dir->num);
+#endif
+
+		if (created) created[i] = ff_savepos(dir);
+		done++;
+	}
+
+#if FF_USE_LFN
+	free(acc);
+#endif
+	free(table.keys);
+	free(table.nums);
+
+	if (done > 0) dir_changed(fat, first, false);
+
+	// Back to the original entry. A free slot may hold a new file now,
+	// and the saved cursor is only valid if the entry had one.
+	open_file(fat, dir, orig.clu, orig.num);
+	if (orig_cursor && orig.cur_rel != 0) ff_seek(dir, orig.cur_rel);
+
+	return done;
+}
+
+
+char* ff_disk_label(const FAT16* fat, char* label_out)
+{
+	FFILE first;
+	ff_root(fat, &first);
+
+	if (first.type == FT_LABEL)
+	{
+		return ff_dispname(&first, label_out);
+	}
+
+	// find where spaces end
+	int8_t j = 10;
+	for (; j >= 0; j--)
+	{
+		if (fat->bs.volume_label[j] != ' ') break;
+	}
+
+	// copy all until spaces
+	uint8_t i;
+	for (i = 0; i <= j; i++)
+	{
+		label_out[i] = fat->bs.volume_label[i];
+	}
+
+	label_out[i] = 0; // ender
+
+	return label_out;
+}
+
+
+char* ff_dispname(const FFILE* file, char* disp_out)
+{
+	// Cannot get name for special files
+	if (file->type == FT_NONE ||        // not-yet-used directory location
+			file->type == FT_DELETED ||     // deleted file entry
+			file->attribs == 0x0F)          // long name special entry (system, hidden)
+		return NULL;
+
+	// find first non-space
+	int8_t j = 7;
+	for (; j >= 0; j--)
+	{
+		if (file->name[j] != ' ') break;
+	}
+
+	// j ... last no-space char
+
+	uint8_t i;
+	for (i = 0; i <= j; i++)
+	{
+		disp_out[i] = file->name[i];
+	}
+
+
+	// directory entry, no extension
+	if (file->type == FT_SUBDIR || file->type == FT_SELF || file->type == FT_PARENT)
+	{
+		disp_out[i] = 0; // end of string
+		return disp_out;
+	}
+
+
+	// add a dot
+	if (file->type != FT_LABEL) // volume label has no dot!
+		disp_out[i++] = '.';
+
+	// Add extension chars
+	for (j = 8; j < 11; j++, i++)
+	{
+		const char c = file->name[j];
+		if (c == ' ') break;
+		disp_out[i] = c;
+	}
+
+	disp_out[i] = 0; // end of string
+
+	return disp_out;
+}
+
+
+char* ff_rawname(const char* disp_in, char* raw_out)
+{
+	uint8_t name_c = 0, wr_c = 0;
+	bool filling = false;
+	bool at_ext = false;
+	for (; wr_c < 11; wr_c++)
+	{
+		// start filling with spaces if end of filename reached
+		uint8_t c = disp_in[name_c];
+		// handle special rule for 0xE5
+		if (name_c == 0 && c == 0xE5)
+		{
+			c = 0x05;
+		}
+
+		if (c == '.' || c == 0)
+		{
+			if (!filling)
+			{
+				filling = true;
+
+				if (c == '.')
+				{
+					name_c++; // skip the dot
+					c = disp_in[name_c];
+					at_ext = true;
+				}
+			}
+		}
+
+		// if at the start of ext
+		if (wr_c == 8)
+		{
+			if (!at_ext)
+			{
+				// try to advance past dot (if any)
+				while (true)
+				{
+					c = disp_in[name_c++];
+					if (c == 0) break;
+					if (c == '.')
+					{
+						// read char PAST the dot
+						c = disp_in[name_c];
+						at_ext = true;
+						break;
+					}
+				}
+			}
+
+			// if c has valid char for extension
+			if (c != 0 && c != '.')
+			{
+				// start copying again.
+				filling = false;
+			}
+		}
+
+		if (!filling)
+		{
+			// copy char of filename
+			raw_out[wr_c] = disp_in[name_c++];
+		}
+		else
+		{
+			// add a filler space
+			raw_out[wr_c] = ' ';
+		}
+	}
+
+	return raw_out;
+}
+
+
+FSAVEPOS ff_savepos(const FFILE* file)
+{
+	FSAVEPOS fsp;
+	fsp.clu = file->clu;
+	fsp.num = file->num;
+	fsp.cur_rel = file->cur_rel;
+	return fsp;
+}
+
+
+void ff_reopen(FFILE* file, const FSAVEPOS* pos)
+{
+	STAT_OP(file->fat, FF_OP_REOPEN);
+
+	open_file(file->fat, file, pos->clu, pos->num);
+	ff_seek(file, pos->cur_rel);
+}
+
+
+void ff_flush_file(FFILE* file)
+{
+	STAT_OP(file->fat, FF_OP_FLUSH);
+
+	const FAT16* fat = file->fat;
+
+#if FF_MAX_DIRTY > 0
+	dirty_drop(file); // stored here
+#endif
+
+	// Store open page
+	fat->dev->flush();
+
+	// Store file size
+
+	// Find address for storing the size
+	const uint32_t addr = dir_entry_addr(fat, file->clu, file->num, file->ent_clu) + 28;
+
+	dev_seek(fat, addr);
+	dev_store(fat, &(file->size), 4);
+
+	const uint32_t pos = file->cur_rel;
+
+	// Seek to the end of the file, to make sure clusters are allocated
+	// (an empty file keeps its first cluster)
+	ff_seek(file, file->size ? file->size - 1 : 0);
+
+	const uint32_t next = next_clu(fat, file->cur_clu);
+	if (next != CLU_END)
+	{
+		free_cluster_chain(fat, next);
+
+		// Mark that there's no further clusters
+		write_fat(fat, file->cur_clu, CLU_END);
+	}
+
+	fsi_store(fat);
+
+#if FF_DISCARD_RANGES > 0
+	discard_issue(fat);
+#endif
+
+	// Restore the cursor
+	if (pos != file->cur_rel)
+		ff_seek(file, pos);
+}
+
+
+uint16_t ff_sync_all(const FAT16* fat)
+{
+	STAT_OP(fat, FF_OP_SYNC);
+
+	uint16_t count = 0;
+
+#if FF_MAX_DIRTY > 0
+	count = sync_dirty(fat);
+#endif
+
+	fsi_store(fat);
+
+	fat->dev->flush();
+
+#if FF_DISCARD_RANGES > 0
+	discard_issue(fat);
+#endif
+
+	return count;
+}
+
+
+
+/** Remove a directory entry (and its long name), keeping the clusters */
+static void delete_entry(FFILE* file)
+{
+	const FAT16* fat = file->fat;
+
+	uint8_t lfn_count = 0;
+
+#if FF_MAX_DIRTY > 0
+	dirty_drop(file); // don't store size into a deleted entry
+#endif
+
+#if FF_USE_LFN
+	// long name entries go first
+	lfn_count = lfn_erase(file);
+#endif
+
+	dir_changed(fat, file->clu, false);
+
+	// the slots can be reused
+	if (file->free_dir == file->clu && file->num - lfn_count < file->free_num)
+		file->free_num = file->num - lfn_count;
+
+	// seek to file record
+	dev_seek(fat, dir_entry_addr(fat, file->clu, file->num, file->ent_clu));
+
+	// mark as deleted
+	dev_write(fat, 0xE5); // "deleted" mark
+}
+
+
+/** Low level no-check file delete and free */
+void delete_file_do(FFILE* file)
+{
+	const FAT16* fat = file->fat;
+
+	delete_entry(file);
+
+	// Free clusters, if FILE or SUBDIR and valid clu_start
+	if (file->type == FT_FILE || file->type == FT_SUBDIR)
+	{
+		// free allocated clusters
+		free_cluster_chain(fat, file->clu_start);
+	}
+
+	// the cluster of a removed directory can be reused by another
+	if (file->type == FT_SUBDIR)
+		dir_changed(fat, file->clu_start, true);
+
+	file->type = FT_DELETED;
+}
+
+
+/** Delete a simple file */
+bool ff_rmfile(FFILE* file)
+{
+	STAT_OP(file->fat, FF_OP_RMFILE);
+
+	switch (file->type)
+	{
+		case FT_FILE:
+		case FT_INVALID:
+		case FT_LFN:
+		case FT_LABEL:
+			delete_file_do(file);
+			return true;
+
+		default:
+			return false;
+	}
+
+}
+
+
+/** Delete an empty directory */
+bool ff_rmdir(FFILE* file)
+{
+	STAT_OP(file->fat, FF_OP_RMDIR);
+
+	if (file->type != FT_SUBDIR)
+		return false; // not a subdirectory entry
+
+	const FSAVEPOS orig = ff_savepos(file);
+
+	// Open the subdir
+	if (!ff_opendir(file))
+		return false; // could not open
+
+	// Look for valid files and subdirs in the directory
+	uint8_t cnt = 0; // entry counter, for checking "." and ".."
+	do
+	{
+		// Stop on apparent corrupt structure (missing "." or "..")
+		// Can safely delete the folder.
+		if (cnt == 0 && file->type != FT_SELF) break;
+		if (cnt == 1 && file->type != FT_PARENT) break;
+
+		// Found valid file
+		if (file->type == FT_SUBDIR || file->type == FT_FILE)
+		{
+			// Valid child file was found, aborting.
+			// reopen original file
+			ff_reopen(file, &orig);
+			return false;
+		}
+
+		if (cnt < 2) cnt++;
+	}
+	while (ff_next(file));
+
+	// reopen original file
+	ff_reopen(file, &orig);
+
+	// and delete as ordinary file
+	delete_file_do(file);
+
+	return true;
+}
+
+
+bool ff_delete(FFILE* file)
+{
+	STAT_OP(file->fat, FF_OP_DELETE);
+
+	switch (file->type)
+	{
+		case FT_DELETED:
+		case FT_NONE:
+			return true; // "deleted successfully"
+
+		case FT_SUBDIR:; // semicolon needed to allow declaration after "case"
+
+			// the entry goes first, then the whole tree
+			const uint32_t top = file->clu_start;
+			FFJOB job;
+			ff_job_delete(&job, file);
+
+			// in one pass over the FAT, or cluster by cluster if short of memory
+			if (top < 2 || !delete_tree_batch(file->fat, top))
+			{
+				while (ff_step(&job, 0));
+			}
+
+			return true;
+
+		default:
+			// try to delete as a regular file
+			return ff_rmfile(file);
+	}
+}
+
+
+/** Check if directory "dir" is "anc", or lies somewhere inside it */
+static bool dir_is_within(const FAT16* fat, uint32_t dir, const uint32_t anc)
+{
+	const uint32_t root = root_dir(fat);
+
+	// climb up through ".." entries
+	for (uint16_t depth = 0; dir != root && depth < 0xFFFF; depth++)
+	{
+		if (dir == anc) return true;
+
+		uint8_t ent[32];
+		dev_seek(fat, clu_addr(fat, dir) + 32); // ".." entry
+		dev_load(fat, ent, 32);
+
+		dir = ent_start(fat, ent);
+		if (dir == 0) dir = root;
+	}
+
+	return anc == root;
+}
+
+
+bool ff_rename(FFILE* file, const FFILE* target_dir, const char* new_name)
+{
+	STAT_OP(file->fat, FF_OP_RENAME);
+
+	const FAT16* fat = file->fat;
+
+	if (file->type != FT_FILE && file->type != FT_SUBDIR)
+		return false;
+
+	FFILE dir = (target_dir != NULL) ? *target_dir : *file;
+	const bool moved = (dir.clu != file->clu);
+
+	// A directory can't go inside itself
+	if (moved && file->type == FT_SUBDIR && dir_is_within(fat, dir.clu, file->clu_start))
+		return false;
+
+	// Keep the name
+#if FF_USE_LFN
+	char name[FF_LFN_MAX * 3 + 1];
+	if (new_name == NULL) new_name = ff_longname(file, name, sizeof(name));
+#else
+	char name[13];
+	if (new_name == NULL) new_name = ff_dispname(file, name);
+#endif
+
+#if FF_MAX_DIRTY > 0
+	sync_dirty(fat); // the old entry must have the size
+#endif
+
+	// Attributes, dates, cluster and size go with the entry
+	const uint32_t old_addr = dir_entry_addr(fat, file->clu, file->num, file->ent_clu);
+	uint8_t ent[32];
+	dev_seek(fat, old_addr);
+	dev_load(fat, ent, 32);
+
+	char fname[11];
+	uint8_t lcase;
+	if (!place_name(&dir, new_name, file, fname, &lcase))
+		return false;
+
+	ent[12] = (ent[12] & ~(SFN_LOWER_BASE | SFN_LOWER_EXT)) | lcase;
+
+	// 1. The new entry
+	dev_seek(fat, dir_entry_addr(fat, dir.clu, dir.num, dir.ent_clu));
+	dev_store(fat, fname, 11);
+	dev_store(fat, ent + 11, 21);
+
+	// 2. The old one goes away (with its long name)
+	delete_entry(file);
+
+	// 3. A moved directory points to its new parent
+	if (moved && file->type == FT_SUBDIR)
+	{
+		write_ent_start(fat, clu_addr(fat, file->clu_start) + 32, parent_ref(fat, dir.clu));
+	}
+
+	// the handle follows the file
+	const FSAVEPOS pos = { dir.clu, dir.num, file->cur_rel };
+	ff_reopen(file, &pos);
+
+	return true;
+}
+
+
+bool ff_parent(FFILE* file)
+{
+	STAT_OP(file->fat, FF_OP_PARENT);
+
+	// open second entry of the directory
+	open_file(file->fat, file, file->clu, 1);
+	const FSAVEPOS orig = ff_savepos(file);
+
+	// if it's a valid PARENT link, follow it.
+	if (file->type == FT_PARENT)
+	{
+		open_file(file->fat, file, file->clu_start, 0);
+		return true;
+	}
+	else
+	{
+		// in root already?
+		// reopen original file
+		ff_reopen(file, &orig);
+		return false;
+	}
+}
+
+
+
+/** Number of clusters in the data area (highest cluster number is count + 1) */
+uint32_t cluster_count(const FAT16* fat)
+{
+	const uint32_t count = bs_clusters(&fat->bs);
+	const uint32_t fat_entries = fat->bs.fat_size_sectors * (fat->bs.bytes_per_sector / FAT_ENT(fat)) - 2;
+	const uint32_t max = fat->bs.fat32 ? 0x0FFFFFF5 : 0xFFF5;
+
+	if (count > fat_entries) return fat_entries;
+	if (count > max) return max;
+	return count;
+}
+
+
+/** State of ff_check() */
+typedef struct
+{
+	const FAT16* fat;
+	FFCHECK* res;
+	bool repair;
+
+	void* table;      // the FAT, see tbl_get()
+	uint8_t* seen;    // bitmap of clusters used by a chain
+	uint8_t* dirty;   // bitmap of modified FAT sectors
+	uint32_t max_clu; // highest valid cluster
+
+	// directories to check
+	uint32_t* stack;
+	uint32_t depth;
+	uint32_t stack_cap;
+
+	bool incomplete; // a directory was not walked (out of memory)
+}
+CheckState;
+
+
+#define BIT_GET(map, n) ((map)[(n) >> 3] & (1 << ((n) & 7)))
+#define BIT_SET(map, n) ((map)[(n) >> 3] |= (1 << ((n) & 7)))
+
+
+/** Entry of a FAT loaded into memory (end of chain marks read as CLU_END) */
+static inline uint32_t tbl_get(const FAT16* fat, const void* table, const uint32_t clu)
+{
+	if (fat->bs.fat32)
+	{
+		const uint32_t v = ((const uint32_t*) table)[clu] & 0x0FFFFFFF;
+		return (v >= 0x0FFFFFF8) ? CLU_END : v;
+	}
+
+	const uint16_t v = ((const uint16_t*) table)[clu];
+	return (v >= 0xFFF8) ? CLU_END : v;
+}
+
+
+/** Change an entry of a FAT loaded into memory (CLU_END = end of chain) */
+static inline void tbl_set(const FAT16* fat, void* table, const uint32_t clu, const uint32_t val)
+{
+	if (fat->bs.fat32)
+	{
+		uint32_t* p = (uint32_t*) table + clu;
+		*p = (*p & 0xF0000000) | (val & 0x0FFFFFFF);
+	}
+	else
+	{
+		((uint16_t*) table)[clu] = val;
+	}
+}
+
+
+/** Load the whole FAT into memory, in one pass */
+static void fat_load(const FAT16* fat, void* table)
+{
+	const uint16_t bps = fat->bs.bytes_per_sector;
+
+	dev_seek(fat, fat->fat_addr);
+	for (uint32_t sec = 0; sec < fat->bs.fat_size_sectors; sec++)
+	{
+		dev_load(fat, (uint8_t*) table + sec * bps, bps);
+	}
+}
+
+
+/**
+ * Write modified sectors of a FAT loaded into memory (bits in "dirty")
+ * back into all FAT copies, in order. Whole FF_PHYS_BLOCK blocks are
+ * written, so the device doesn't have to read-modify-write.
+ */
+static void fat_write_back(const FAT16* fat, const void* table, const uint8_t* dirty)
+{
+	const uint16_t bps = fat->bs.bytes_per_sector;
+	const uint32_t fat_secs = fat->bs.fat_size_sectors;
+	const uint16_t spb = (FF_PHYS_BLOCK > bps) ? FF_PHYS_BLOCK / bps : 1; // sectors per block
+
+	for (uint32_t sec = 0; sec < fat_secs; sec += spb)
+	{
+		const uint16_t n = MIN(spb, fat_secs - sec);
+
+		bool changed = false;
+		for (uint16_t i = 0; i < n; i++)
+		{
+			if (BIT_GET(dirty, sec + i)) changed = true;
+		}
+
+		if (!changed) continue;
+
+#if FF_USE_SIDECAR
+		if (fat->sc_clean) sc_set_clean(fat, false); // the sidecar is stale now
+#endif
+
+		for (uint8_t f = 0; f < fat->bs.num_fats; f++)
+		{
+			dev_seek(fat, fat->fat_addr + ((uint32_t) f * fat_secs + sec) * bps);
+			dev_store(fat, (const uint8_t*) table + sec * bps, n * bps);
+		}
+	}
+}
+
+
+static void check_set_fat(CheckState* st, const uint32_t clu, const uint32_t val)
+{
+	tbl_set(st->fat, st->table, clu, val);
+	BIT_SET(st->dirty, clu / (st->fat->bs.bytes_per_sector / FAT_ENT(st->fat)));
+}
+
+
+/** Patch a directory entry on disk */
+static void check_fix_entry(CheckState* st, const uint32_t addr, const uint8_t offs, const uint32_t val, const uint8_t bytes)
+{
+	dev_seek(st->fat, addr + offs);
+	dev_store(st->fat, &val, bytes);
+	st->res->repaired++;
+}
+
+
+/**
+ * Walk a chain in the loaded FAT, marking clusters as used.
+ * With repair, the chain is cut before the first bad link.
+ * Returns chain length, 0 if the first cluster is unusable.
+ */
+static uint32_t check_chain(CheckState* st, const uint32_t start, bool* bad)
+{
+	uint32_t len = 0;
+	uint32_t prev = 0;
+	uint32_t clu = start;
+
+	*bad = false;
+
+	while (true)
+	{
+		if (clu < 2 || clu > st->max_clu || tbl_get(st->fat, st->table, clu) == 0 || BIT_GET(st->seen, clu))
+		{
+			// Link to outside the volume, to a free cluster,
+			// or into another chain (or a loop).
+			*bad = true;
+
+			if (clu >= 2 && clu <= st->max_clu && BIT_GET(st->seen, clu))
+				st->res->cross_linked++;
+			else
+				st->res->bad_chains++;
+
+			if (st->repair && prev != 0)
+			{
+				check_set_fat(st, prev, CLU_END);
+				st->res->repaired++;
+			}
+
+			return len;
+		}
+
+		BIT_SET(st->seen, clu);
+		len++;
+
+		const uint32_t next = tbl_get(st->fat, st->table, clu);
+		if (next == CLU_END) return len; // end of chain
+
+		prev = clu;
+		clu = next;
+	}
+}
+
+
+/** Check one directory entry (at "addr") */
+static void check_entry(CheckState* st, const uint32_t addr, const uint8_t* ent)
+{
+	const uint8_t attribs = ent[11];
+	const uint32_t start = ent_start(st->fat, ent);
+	const uint32_t size = ent[28] | (ent[29] << 8) | ((uint32_t) ent[30] << 16) | ((uint32_t) ent[31] << 24);
+	const uint32_t bpc = st->fat->bs.bytes_per_cluster;
+
+	const bool is_dir = attribs & FA_DIR;
+
+	if (is_dir) st->res->dirs++;
+	else st->res->files++;
+
+	if (start == 0 && (is_dir || size == 0))
+		return; // empty file (or a broken dir, nothing to walk)
+
+	// Entry pointing at an unused cluster - the data is gone
+	if (start < 2 || start > st->max_clu || tbl_get(st->fat, st->table, start) == 0)
+	{
+		st->res->free_start++;
+		if (st->repair) check_fix_entry(st, addr, 0, 0xE5, 1);
+		return;
+	}
+
+	// Start cluster already belongs to some other file
+	if (BIT_GET(st->seen, start))
+	{
+		st->res->cross_linked++;
+		if (st->repair) check_fix_entry(st, addr, 0, 0xE5, 1);
+		return;
+	}
+
+	bool bad;
+	const uint32_t len = check_chain(st, start, &bad);
+
+	if (is_dir)
+	{
+		// Check its contents later
+		if (st->depth == st->stack_cap)
+		{
+			const uint32_t cap = st->stack_cap ? st->stack_cap * 2 : 16;
+			uint32_t* stack = realloc(st->stack, cap * sizeof(uint32_t));
+			if (stack == NULL)
+			{
+				// Its files are not known, so nothing can be called
+				// lost anymore - stop repairing
+				st->incomplete = true;
+				st->repair = false;
+				return;
+			}
+			st->stack = stack;
+			st->stack_cap = cap;
+		}
+
+		st->stack[st->depth++] = start;
+		return;
+	}
+
+	// File - chain length must match the size.
+	// Files created by this library keep one cluster even if empty.
+	const uint32_t need = (size + bpc - 1) / bpc;
+
+	if (len < need)
+	{
+		st->res->size_mismatch++;
+		if (st->repair) check_fix_entry(st, addr, 28, len * bpc, 4); // size to what's there
+	}
+	else if (len > need && !(need == 0 && len == 1) && !bad)
+	{
+		st->res->size_mismatch++;
+
+		if (st->repair)
+		{
+			// cut the chain after the last needed cluster, free the rest
+			uint32_t clu = start;
+			for (uint32_t i = 1; i < (need ? need : 1); i++) clu = tbl_get(st->fat, st->table, clu);
+
+			uint32_t rest = tbl_get(st->fat, st->table, clu);
+			check_set_fat(st, clu, CLU_END);
+
+			// the rest becomes "lost", and is freed below
+			while (rest >= 2 && rest <= st->max_clu)
+			{
+				st->seen[rest >> 3] &= ~(1 << (rest & 7));
+				rest = tbl_get(st->fat, st->table, rest);
+			}
+
+			st->res->repaired++;
+		}
+	}
+}
+
+
+/** Check all entries of a directory (0 = FAT16 root) */
+static void check_dir(CheckState* st, const uint32_t dir)
+{
+	const FAT16* fat = st->fat;
+	uint8_t ent[32];
+
+	uint32_t clu = dir;
+	uint32_t addr = (dir == 0) ? fat->rd_addr : clu_addr(fat, clu);
+	uint32_t left = (dir == 0) ? fat->bs.root_entries * 32 : fat->bs.bytes_per_cluster;
+
+	dev_seek(fat, addr);
+
+	while (true)
+	{
+		if (left == 0)
+		{
+			if (dir == 0) return; // end of root dir
+
+			// next cluster of the directory, from the loaded FAT
+			clu = tbl_get(fat, st->table, clu);
+			if (clu < 2 || clu > st->max_clu) return;
+
+			addr = clu_addr(fat, clu);
+			left = fat->bs.bytes_per_cluster;
+			dev_seek(fat, addr);
+		}
+
+		dev_load(fat, ent, 32);
+
+		if (ent[0] == 0x00) return; // end of directory
+
+		const bool skip = (ent[0] == 0xE5 || ent[0] == 0x2E || ent[11] == 0x0F || (ent[11] & FA_LABEL));
+		if (!skip)
+		{
+			check_entry(st, addr, ent);
+			dev_seek(fat, addr + 32); // back to where we were
+		}
+
+		addr += 32;
+		left -= 32;
+	}
+}
+
+
+bool ff_check(const FAT16* fat, FFCHECK* result, bool repair)
+{
+	STAT_OP(fat, FF_OP_CHECK);
+
+#if FF_MAX_DIRTY > 0
+	sync_dirty(fat); // sizes and chains must be on the disk
+#endif
+
+	*result = (FFCHECK) { 0 };
+
+	CheckState st = { .fat = fat, .res = result, .repair = repair };
+
+	st.max_clu = cluster_count(fat) + 1;
+
+	const uint32_t fat_secs = fat->bs.fat_size_sectors;
+	const uint32_t entries = fat_secs * (fat->bs.bytes_per_sector / FAT_ENT(fat));
+
+	st.table = malloc(fat_secs * fat->bs.bytes_per_sector);
+	st.seen = calloc(entries / 8, 1);
+	st.dirty = calloc((fat_secs + 7) / 8, 1);
+
+	bool ok = (st.table != NULL && st.seen != NULL && st.dirty != NULL);
+
+	if (ok)
+	{
+		fat_load(fat, st.table);
+
+		// Walk the tree (the FAT32 root directory is a chain too)
+		const uint32_t root = root_dir(fat);
+		if (root != 0)
+		{
+			bool bad;
+			check_chain(&st, root, &bad);
+		}
+
+		check_dir(&st, root);
+		while (st.depth > 0)
+		{
+			check_dir(&st, st.stack[--st.depth]);
+		}
+
+		// Clusters in use, but not by any file
+		// (unknown if some directory was not walked)
+		uint32_t free = 0, first_free = 0;
+		for (uint32_t c = 2; c <= st.max_clu; c++)
+		{
+			const uint32_t v = tbl_get(fat, st.table, c);
+			if (!st.incomplete && v != 0 && v != CLU_BAD(fat) && !BIT_GET(st.seen, c))
+			{
+				result->lost_clusters++;
+
+				if (repair)
+				{
+					check_set_fat(&st, c, 0);
+					result->repaired++;
+				}
+			}
+
+			if (tbl_get(fat, st.table, c) == 0)
+			{
+				if (free++ == 0) first_free = c;
+			}
+		}
+
+		fat_write_back(fat, st.table, st.dirty);
+
+		// The free space hints are exact now
+		FAT16* f = (FAT16*) fat; // hints are runtime state
+		if (f->free_count != free || (free > 0 && f->next_free != first_free))
+		{
+			f->free_count = free;
+			f->next_free = free ? first_free : 2;
+			f->fsi_dirty = true;
+		}
+
+		if (repair) fsi_store(fat);
+
+		if (result->repaired > 0) fat->dev->flush();
+
+		if (result->repaired > 0) dir_changed(fat, CLU_END, true);
+	}
+
+	free(st.table);
+	free(st.seen);
+	free(st.dirty);
+	free(st.stack);
+
+	if (!ok || st.incomplete) return false;
+
+	const uint32_t found = result->bad_chains + result->cross_linked + result->lost_clusters
+						   + result->size_mismatch + result->free_start;
+
+	return found == 0 || (repair && result->repaired >= found);
+}
+
+
+/** Free a chain in a FAT loaded into memory */
+static void table_free_chain(const FAT16* fat, void* table, uint8_t* dirty, const uint32_t max_clu, uint32_t clu)
+{
+	const uint16_t per_sec = fat->bs.bytes_per_sector / FAT_ENT(fat); // FAT entries
+
+	// freed links read as 0, so a loop ends too
+	while (clu >= 2 && clu <= max_clu)
+	{
+		const uint32_t next = tbl_get(fat, table, clu);
+		tbl_set(fat, table, clu, 0);
+		BIT_SET(dirty, clu / per_sec);
+		note_free(fat, clu, 1);
+		clu = next;
+	}
+}
+
+
+bool delete_tree_batch(const FAT16* fat, const uint32_t top)
+{
+	const uint32_t fat_secs = fat->bs.fat_size_sectors;
+	const uint32_t max_clu = cluster_count(fat) + 1;
+
+	void* table = malloc(fat_secs * fat->bs.bytes_per_sector);
+	uint8_t* dirty = calloc((fat_secs + 7) / 8, 1);
+
+	// Directories of the tree, walked in the order found
+	uint32_t dirs_cap = 16;
+	uint32_t dirs_count = 1;
+	uint32_t* dirs = malloc(dirs_cap * sizeof(uint32_t));
+
+	bool ok = (table != NULL && dirty != NULL && dirs != NULL);
+
+	// the hints follow the frees, unless it's abandoned
+	FAT16* f = (FAT16*) fat;
+	const uint32_t free_count = f->free_count, next_free = f->next_free;
+
+	if (ok)
+	{
+		fat_load(fat, table);
+
+		dirs[0] = top;
+
+		for (uint32_t d = 0; ok && d < dirs_count; d++)
+		{
+			// Entries of the directory, cluster by cluster
+			uint32_t clu = dirs[d];
+			bool end = false;
+
+			for (uint32_t steps = 0; !end && clu >= 2 && clu <= max_clu && steps < max_clu; steps++)
+			{
+				dev_seek(fat, clu_addr(fat, clu));
+
+				for (uint32_t b = 0; b < fat->bs.bytes_per_cluster; b += 32)
+				{
+					uint8_t ent[32];
+					dev_load(fat, ent, 32);
+
+					if (ent[0] == 0x00)
+					{
+						end = true;
+						break;
+					}
+
+					if (ent[0] == 0xE5 || ent[0] == 0x2E || ent[11] == 0x0F || (ent[11] & FA_LABEL))
+						continue;
+
+					const uint32_t start = ent_start(fat, ent);
+
+					if (!(ent[11] & FA_DIR))
+					{
+						table_free_chain(fat, table, dirty, max_clu, start);
+					}
+					else if (start >= 2)
+					{
+						if (dirs_count == dirs_cap)
+						{
+							uint32_t* grown = realloc(dirs, dirs_cap * 2 * sizeof(uint32_t));
+							if (grown == NULL)
+							{
+								ok = false; // nothing written yet
+								break;
+							}
+
+							dirs = grown;
+							dirs_cap *= 2;
+						}
+
+						dirs[dirs_count++] = start;
+					}
+				}
+
+				clu = tbl_get(fat, table, clu);
+			}
+
+			table_free_chain(fat, table, dirty, max_clu, dirs[d]);
+		}
+	}
+
+	if (ok)
+	{
+		fat_write_back(fat, table, dirty);
+
+		dir_changed(fat, CLU_END, true);
+	}
+	else
+	{
+		f->free_count = free_count;
+		f->next_free = next_free;
+#if FF_DISCARD_RANGES > 0
+		f->discard_count = 0; // the frees were not written
+#endif
+	}
+
+	free(table);
+	free(dirty);
+	free(dirs);
+
+	return ok;
+}
+
+
+/** Find a run of "len" free clusters among clusters "first" to "last" */
+static uint32_t scan_free_run(const FAT16* fat, const uint32_t first, const uint32_t last, const uint32_t len)
+{
+	const uint8_t w = FAT_ENT(fat);
+
+	uint8_t buf[32 * 4];
+	uint32_t run = 0;
+	uint32_t start = 0;
+
+	dev_seek(fat, fat->fat_addr + first * w);
+
+	for (uint32_t c = first; c <= last; c += 32)
+	{
+		const uint8_t n = MIN(32, last - c + 1);
+
+		dev_load(fat, buf, n * w);
+		STAT_ADD(fat, fat_reads, n);
+
+		for (uint8_t i = 0; i < n; i++)
+		{
+			const uint32_t clu = c + i;
+
+			STAT_ADD(fat, alloc_scan, 1);
+
+			const bool used = fat->bs.fat32 ? (get_le32(buf + i * 4) & 0x0FFFFFFF) != 0
+							  : (buf[i * 2] | buf[i * 2 + 1]) != 0;
+			if (used)
+			{
+				run = 0;
+				continue;
+			}
+
+#if FF_USE_JOURNAL
+			if (fat->jr_buf && jr_held(fat, clu))
+			{
+				run = 0;
+				continue;
+			}
+#endif
+
+			if (run++ == 0) start = clu;
+			if (run == len) return start;
+		}
+	}
+
+	return CLU_END;
+}
+
+
+/**
+ * Find a run of "len" free clusters, reading the FAT in blocks.
+ * The search starts at cluster "from", and wraps around.
+ * Returns first cluster of the run, or CLU_END if there is none.
+ */
+uint32_t find_free_run(const FAT16* fat, const uint32_t len, const uint32_t from)
+{
+	const uint32_t last = cluster_count(fat) + 1;
+	const uint32_t first = (from < 2 || from > last) ? 2 : from;
+
+	uint32_t start = scan_free_run(fat, first, last, len);
+
+	// runs before "from", and the one reaching over it
+	if (start == CLU_END && first > 2)
+		start = scan_free_run(fat, 2, MIN(last, first + len - 2), len);
+
+	return start;
+}
+
+
+/** Copy contents of one cluster into another */
+void copy_cluster(const FAT16* fat, const uint32_t from, const uint32_t to)
+{
+	uint8_t buf[128];
+
+	const uint32_t src = clu_addr(fat, from);
+	const uint32_t dst = clu_addr(fat, to);
+
+	for (uint32_t i = 0; i < fat->bs.bytes_per_cluster; i += sizeof(buf))
+	{
+		dev_seek(fat, src + i);
+		dev_load(fat, buf, sizeof(buf));
+		dev_seek(fat, dst + i);
+		dev_store(fat, buf, sizeof(buf));
+	}
+}
+
+
+/** Point the ".." entries of all subdirectories of a (moved) directory to it */
+void fix_child_parents(const FAT16* fat, const uint32_t dir)
+{
+	FFILE child;
+	open_file(fat, &child, dir, 0);
+
+	do
+	{
+		if (child.type != FT_SUBDIR) continue;
+
+		// ".." is the second entry of the child directory
+		FFILE parent;
+		open_file(fat, &parent, child.clu_start, 1);
+
+		if (parent.type == FT_PARENT)
+		{
+			write_ent_start(fat, dir_entry_addr(fat, parent.clu, 1, parent.ent_clu), parent_ref(fat, dir));
+		}
+	}
+	while (ff_next(&child));
+}
+
+
+bool ff_defrag_file(FFILE* file)
+{
+	STAT_OP(file->fat, FF_OP_DEFRAG);
+
+	const FAT16* fat = file->fat;
+
+#if FF_MAX_DIRTY > 0
+	sync_dirty(fat); // sizes and chains must be on the disk
+#endif
+
+	if (file->type != FT_FILE && file->type != FT_SUBDIR)
+		return false;
+
+	if (file->attribs & FA_SYSTEM)
+		return false; // system files (eg. the journal) stay in place
+
+	if (file->clu_start < 2)
+		return false; // no clusters
+
+	// Measure the chain, and see if it's contiguous already
+	uint32_t len = 1;
+	bool contiguous = true;
+	for (uint32_t clu = file->clu_start, next; (next = next_clu(fat, clu)) != CLU_END; clu = next)
+	{
+		if (next != clu + 1) contiguous = false;
+		len++;
+	}
+
+	if (contiguous) return false;
+
+	const uint32_t start = find_free_run(fat, len, 2);
+	if (start == CLU_END) return false;
+
+	// 1. Copy the data into the free run
+	uint32_t clu = file->clu_start;
+	for (uint32_t i = 0; i < len; i++)
+	{
+		copy_cluster(fat, clu, start + i);
+		clu = next_clu(fat, clu);
+	}
+
+	// 2. Chain the new clusters
+	for (uint32_t i = 0; i < len; i++)
+	{
+		write_fat(fat, start + i, (i == len - 1) ? CLU_END : start + i + 1);
+	}
+
+	note_alloc(fat, start, len);
+
+	// 3. Switch the entry over
+	const uint32_t old = file->clu_start;
+	write_ent_start(fat, dir_entry_addr(fat, file->clu, file->num, file->ent_clu), start);
+
+	// Moved directory - fix its "." and the ".." of its children
+	if (file->type == FT_SUBDIR)
+	{
+		write_ent_start(fat, clu_addr(fat, start), start);
+
+		fix_child_parents(fat, start);
+	}
+
+	// 4. Release the old clusters
+	free_cluster_chain(fat, old);
+
+	if (file->type == FT_SUBDIR)
+		dir_changed(fat, old, true);
+
+	fat->dev->flush();
+
+	// reload the entry
+	open_entry(fat, file, file->clu, file->num, file->ent_clu);
+
+	return true;
+}
+
+
+uint32_t ff_defrag(const FAT16* fat, uint32_t max_files)
+{
+	STAT_OP(fat, FF_OP_DEFRAG);
+
+	uint32_t moved = 0;
+
+	// directories left to process
+	uint32_t* stack = NULL;
+	uint32_t depth = 0;
+	uint32_t cap = 0;
+
+	uint32_t dir = root_dir(fat); // root first
+
+	while (true)
+	{
+		FFILE file;
+		open_file(fat, &file, dir, 0);
+
+		do
+		{
+			if (file.type != FT_FILE && file.type != FT_SUBDIR)
+				continue;
+
+			if (max_files > 0 && moved >= max_files)
+				break;
+
+			if (ff_defrag_file(&file))
+				moved++;
+
+			if (file.type == FT_SUBDIR && file.clu_start >= 2)
+			{
+				if (depth == cap)
+				{
+					const uint32_t grow = cap ? cap * 2 : 16;
+					uint32_t* grown = realloc(stack, grow * sizeof(uint32_t));
+					if (grown == NULL) break; // skip the rest of the tree
+					stack = grown;
+					cap = grow;
+				}
+
+				stack[depth++] = file.clu_start;
+			}
+		}
+		while (ff_next(&file));
+
+		if (depth == 0 || (max_files > 0 && moved >= max_files))
+			break;
+
+		dir = stack[--depth];
+	}
+
+	free(stack);
+
+	return moved;
+}
+
+
+uint16_t ff_compact_dir(FFILE* dir)
+{
+	STAT_OP(dir->fat, FF_OP_COMPACT);
+
+	const FAT16* fat = dir->fat;
+
+#if FF_MAX_DIRTY > 0
+	sync_dirty(fat); // sizes and chains must be on the disk
+#endif
+	const uint32_t first = dir->clu;
+	const uint16_t per_clu = fat->bs.bytes_per_cluster / 32; // entries per cluster
+
+	// Limit of entries (root has a fixed size)
+	const uint16_t limit = (first == 0) ? fat->bs.root_entries : 0xFFFF;
+
+	uint8_t ent[32];
+
+	uint16_t rd = 0, wr = 0; // read & write cursor
+	uint32_t rd_clu = first, wr_clu = first;
+
+	for (; rd < limit; rd++)
+	{
+		// read cursor moves to next cluster
+		if (first != 0 && rd > 0 && rd % per_clu == 0)
+		{
+			rd_clu = next_clu(fat, rd_clu);
+			if (rd_clu == CLU_END) break; // end of chain
+		}
+
+		dev_seek(fat, dir_entry_addr(fat, first, rd, rd_clu));
+		dev_load(fat, ent, 32);
+
+		if (ent[0] == 0x00) break; // end of directory
+		if (ent[0] == 0xE5) continue; // deleted, reclaim
+
+		if (first != 0 && wr > 0 && wr % per_clu == 0)
+		{
+			wr_clu = next_clu(fat, wr_clu);
+		}
+
+		if (wr != rd)
+		{
+			dev_seek(fat, dir_entry_addr(fat, first, wr, wr_clu));
+			dev_store(fat, ent, 32);
+		}
+
+		wr++;
+	}
+
+	const uint16_t reclaimed = rd - wr;
+
+	// Blank the rest of the last used cluster (or of the root directory)
+	uint16_t end = (first == 0) ? rd : ((wr + per_clu - 1) / per_clu) * per_clu;
+	if (end == 0) end = per_clu; // keep one cluster
+	if (end > rd) end = rd;
+
+	for (uint16_t n = wr; n < end; n++)
+	{
+		if (first != 0 && n > 0 && n % per_clu == 0)
+		{
+			wr_clu = next_clu(fat, wr_clu);
+		}
+
+		dev_seek(fat, dir_entry_addr(fat, first, n, wr_clu));
+		dev_write(fat, 0x00);
+	}
+
+	// Free clusters past the last used one
+	if (first != 0)
+	{
+		const uint16_t keep = (wr == 0) ? 1 : (wr + per_clu - 1) / per_clu;
+
+		uint32_t last = first;
+		for (uint16_t i = 1; i < keep; i++) last = next_clu(fat, last);
+
+		const uint32_t rest = next_clu(fat, last);
+		if (rest != CLU_END)
+		{
+			write_fat(fat, last, CLU_END);
+			free_cluster_chain(fat, rest);
+		}
+	}
+
+	fat->dev->flush();
+
+	dir_changed(fat, first, true);
+
+	ff_first(dir);
+
+	return reclaimed;
+}
+
+
+void ff_statfs(const FAT16* fat, FFSTATFS* out)
+{
+	STAT_OP(fat, FF_OP_STATFS);
+
+	const uint8_t w = FAT_ENT(fat);
+	const uint32_t end = cluster_count(fat) + 2; // entries 0 and 1 are not clusters
+
+	uint64_t buf[512]; // FAT block
+	const uint32_t per_block = sizeof(buf) / w;
+
+	uint32_t free = 0, run = 0, best = 0;
+	uint32_t chains = 0, bad = 0, links = 0, jumps = 0;
+
+	dev_seek(fat, fat->fat_addr);
+
+	for (uint32_t base = 0; base < end; base += per_block)
+	{
+		const uint32_t n = MIN(per_block, end - base);
+
+		dev_load(fat, buf, n * w);
+		STAT_ADD(fat, fat_reads, n);
+
+		for (uint32_t g = 0; g < n; g += 64)
+		{
+			const uint8_t cnt = MIN(64, n - g);
+
+			FatMasks m;
+			fat_classify(fat, (const uint8_t*) buf + g * w, base + g, cnt, &m);
+
+			uint64_t valid = (cnt == 64) ? ~(uint64_t) 0 : ((uint64_t) 1 << cnt) - 1;
+			if (base + g == 0) valid &= ~(uint64_t) 3;
+
+			const uint64_t fr = m.free & valid;
+			const uint64_t ln = valid & ~(m.free | m.end | m.bad);
+
+			free += __builtin_popcountll(fr);
+			chains += __builtin_popcountll(m.end & valid);
+			bad += __builtin_popcountll(m.bad & valid);
+			links += __builtin_popcountll(ln);
+			jumps += __builtin_popcountll(ln & ~m.seq);
+
+			track_runs(fr, &run, &best);
+		}
+	}
+
+	out->clusters = end - 2;
+	out->free_clusters = free;
+	out->largest_free = best;
+	out->bad_clusters = bad;
+	out->chains = chains;
+	out->fragments = chains + jumps;
+	out->frag_index = links ? (uint8_t)((uint64_t) jumps * 100 / links) : 0;
+	out->bytes_per_cluster = fat->bs.bytes_per_cluster;
+
+	// The free count hint is exact now
+	FAT16* f = (FAT16*) fat; // hints are runtime state
+	if (f->free_count != free)
+	{
+		f->free_count = free;
+		f->fsi_dirty = true;
+	}
+}
+
+
+/** Start a walk of directory "dir" (tree delete) */
+static void job_enter(FFJOB* job, const uint32_t dir)
+{
+	job->at.dir = dir;
+	job->at.ent = dir;
+	job->at.num = 0;
+	job->depth++;
+}
+
+
+/**
+ * Find where the walk continues in the parent of a finished directory,
+ * if the parent's position is not on the stack. The parent is found
+ * through "..", and scanned for the entry of the directory.
+ */
+static void job_find_parent(FFJOB* job, const uint32_t dir)
+{
+	const FAT16* fat = job->fat;
+
+	uint8_t dots[32];
+	dev_seek(fat, clu_addr(fat, dir) + 32); // ".." entry
+	dev_load(fat, dots, 32);
+
+	const uint32_t parent = ent_start(fat, dots);
+	FFJOBDIR at = { parent, parent, 0 };
+
+	while (at.ent >= 2 && at.ent != CLU_END)
+	{
+		uint8_t ent[32];
+		dev_seek(fat, clu_addr(fat, at.ent) + (at.num * 32) % fat->bs.bytes_per_cluster);
+		dev_load(fat, ent, 32);
+
+		if (ent[0] == 0x00) break;
+
+		at.num++;
+
+		if (ent[0] != 0xE5 && (ent[11] & FA_DIR) && ent[11] != 0x0F && ent_start(fat, ent) == dir)
+		{
+			if ((at.num * 32) % fat->bs.bytes_per_cluster == 0)
+				at.ent = next_clu(fat, at.ent);
+
+			job->at = at; // continue after it
+			return;
+		}
+
+		if ((at.num * 32) % fat->bs.bytes_per_cluster == 0)
+			at.ent = next_clu(fat, at.ent);
+	}
+
+	// Broken tree - stop walking, the rest become lost clusters
+	job->depth = 0;
+}
+
+
+/** Do one unit of a delete job */
+static bool delete_unit(FFJOB* job)
+{
+	const FAT16* fat = job->fat;
+
+	// Free the chain in progress
+	if (job->clu >= 2 && job->clu != CLU_END)
+	{
+		STAT_ADD(fat, chain_steps, 1);
+		const uint32_t next = read_fat(fat, job->clu);
+		write_fat(fat, job->clu, 0x0000);
+		note_free(fat, job->clu, 1);
+		job->clu = next;
+		job->result++;
+		return true;
+	}
+
+	if (job->depth == 0)
+		return false; // all freed
+
+	FFJOBDIR* at = &job->at;
+
+	// Read the next entry, unless the directory ends
+	uint8_t ent[32];
+	ent[0] = 0x00;
+
+	if (at->ent >= 2 && at->ent != CLU_END)
+	{
+		dev_seek(fat, clu_addr(fat, at->ent) + (at->num * 32) % fat->bs.bytes_per_cluster);
+		dev_load(fat, ent, 32);
+	}
+
+	if (ent[0] == 0x00)
+	{
+		// Directory done - free it after its contents
+		const uint32_t dir = at->dir;
+
+		if (--job->depth > 0)
+		{
+			if (job->depth <= FF_JOB_DEPTH)
+				job->at = job->stack[job->depth - 1];
+			else
+				job_find_parent(job, dir);
+		}
+
+		job->clu = dir;
+		dir_changed(fat, dir, true);
+		return true;
+	}
+
+	at->num++;
+	if ((at->num * 32) % fat->bs.bytes_per_cluster == 0)
+		at->ent = next_clu(fat, at->ent);
+
+	if (ent[0] == 0xE5 || ent[0] == 0x2E || ent[11] == 0x0F || (ent[11] & FA_LABEL))
+		return true; // nothing to free
+
+	const uint32_t start = ent_start(fat, ent);
+
+	if ((ent[11] & FA_DIR) && start >= 2)
+	{
+		// Descend, remember where to continue
+		if (job->depth <= FF_JOB_DEPTH)
+			job->stack[job->depth - 1] = *at;
+
+		job_enter(job, start);
+	}
+	else
+	{
+		job->clu = start;
+	}
+
+	return true;
+}
+
+
+bool ff_job_delete(FFJOB* job, FFILE* file)
+{
+	STAT_OP(file->fat, FF_OP_DELETE);
+
+	const FAT16* fat = file->fat;
+
+	job->kind = FJ_NONE;
+	job->fat = fat;
+	job->dev = fat->dev;
+	job->clu = 0;
+	job->depth = 0;
+	job->result = 0;
+
+	switch (file->type)
+	{
+		case FT_DELETED:
+		case FT_NONE:
+			return true; // nothing to do
+
+		case FT_SELF:
+		case FT_PARENT:
+			return false;
+
+		case FT_SUBDIR:
+#if FF_MAX_DIRTY > 0
+			sync_dirty(fat); // no sizes pending for files inside
+#endif
+			if (file->clu_start >= 2)
+				job_enter(job, file->clu_start);
+			break;
+
+		case FT_FILE:
+			job->clu = file->clu_start;
+			break;
+
+		default:
+			break; // no clusters
+	}
+
+	delete_entry(file);
+	file->type = FT_DELETED;
+
+	job->kind = FJ_DELETE;
+	return true;
+}
+
+
+void ff_job_free_scan(FFJOB* job, const FAT16* fat)
+{
+	job->kind = FJ_FREE_SCAN;
+	job->fat = fat;
+	job->dev = fat->dev;
+	job->pos = 2;
+	job->end = cluster_count(fat) + 2;
+	job->depth = 0;
+	job->result = 0;
+}
+
+
+/** Do one unit of a free scan: check 32 FAT entries */
+static bool scan_unit(FFJOB* job)
+{
+	const FAT16* fat = job->fat;
+
+	if (job->pos >= job->end)
+		return false;
+
+	uint8_t buf[32 * 4];
+	const uint8_t n = (job->end - job->pos < 32) ? job->end - job->pos : 32;
+	const uint8_t w = FAT_ENT(fat);
+
+	dev_seek(fat, fat->fat_addr + job->pos * w);
+	dev_load(fat, buf, n * w);
+	STAT_ADD(fat, fat_reads, n);
+
+	for (uint8_t i = 0; i < n; i++)
+	{
+		const uint32_t v = (w == 4) ? get_le32(buf + i * 4) & 0x0FFFFFFF : (uint32_t)(buf[i * 2] | (buf[i * 2 + 1] << 8));
+		if (v == 0) job->result++;
+	}
+
+	job->pos += n;
+	return true;
+}
+
+
+/** Run units of a job until it's finished, or the budget is used up */
+static bool job_run(FFJOB* job, uint32_t budget, bool (*unit)(FFJOB*))
+{
+	do
+	{
+		if (!unit(job))
+		{
+			job->kind = FJ_NONE;
+			return false;
+		}
+	}
+	while (budget == 0 || --budget > 0);
+
+	return true;
+}
+
+
+bool ff_step(FFJOB* job, uint32_t budget)
+{
+	switch (job->kind)
+	{
+		case FJ_FORMAT:
+			return job_run(job, budget, format_unit); // no volume to count on
+
+		case FJ_DELETE:
+		{
+			STAT_OP(job->fat, FF_OP_STEP);
+			return job_run(job, budget, delete_unit);
+		}
+
+		case FJ_FREE_SCAN:
+		{
+			STAT_OP(job->fat, FF_OP_STEP);
+			return job_run(job, budget, scan_unit);
+		}
+
+		default:
+			return false;
+	}
+}
+
+
+#if FF_USE_JOURNAL
+
+/** Raw name of the journal file */
+#define JR_NAME "FFJOURNLSYS"
+
+
+static void jr_open(const FAT16* fat)
+{
+	FAT16* f = JR(fat);
+
+	FFILE file;
+	ff_root(fat, &file);
+
+	if (!dir_find_file_raw(&file, JR_NAME) || file.clu_start < 2 || file.size <= JR_HEADER)
+		return; // no journal
+
+	f->jr_addr = clu_addr(fat, file.clu_start);
+	f->jr_size = file.size;
+	f->jr_seq = 0;
+
+	uint8_t head[20];
+	dev_seek(fat, fat->jr_addr);
+	dev_load(fat, head, sizeof(head));
+
+	if (get_le32(head) != JR_MAGIC)
+		return; // never used
+
+	f->jr_seq = get_le32(head + 4);
+	const uint32_t used = get_le32(head + 8);
+
+	if (head[16] != 1 || used > fat->jr_size - JR_HEADER)
+		return; // clean
+
+	// Interrupted commit - replay it, if it was written completely
+	uint8_t* rec = malloc(used);
+	if (rec == NULL) return;
+
+	dev_seek(fat, fat->jr_addr + JR_HEADER);
+	for (uint32_t done = 0; done < used; done += 0x8000)
+	{
+		const uint32_t rest = used - done;
+		dev_load(fat, rec + done, (rest < 0x8000) ? rest : 0x8000);
+	}
+
+	if (crc32_update(crc32_update(0, head + 4, 8), rec, used) == get_le32(head + 12))
+	{
+		jr_apply(fat, rec, used);
+		fat->dev->flush();
+	}
+
+	// (a torn journal was not applied at all, so it's just dropped)
+	dev_seek(fat, fat->jr_addr + 16);
+	dev_write(fat, 0);
+	fat->dev->flush();
+
+	free(rec);
+}
+
+
+bool ff_journal_create(const FAT16* fat)
+{
+	if (fat->jr_addr != 0)
+		return true; // has one already
+
+	if (fat->jr_buf != NULL)
+		return false; // in a transaction
+
+	const uint32_t bpc = fat->bs.bytes_per_cluster;
+	uint16_t count = (FF_JOURNAL_SIZE + bpc - 1) / bpc;
+	if (count * bpc <= JR_HEADER) count++; // room for records
+
+	// One contiguous run, so the journal is written sequentially
+	const uint32_t start = find_free_run(fat, count, 2);
+	if (start == CLU_END)
+		return false;
+
+	for (uint16_t i = 0; i < count; i++)
+	{
+		write_fat(fat, start + i, (i == count - 1) ? CLU_END : start + i + 1);
+	}
+
+	note_alloc(fat, start, count);
+
+	// Clean header
+	const uint8_t zeros[20] = { 0 };
+	dev_seek(fat, clu_addr(fat, start));
+	dev_store(fat, zeros, sizeof(zeros));
+
+	FFILE file;
+	ff_root(fat, &file);
+
+	if (!find_empty_slots(&file, 1))
+	{
+		free_cluster_chain(fat, start);
+		return false;
+	}
+
+	write_file_header(&file, JR_NAME, FA_HIDDEN | FA_SYSTEM, start);
+
+	const uint32_t size = count * bpc;
+	dev_seek(fat, dir_entry_addr(fat, file.clu, file.num, file.ent_clu) + 28);
+	dev_store(fat, &size, 4);
+
+	dir_changed(fat, root_dir(fat), false);
+	fat->dev->flush();
+
+	JR(fat)->jr_addr = clu_addr(fat, start);
+	JR(fat)->jr_size = size;
+	JR(fat)->jr_seq = 0;
+
+	return true;
+}
+
+
+bool ff_tx_begin(const FAT16* fat)
+{
+	if (fat->jr_addr == 0)
+		return false; // no journal
+
+	if (fat->jr_buf != NULL)
+		return true; // joins the open transaction
+
+	FAT16* f = JR(fat);
+
+	f->jr_buf = malloc(fat->jr_size - JR_HEADER);
+	if (f->jr_buf == NULL)
+		return false;
+
+	f->jr_used = 0;
+	f->jr_last = 0;
+	f->jr_pos = 0;
+	f->jr_bypass = false;
+
+	return true;
+}
+
+
+bool ff_tx_commit(const FAT16* fat)
+{
+	STAT_OP(fat, FF_OP_COMMIT);
+
+	if (fat->jr_buf == NULL)
+		return false; // no transaction
+
+	jr_commit(fat);
 
-	return label_out;
+	free(fat->jr_buf);
+	JR(fat)->jr_buf = NULL;
+
+#if FF_DISCARD_RANGES > 0
+	discard_issue(fat); // frees of the transaction
+#endif
+
+	return true;
 }
 
+#endif // FF_USE_JOURNAL
 
-char* ff_dispname(const FFILE* file, char* disp_out)
-{
-	// Cannot get name for special files
-	if (file->type == FT_NONE ||        // not-yet-used directory location
-			file->type == FT_DELETED ||     // deleted file entry
-			file->attribs == 0x0F)          // long name special entry (system, hidden)
-		return NULL;
+#if FF_USE_SIDECAR
 
-	// find first non-space
-	int8_t j = 7;
-	for (; j >= 0; j--)
-	{
-		if (file->name[j] != ' ') break;
-	}
+//
+// Sidecar file layout:
+//   magic (4), generation (4), payload length (4),
+//   CRC32 of generation, length and payload (4)
+//   payload: free count (4), next free (4), flags (4), volume stamp (4),
+//   number of entries (4),
+//   directory cache entries: directory (4), hash (4), name length (2),
+//   entry number (2), entry cluster (4)
+//
+// The sidecar is only valid while the clean bit in FAT[1] is set, and
+// the volume stamp matches. Other drivers may set the clean bit again
+// when they unmount, so the stamp covers what they change along with
+// the FAT: the FSInfo hints on FAT32, or the whole FAT otherwise.
+//
 
-	// j ... last no-space char
+#define SC_MAGIC  0x43534646 // "FFSC"
+#define SC_NAME   "FFMOUNT SYS"
+#define SC_HEADER 16
+#define SC_FIXED  20 // payload before the entries
+#define SC_ENTRY  16
+#define SC_SIZE   (SC_HEADER + SC_FIXED + FF_DCACHE_SIZE * SC_ENTRY)
 
-	uint8_t i;
-	for (i = 0; i <= j; i++)
-	{
-		disp_out[i] = file->name[i];
-	}
+#define SC_NO_WINDOW 0x01 // flag: no free run for an allocation window
 
+/** Clean shutdown bit of FAT[1] */
+#define SC_CLEAN(fat) ((fat)->bs.fat32 ? 0x08000000 : 0x8000)
 
-	// directory entry, no extension
-	if (file->type == FT_SUBDIR || file->type == FT_SELF || file->type == FT_PARENT)
+
+static void sc_set_clean(const FAT16* fat, const bool clean)
+{
+	const uint8_t w = FAT_ENT(fat);
+	const uint32_t fat_bytes = fat->bs.fat_size_sectors * (uint32_t) fat->bs.bytes_per_sector;
+
+	// straight to the device, also during a transaction
+	for (uint8_t i = 0; i < fat->bs.num_fats; i++)
 	{
-		disp_out[i] = 0; // end of string
-		return disp_out;
-	}
+		const uint32_t addr = fat->fat_addr + i * fat_bytes + w;
+		uint32_t v = 0;
 
+		fat->dev->seek(addr);
+		fat->dev->load(&v, w);
 
-	// add a dot
-	if (file->type != FT_LABEL) // volume label has no dot!
-		disp_out[i++] = '.';
+		v = clean ? (v | SC_CLEAN(fat)) : (v & ~SC_CLEAN(fat));
 
-	// Add extension chars
-	for (j = 8; j < 11; j++, i++)
-	{
-		const char c = file->name[j];
-		if (c == ' ') break;
-		disp_out[i] = c;
+		fat->dev->seek(addr);
+		fat->dev->store(&v, w);
 	}
 
-	disp_out[i] = 0; // end of string
+	fat->dev->flush();
 
-	return disp_out;
+	((FAT16*) fat)->sc_clean = clean;
 }
 
 
-char* ff_rawname(const char* disp_in, char* raw_out)
+/** CRC of the FSInfo hints, or of the first FAT without the clean bit */
+static uint32_t sc_stamp(const FAT16* fat)
 {
-	uint8_t name_c = 0, wr_c = 0;
-	bool filling = false;
-	bool at_ext = false;
-	for (; wr_c < 11; wr_c++)
+	uint8_t buf[512];
+
+	if (fat->fsi_addr != 0)
 	{
-		// start filling with spaces if end of filename reached
-		uint8_t c = disp_in[name_c];
-		// handle special rule for 0xE5
-		if (name_c == 0 && c == 0xE5)
-		{
-			c = 0x05;
-		}
+		dev_seek(fat, fat->fsi_addr + 488);
+		dev_load(fat, buf, 8);
+		return crc32_update(0, buf, 8);
+	}
 
-		if (c == '.' || c == 0)
-		{
-			if (!filling)
-			{
-				filling = true;
+	const uint32_t fat_bytes = fat->bs.fat_size_sectors * (uint32_t) fat->bs.bytes_per_sector;
+	uint32_t crc = 0;
 
-				if (c == '.')
-				{
-					name_c++; // skip the dot
-					c = disp_in[name_c];
-					at_ext = true;
-				}
-			}
-		}
+	dev_seek(fat, fat->fat_addr);
+	for (uint32_t pos = 0; pos < fat_bytes; pos += sizeof(buf))
+	{
+		dev_load(fat, buf, sizeof(buf));
 
-		// if at the start of ext
-		if (wr_c == 8)
+		// FAT[1] - the clean bit is set after the stamp is taken
+		for (uint8_t i = 0; pos == 0 && i < FAT_ENT(fat); i++)
 		{
-			if (!at_ext)
-			{
-				// try to advance past dot (if any)
-				while (true)
-				{
-					c = disp_in[name_c++];
-					if (c == 0) break;
-					if (c == '.')
-					{
-						// read char PAST the dot
-						c = disp_in[name_c];
-						at_ext = true;
-						break;
-					}
-				}
-			}
-
-			// if c has valid char for extension
-			if (c != 0 && c != '.')
-			{
-				// start copying again.
-				filling = false;
-			}
+			buf[FAT_ENT(fat) + i] = 0;
 		}
 
-		if (!filling)
-		{
-			// copy char of filename
-			raw_out[wr_c] = disp_in[name_c++];
-		}
-		else
-		{
-			// add a filler space
-			raw_out[wr_c] = ' ';
-		}
+		crc = crc32_update(crc, buf, sizeof(buf));
 	}
 
-	return raw_out;
+	return crc;
 }
 
 
-FSAVEPOS ff_savepos(const FFILE* file)
+/** Find the sidecar file. Returns its address, or 0 if there is none. */
+static uint32_t sc_find(const FAT16* fat, FFILE* file)
 {
-	FSAVEPOS fsp;
-	fsp.clu = file->clu;
-	fsp.num = file->num;
-	fsp.cur_rel = file->cur_rel;
-	return fsp;
-}
+	ff_root(fat, file);
 
+	if (!dir_find_file_raw(file, SC_NAME) || file->clu_start < 2 || file->size < SC_SIZE)
+		return 0;
 
-void ff_reopen(FFILE* file, const FSAVEPOS* pos)
-{
-	open_file(file->fat, file, pos->clu, pos->num);
-	ff_seek(file, pos->cur_rel);
+	return clu_addr(fat, file->clu_start);
 }
 
 
-void ff_flush_file(FFILE* file)
+/** Load the sidecar, if the volume is clean and it's valid */
+static void sc_open(const FAT16* fat)
 {
-	const FAT16* fat = file->fat;
-	const BLOCKDEV* dev = file->fat->dev;
+	FAT16* f = (FAT16*) fat; // hints and cache are runtime state
 
-	// Store open page
-	dev->flush();
-
-	// Store file size
+	f->sc_gen = 0;
 
-	// Find address for storing the size
-	const uint32_t addr = clu_offs(fat, file->clu, file->num * 32 + 28);
+	uint32_t v = 0;
+	dev_seek(fat, fat->fat_addr + FAT_ENT(fat));
+	dev_load(fat, &v, FAT_ENT(fat));
+	f->sc_clean = (v & SC_CLEAN(fat)) != 0;
 
-	dev->seek(addr);
-	dev->store(&(file->size), 4);
+	FFILE file;
+	const uint32_t addr = sc_find(fat, &file);
+	if (addr == 0)
+		return; // no sidecar
 
-	// Seek to the end of the file, to make sure clusters are allocated
-	ff_seek(file, file->size - 1);
+	uint8_t* buf = malloc(SC_SIZE);
+	if (buf == NULL) return;
 
-	const uint16_t next = next_clu(fat, file->cur_clu);
-	if (next != 0xFFFF)
-	{
-		free_cluster_chain(fat, next);
+	dev_seek(fat, addr);
+	dev_load(fat, buf, SC_SIZE);
 
-		// Mark that there's no further clusters
-		write_fat(fat, file->cur_clu, 0xFFFF);
-	}
-}
+	const uint32_t len = get_le32(buf + 8);
+	const uint8_t* p = buf + SC_HEADER;
 
+	bool ok = get_le32(buf) == SC_MAGIC
+			  && len >= SC_FIXED && len <= SC_SIZE - SC_HEADER
+			  && crc32_update(crc32_update(0, buf + 4, 8), p, len) == get_le32(buf + 12);
 
+	if (get_le32(buf) == SC_MAGIC)
+		f->sc_gen = get_le32(buf + 4); // continue the count
 
-/** Low level no-check file delete and free */
-void delete_file_do(FFILE* file)
-{
-	const FAT16* fat = file->fat;
+	const uint32_t count = cluster_count(fat);
+	const uint32_t free_count = get_le32(p);
+	const uint32_t next_free = get_le32(p + 4);
+	const uint32_t entries = get_le32(p + 16);
 
-	// seek to file record
-	fat->dev->seek(clu_offs(fat, file->clu, file->num * 32));
+	ok = ok && f->sc_clean
+		 && (free_count == 0xFFFFFFFF || free_count <= count)
+		 && next_free >= 2 && next_free < count + 2
+		 && entries <= FF_DCACHE_SIZE && SC_FIXED + entries * SC_ENTRY <= len;
 
-	// mark as deleted
-	fat->dev->write(0xE5); // "deleted" mark
+	// last, it may read the whole FAT
+	ok = ok && get_le32(p + 12) == sc_stamp(fat);
 
-	// Free clusters, if FILE or SUBDIR and valid clu_start
-	if (file->type == FT_FILE || file->type == FT_SUBDIR)
+	if (ok)
 	{
-		// free allocated clusters
-		free_cluster_chain(fat, file->clu_start);
+		f->free_count = free_count;
+		f->next_free = next_free;
+		f->no_window = (get_le32(p + 8) & SC_NO_WINDOW) != 0;
+
+#if FF_DCACHE_SIZE > 0
+		for (uint32_t i = 0; i < entries; i++)
+		{
+			const uint8_t* e = p + SC_FIXED + i * SC_ENTRY;
+			FFDENTRY* d = &f->dcache[i];
+
+			d->dir = get_le32(e);
+			d->hash = get_le32(e + 4);
+			d->len = e[8] | (e[9] << 8);
+			d->num = e[10] | (e[11] << 8);
+			d->ent_clu = get_le32(e + 12);
+			d->used = ++f->dcache_clock;
+		}
+#endif
 	}
 
-	file->type = FT_DELETED;
+	free(buf);
+
+	if (!ok)
+	{
+		// stale - rebuild the free count
+		FFSTATFS st;
+		ff_statfs(fat, &st);
+	}
 }
 
 
-/** Delete a simple file */
-bool ff_rmfile(FFILE* file)
+bool ff_sidecar_save(const FAT16* fat)
 {
-	switch (file->type)
-	{
-		case FT_FILE:
-		case FT_INVALID:
-		case FT_LFN:
-		case FT_LABEL:
-			delete_file_do(file);
-			return true;
+#if FF_USE_JOURNAL
+	if (fat->jr_buf != NULL)
+		return false; // in a transaction
+#endif
 
-		default:
-			return false;
+	ff_sync_all(fat);
+
+	if (fat->free_count == 0xFFFFFFFF)
+	{
+		// count free clusters, so the next mount has it
+		FFSTATFS st;
+		ff_statfs(fat, &st);
 	}
 
-}
+	FFILE file;
+	uint32_t addr = sc_find(fat, &file);
 
+	if (addr == 0)
+	{
+		ff_root(fat, &file);
+		if (dir_find_file_raw(&file, SC_NAME) && !ff_rmfile(&file))
+			return false; // too small, could not replace it
 
-/** Delete an empty directory */
-bool ff_rmdir(FFILE* file)
-{
-	if (file->type != FT_SUBDIR)
-		return false; // not a subdirectory entry
+		// One contiguous run, so it's loaded in one go
+		const uint32_t bpc = fat->bs.bytes_per_cluster;
+		const uint32_t count = (SC_SIZE + bpc - 1) / bpc;
 
-	const FSAVEPOS orig = ff_savepos(file);
+		const uint32_t start = find_free_run(fat, count, 2);
+		if (start == CLU_END)
+			return false;
 
-	// Open the subdir
-	if (!ff_opendir(file))
-		return false; // could not open
+		for (uint32_t i = 0; i < count; i++)
+		{
+			write_fat(fat, start + i, (i == count - 1) ? CLU_END : start + i + 1);
+		}
 
-	// Look for valid files and subdirs in the directory
-	uint8_t cnt = 0; // entry counter, for checking "." and ".."
-	do
-	{
-		// Stop on apparent corrupt structure (missing "." or "..")
-		// Can safely delete the folder.
-		if (cnt == 0 && file->type != FT_SELF) break;
-		if (cnt == 1 && file->type != FT_PARENT) break;
+		note_alloc(fat, start, count);
 
-		// Found valid file
-		if (file->type == FT_SUBDIR || file->type == FT_FILE)
+		ff_root(fat, &file);
+
+		if (!find_empty_slots(&file, 1))
 		{
-			// Valid child file was found, aborting.
-			// reopen original file
-			ff_reopen(file, &orig);
+			free_cluster_chain(fat, start);
 			return false;
 		}
 
-		if (cnt < 2) cnt++;
+		write_file_header(&file, SC_NAME, FA_HIDDEN | FA_SYSTEM, start);
+
+		const uint32_t size = count * bpc;
+		dev_seek(fat, dir_entry_addr(fat, file.clu, file.num, file.ent_clu) + 28);
+		dev_store(fat, &size, 4);
+
+		dir_changed(fat, root_dir(fat), false);
+
+		addr = clu_addr(fat, start);
+		fsi_store(fat);
 	}
-	while (ff_next(file));
 
-	// reopen original file
-	ff_reopen(file, &orig);
+	fsi_store(fat); // the stamp reads it back
 
-	// and delete as ordinary file
-	delete_file_do(file);
+	uint8_t* buf = calloc(1, SC_SIZE);
+	if (buf == NULL) return false;
 
-	return true;
-}
+	const uint32_t gen = fat->sc_gen + 1;
+	uint8_t* p = buf + SC_HEADER;
 
+	set_le32(p, fat->free_count);
+	set_le32(p + 4, fat->next_free);
+	set_le32(p + 8, fat->no_window ? SC_NO_WINDOW : 0);
 
-bool ff_delete(FFILE* file)
-{
-	switch (file->type)
+	uint32_t entries = 0;
+
+#if FF_DCACHE_SIZE > 0
+	// Found entries only - they are verified when used,
+	// "not found" results are not (see dir_changed())
+	for (uint16_t i = 0; i < FF_DCACHE_SIZE; i++)
 	{
-		case FT_DELETED:
-		case FT_NONE:
-			return true; // "deleted successfully"
+		const FFDENTRY* d = &fat->dcache[i];
+		if (d->hash == 0 || d->num == 0xFFFF) continue;
+
+		uint8_t* e = p + SC_FIXED + entries * SC_ENTRY;
+		set_le32(e, d->dir);
+		set_le32(e + 4, d->hash);
+		e[8] = d->len;
+		e[9] = d->len >> 8;
+		e[10] = d->num;
+		e[11] = d->num >> 8;
+		set_le32(e + 12, d->ent_clu);
+		entries++;
+	}
+#endif
 
-		case FT_SUBDIR:; // semicolon needed to allow declaration after "case"
+	set_le32(p + 16, entries);
+	set_le32(p + 12, sc_stamp(fat));
 
-			// store original file location
-			const FSAVEPOS orig = ff_savepos(file);
+	const uint32_t len = SC_FIXED + entries * SC_ENTRY;
 
-			// open the directory (skip "." and "..")
-			open_file(file->fat, file, file->clu_start, 2);
+	set_le32(buf, SC_MAGIC);
+	set_le32(buf + 4, gen);
+	set_le32(buf + 8, len);
+	set_le32(buf + 12, crc32_update(crc32_update(0, buf + 4, 8), p, len));
 
-			// delete all children
-			do
-			{
-				if (!ff_delete(file))
-				{
-					// failure
-					// reopen original file
-					ff_reopen(file, &orig);
-					return false;
-				}
-			}
-			while (ff_next(file));
+	dev_seek(fat, addr);
+	dev_store(fat, buf, SC_SIZE);
 
-			// go up and delete the dir
-			ff_reopen(file, &orig);
-			return ff_rmdir(file);
+	fat->dev->flush();
+	free(buf);
 
-		default:
-			// try to delete as a regular file
-			return ff_rmfile(file);
-	}
+	((FAT16*) fat)->sc_gen = gen;
+
+	// Valid from now on, until the FAT changes
+	sc_set_clean(fat, true);
+
+	return true;
 }
 
+#endif // FF_USE_SIDECAR
 
-bool ff_parent(FFILE* file)
+
+#if FF_USE_STATS
+
+void ff_get_stats(const FAT16* fat, FF_OP op, FFSTATS* out)
 {
-	// open second entry of the directory
-	open_file(file->fat, file, file->clu, 1);
-	const FSAVEPOS orig = ff_savepos(file);
+	*out = (op == FF_OP_NONE) ? fat->stats : fat->op_stats[op];
+}
 
-	// if it's a valid PARENT link, follow it.
-	if (file->type == FT_PARENT)
+
+FF_OP ff_get_last_stats(const FAT16* fat, FFSTATS* out)
+{
+	*out = fat->last_stats;
+	return fat->last_op;
+}
+
+
+void ff_reset_stats(FAT16* fat)
+{
+	fat->stats = (FFSTATS) { 0 };
+	fat->last_stats = (FFSTATS) { 0 };
+
+	for (uint8_t i = 0; i < FF_OP_COUNT; i++)
 	{
-		open_file(file->fat, file, file->clu_start, 0);
-		return true;
+		fat->op_stats[i] = (FFSTATS) { 0 };
 	}
-	else
+
+	fat->op = FF_OP_NONE;
+	fat->last_op = FF_OP_NONE;
+}
+
+
+char* ff_dump_stats(const FAT16* fat, char* buf, uint16_t len)
+{
+	static const char* const names[FF_OP_COUNT] = {
+		"total", "read", "write", "seek", "next", "prev", "first", "root", "find",
+		"opendir", "parent", "reopen", "newfile", "mkdir", "rmfile", "rmdir",
+		"delete", "flush", "check", "defrag", "compact", "newfiles",
+		"openpath", "sync", "commit", "step", "rename", "statfs"
+	};
+
+	int n = snprintf(buf, len, "%-8s %8s %8s %10s %10s %8s %8s %8s %8s\n",
+					 "op", "calls", "seeks", "loaded", "stored",
+					 "fat_rd", "fat_wr", "chain", "scan");
+
+	for (uint8_t op = 0; op < FF_OP_COUNT && n >= 0 && n < len; op++)
 	{
-		// in root already?
-		// reopen original file
-		ff_reopen(file, &orig);
-		return false;
+		FFSTATS st;
+		ff_get_stats(fat, op, &st);
+
+		if (op != FF_OP_NONE && st.calls == 0)
+			continue; // never called
+
+		n += snprintf(buf + n, len - n, "%-8s %8u %8u %10u %10u %8u %8u %8u %8u\n",
+					  names[op], st.calls, st.seeks, st.bytes_loaded, st.bytes_stored,
+					  st.fat_reads, st.fat_writes, st.chain_steps, st.alloc_scan);
 	}
+
+	return buf;
 }
+
+#endif
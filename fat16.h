@@ -1,7 +1,7 @@
 #pragma once
 
 //
-// Simple FAT16 library.
+// Simple FAT16 library, also handling FAT32 volumes.
 //
 // To use it, implement BLOCKDEV functions
 // and attach them to it's instance.
@@ -11,6 +11,11 @@
 #include <stdbool.h>
 
 #include "blockdev.h"
+#include "fat16_config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 
 // -------------------------------
@@ -36,12 +41,65 @@ typedef enum
 /** "File address" for saving and restoring file */
 typedef struct
 {
-	uint16_t clu;
+	uint32_t clu;
 	uint16_t num;
 	uint32_t cur_rel;
 } FSAVEPOS;
 
 
+#if FF_USE_STATS
+
+/** Access counters, see ff_get_stats() */
+typedef struct
+{
+	uint32_t calls;        // public calls (per-operation counters only)
+	uint32_t seeks;        // device seeks (absolute and relative)
+	uint32_t bytes_loaded; // bytes read from the device
+	uint32_t bytes_stored; // bytes written to the device
+	uint32_t fat_reads;    // FAT entries read
+	uint32_t fat_writes;   // FAT entries written
+	uint32_t chain_steps;  // cluster chain links followed
+	uint32_t alloc_scan;   // FAT entries examined while allocating
+} FFSTATS;
+
+
+/** Public operations with their own counters */
+typedef enum
+{
+	FF_OP_NONE = 0, // totals / outside any public call
+	FF_OP_READ,
+	FF_OP_WRITE,
+	FF_OP_SEEK,
+	FF_OP_NEXT,
+	FF_OP_PREV,
+	FF_OP_FIRST,
+	FF_OP_ROOT,
+	FF_OP_FIND,
+	FF_OP_OPENDIR,
+	FF_OP_PARENT,
+	FF_OP_REOPEN,
+	FF_OP_NEWFILE,
+	FF_OP_MKDIR,
+	FF_OP_RMFILE,
+	FF_OP_RMDIR,
+	FF_OP_DELETE,
+	FF_OP_FLUSH,
+	FF_OP_CHECK,
+	FF_OP_DEFRAG,
+	FF_OP_COMPACT,
+	FF_OP_NEWFILES,
+	FF_OP_OPENPATH,
+	FF_OP_SYNC,
+	FF_OP_COMMIT,
+	FF_OP_STEP,
+	FF_OP_RENAME,
+	FF_OP_STATFS,
+	FF_OP_COUNT
+} FF_OP;
+
+#endif
+
+
 // Include definitions of fully internal structs
 #include "fat16_internal.h"
 
@@ -66,10 +124,11 @@ typedef struct __attribute__((packed))
 	 */
 	uint8_t attribs;
 
-	// 14 bytes skipped (10 reserved, date, time)
-
-	/** First cluster of the file. (internal) */
-	uint16_t clu_start;
+	/**
+	 * First cluster of the file. (internal)
+	 * On FAT32, the high half comes from its own field of the entry.
+	 */
+	uint32_t clu_start;
 
 	/**
 	 * File size in bytes.
@@ -89,12 +148,17 @@ typedef struct __attribute__((packed))
 	// Cursor variables. (internal)
 	uint32_t cur_abs; // absolute position in device
 	uint32_t cur_rel; // relative position in file
-	uint16_t cur_clu; // cluster where the cursor is
+	uint32_t cur_clu; // cluster where the cursor is
 	uint16_t cur_ofs; // offset within the active cluster
 
 	// File position in the directory. (internal)
-	uint16_t clu; // first cluster of directory
+	uint32_t clu; // first cluster of directory (0 = FAT16 root directory)
 	uint16_t num; // file entry number
+	uint32_t ent_clu; // directory cluster holding the entry
+
+	// Where to start looking for a free entry in the directory. (internal)
+	uint32_t free_dir; // directory the hint is for
+	uint16_t free_num; // entries before this one are in use
 
 	// Pointer to the FAT16 handle. (internal)
 	const FAT16* fat;
@@ -108,6 +172,18 @@ FFILE;
 void ff_flush_file(FFILE* file);
 
 
+/**
+ * Store metadata of all written files, and flush the device once.
+ *
+ * Sizes are written in the order of their directory entries. The unused
+ * clusters past the end of the files are freed together, with the FAT
+ * entries written in order, consecutive ones in one store.
+ * Freed clusters are then discarded, if the device can (see FF_DISCARD_RANGES).
+ * Returns the number of files synced.
+ */
+uint16_t ff_sync_all(const FAT16* fat);
+
+
 /**
  * Save a file "position" into a struct, for later restoration.
  * Cursor is also saved.
@@ -120,12 +196,96 @@ FSAVEPOS ff_savepos(const FFILE* file);
 void ff_reopen(FFILE* file, const FSAVEPOS* pos);
 
 
+/** A FAT16 or FAT32 partition, see ff_list_partitions() */
+typedef struct
+{
+	uint8_t index;    // for ff_init_part(): 0-3 primary, 4+ logical
+	uint8_t type;     // partition type (4, 6, 14; 11 or 12 for FAT32)
+	uint32_t start;   // first sector
+	uint32_t sectors; // length in sectors
+} FFPART;
+
+
 /**
- * Initialize the file system - store into "fat"
+ * Find the FAT partitions on a device: primary partitions,
+ * and logical partitions in an extended one.
+ *
+ * Returns number of partitions stored into "parts" (max. "max").
+ */
+uint8_t ff_list_partitions(const BLOCKDEV* dev, FFPART* parts, uint8_t max);
+
+
+/**
+ * Initialize the file system - store into "fat".
+ * Mounts the first FAT partition.
+ *
+ * FAT16 and FAT32 volumes are handled the same way; on FAT32 the root
+ * directory is a cluster chain (it can grow), and the free cluster
+ * count and next free cluster hints are kept in the FSInfo sector
+ * (stored by ff_flush_file() and ff_sync_all()).
  */
 bool ff_init(const BLOCKDEV* dev, FAT16* fat);
 
 
+/**
+ * Mount a partition by its index (see FFPART).
+ *
+ * Each mounted partition has its own FAT16 handle, and they can share
+ * one device: all addresses are absolute. With a device that keeps
+ * the cursor per thread (blockdev_pio), each partition can be used
+ * from its own thread.
+ */
+bool ff_init_part(const BLOCKDEV* dev, FAT16* fat, uint8_t index);
+
+
+/** Options for ff_format() */
+typedef struct
+{
+	/**
+	 * Cluster size in sectors (power of two, clusters up to 32 KiB).
+	 * 0 = choose automatically, see avg_file_size.
+	 */
+	uint8_t sectors_per_cluster;
+
+	/** Sector size: 512, 1024, 2048 or 4096 bytes. 0 = 512 */
+	uint16_t bytes_per_sector;
+
+	/**
+	 * FAT type: 16 or 32. 0 = FAT16 if it fits with clusters up to 4 KiB,
+	 * FAT32 otherwise. (The type follows from the number of clusters:
+	 * FAT32 needs at least 65525 of them, FAT16 4085 to 65524.)
+	 */
+	uint8_t fat_type;
+
+	/** Number of root directory entries (FAT16), 0 = 512 */
+	uint16_t root_entries;
+
+	/**
+	 * Expected typical file size in bytes, used to choose the cluster size
+	 * in automatic mode. Larger clusters mean shorter chains to walk,
+	 * smaller clusters mean less slack space. 0 = unknown.
+	 */
+	uint32_t avg_file_size;
+
+	/** Volume label, up to 11 chars, or NULL */
+	const char* label;
+} FFORMAT;
+
+
+/**
+ * Create a new FAT16 or FAT32 volume: write a MBR with one partition,
+ * a boot sector, empty FATs and an empty root directory.
+ *
+ * @param dev        the device
+ * @param total_size size of the device in bytes
+ * @param opts       options, or NULL for defaults
+ *
+ * Returns false if the volume can't be created with given options
+ * (too small, or a cluster count that doesn't suit the FAT type).
+ */
+bool ff_format(const BLOCKDEV* dev, uint32_t total_size, const FFORMAT* opts);
+
+
 /**
  * Open the first file of the root directory.
  * The file may be invalid (eg. a volume label, deleted etc),
@@ -163,6 +323,9 @@ uint16_t ff_read(FFILE* file, void* target, uint16_t len);
 
 /**
  * Write into file at a "seek" position.
+ *
+ * The new size is stored by ff_flush_file(), or for all written
+ * files at once by ff_sync_all().
  */
 bool ff_write(FFILE* file, const void* source, uint32_t len);
 
@@ -178,6 +341,9 @@ bool ff_write_str(FFILE* file, const char* source);
  *
  * file ... open directory; new file is opened into this handle.
  * name ... name of the new file, including extension
+ *
+ * With FF_USE_LFN, names that don't fit 8.3 get a long name
+ * entry, and a generated short alias (eg. "LONGFI~1.TXT").
  */
 bool ff_newfile(FFILE* file, const char* name);
 
@@ -189,6 +355,21 @@ bool ff_newfile(FFILE* file, const char* name);
 bool ff_mkdir(FFILE* file, const char* name);
 
 
+/**
+ * Create several files in one directory, in a single pass over it.
+ *
+ * dir ... open directory; it's left at the original position.
+ * names ... names of the new files
+ * created ... position of each new file (for ff_reopen), can be NULL.
+ *             num is 0xFFFF for names that were skipped.
+ *
+ * Names that already exist (or are invalid) are skipped.
+ * Returns the number of files created; stops early if the
+ * directory or the disk is full.
+ */
+uint16_t ff_newfiles(FFILE* dir, const char* const* names, const uint16_t count, FSAVEPOS* created);
+
+
 /**
  * Set new file size.
  * Allocates / frees needed clusters, does NOT erase them.
@@ -212,11 +393,27 @@ bool ff_rmdir(FFILE* file);
 
 /**
  * Delete a file or directory, even FT_LFN and FT_INVALID.
- * Directories are deleted recursively (!)
+ * Directories are deleted with all their contents (!)
+ * To do it in bounded steps, see ff_job_delete().
  */
 bool ff_delete(FFILE* file);
 
 
+/**
+ * Rename a file or directory, or move it into another directory.
+ * The entry is rewritten, the data stays where it is.
+ *
+ * target_dir ... a handle in the destination directory,
+ *                or NULL to stay in the same directory
+ * new_name   ... new name (can be a long name), or NULL to keep it
+ *
+ * The handle is moved to the new entry; other handles of the file
+ * must be reopened. Returns false if the name is taken, or if
+ * a directory would be moved inside itself.
+ */
+bool ff_rename(FFILE* file, const FFILE* target_dir, const char* new_name);
+
+
 
 // --------- NAVIGATION ------------
 
@@ -251,10 +448,27 @@ void ff_first(FFILE* file);
  * Find a file with given "display name" in this directory, and open it.
  * If file is found, "file" will contain it's handle.
  * Otherwise, the handle is unchanged.
+ *
+ * With FF_USE_LFN, the name can also be a long name (UTF-8),
+ * matched case-insensitively (ASCII letters only).
  */
 bool ff_find(FFILE* file, const char* name);
 
 
+/**
+ * Open a file or directory by its path from the root, eg. "a/b/file.bin".
+ * Components are names as for ff_find(), separated by "/" or "\".
+ *
+ * Lookups are cached per volume (see FF_DCACHE_SIZE), including names
+ * that were not found, so repeated opens don't scan the directories.
+ *
+ * If found, "file" is opened at the entry (an empty path gives the root
+ * directory, as ff_root()). Otherwise it's left in the last directory
+ * reached, and false is returned.
+ */
+bool ff_open_path(const FAT16* fat, const char* path, FFILE* file);
+
+
 // -------- FILE INSPECTION -----------
 
 /** Check if file is a valid entry, or long-name/label/deleted */
@@ -274,3 +488,325 @@ char* ff_dispname(const FFILE* file, char* disp_out);
  */
 char* ff_rawname(const char* disp_in, char* raw_out);
 
+
+#if FF_USE_LFN
+
+/** Longest long name, in UCS-2 characters */
+#define FF_LFN_MAX 255
+
+/**
+ * Get the long name of a file, as UTF-8.
+ * Falls back to the display name if the file has no (valid) long name.
+ * A buffer of FF_LFN_MAX * 3 + 1 bytes fits any name.
+ * Returns the passed char*, or NULL on error.
+ */
+char* ff_longname(const FFILE* file, char* out, uint16_t size);
+
+#endif
+
+
+
+// -------- MAINTENANCE -----------
+
+/** Result of ff_check() */
+typedef struct
+{
+	uint32_t files;         // files found
+	uint32_t dirs;          // directories found
+	uint32_t bad_chains;    // chains with invalid links or loops
+	uint32_t cross_linked;  // chains running into a cluster of another chain
+	uint32_t lost_clusters; // allocated clusters not used by any file
+	uint32_t size_mismatch; // file size doesn't match the chain length
+	uint32_t free_start;    // entries pointing at a free cluster
+	uint32_t repaired;      // problems fixed (with repair on)
+} FFCHECK;
+
+
+/**
+ * Check consistency of the volume.
+ *
+ * Reads the FAT once into memory (needs 2 bytes per cluster on FAT16,
+ * 4 on FAT32, plus a bitmap), and walks the directory tree once.
+ *
+ * With "repair", found problems are fixed:
+ * broken and cross-linked chains are cut, sizes are trimmed to
+ * the chain, entries pointing at free clusters are deleted,
+ * and lost clusters are freed.
+ *
+ * Returns true if the volume is consistent (after repair),
+ * false if problems remain, or if there is not enough memory.
+ * If memory runs out during the walk, lost clusters are not
+ * counted, and nothing more is repaired.
+ */
+bool ff_check(const FAT16* fat, FFCHECK* result, bool repair);
+
+
+/**
+ * Move a file or directory into one contiguous run of clusters.
+ *
+ * Data is copied into a free run first, then the entry is switched
+ * over and the old clusters are freed, so an interruption leaves
+ * at worst some lost clusters (see ff_check()).
+ *
+ * Other open handles of the file must be reopened afterwards.
+ *
+ * Returns false if the file is not fragmented, or if there is
+ * no free run large enough.
+ */
+bool ff_defrag_file(FFILE* file);
+
+
+/**
+ * Defragment all files and directories on the volume.
+ * Can be stopped after any file, and called again later.
+ *
+ * max_files ... maximum number of files to move, 0 = no limit
+ *
+ * Returns number of files moved.
+ */
+uint32_t ff_defrag(const FAT16* fat, uint32_t max_files);
+
+
+/**
+ * Compact the directory the handle is in: move all live entries
+ * to the front (keeping their order), end the directory with
+ * a blank entry, and free clusters no longer needed.
+ *
+ * Entry numbers change - other handles in this directory
+ * must be reopened. The handle is rewound to the first entry.
+ *
+ * Returns number of reclaimed entry slots.
+ */
+uint16_t ff_compact_dir(FFILE* dir);
+
+
+/** Result of ff_statfs() */
+typedef struct
+{
+	uint32_t clusters;          // data clusters of the volume
+	uint32_t free_clusters;     // free clusters
+	uint32_t largest_free;      // longest run of free clusters
+	uint32_t bad_clusters;      // clusters marked bad
+	uint32_t chains;            // cluster chains (files and directories with data)
+	uint32_t fragments;         // contiguous pieces of all chains (= chains if none is fragmented)
+	uint8_t frag_index;         // links of chains that jump elsewhere, in percent
+	uint16_t bytes_per_cluster;
+} FFSTATFS;
+
+
+/**
+ * Get free space and fragmentation statistics of the volume.
+ *
+ * Only the FAT is read, in large blocks; entries are classified
+ * 64 at a time (with SSE2 / AVX2 if available, see FF_USE_SIMD).
+ * The directory tree is not walked, so files are counted
+ * as chains - empty files without a cluster are not counted,
+ * and the FAT32 root directory is.
+ *
+ * The free cluster count hint (FSInfo) is updated.
+ */
+void ff_statfs(const FAT16* fat, FFSTATFS* out);
+
+
+
+
+// -------- INCREMENTAL JOBS -----------
+
+/** Kind of an incremental job */
+typedef enum
+{
+	FJ_NONE = 0,  // finished, or not started
+	FJ_DELETE,    // delete a file or a directory tree
+	FJ_FORMAT,    // format a volume
+	FJ_FREE_SCAN  // count free clusters
+} FFJOB_KIND;
+
+
+/**
+ * State of an incremental job. Started by one of the ff_job_*()
+ * functions, and advanced by ff_step() in bounded pieces.
+ *
+ * Only "kind" and "result" are meant to be read,
+ * the rest is internal.
+ */
+typedef struct
+{
+	FFJOB_KIND kind;
+
+	const FAT16* fat;
+	const BLOCKDEV* dev; // (format)
+
+	uint32_t pos; // next FAT entry (scan), next address (format)
+	uint32_t end; // where the job ends
+	uint32_t clu; // cluster chain being freed
+	uint32_t base; // boot sector address (format)
+
+	// Directory walk (tree delete)
+	uint16_t depth;  // directory levels entered, 0 = no walk
+	FFJOBDIR at;     // position in the current directory
+	FFJOBDIR stack[FF_JOB_DEPTH];
+
+	/**
+	 * Clusters freed (delete),
+	 * free clusters found (free scan),
+	 * sectors cleared (format).
+	 */
+	uint32_t result;
+} FFJOB;
+
+
+/**
+ * Start deleting a file or a directory with all its contents.
+ *
+ * The entry is removed right away, so the file is gone for lookups;
+ * its clusters (and the contents of a directory) are freed by ff_step().
+ * An interrupted job leaves only lost clusters (see ff_check()).
+ *
+ * Returns false if the entry can't be deleted ("." or "..").
+ */
+bool ff_job_delete(FFJOB* job, FFILE* file);
+
+
+/**
+ * Start formatting a volume, see ff_format().
+ * The volume can be mounted once the job is finished.
+ *
+ * Returns false if the geometry is not possible.
+ */
+bool ff_job_format(FFJOB* job, const BLOCKDEV* dev, uint32_t total_size, const FFORMAT* opts);
+
+
+/**
+ * Start counting free clusters. The count is in job->result.
+ */
+void ff_job_free_scan(FFJOB* job, const FAT16* fat);
+
+
+/**
+ * Advance a job by up to "budget" units of work, 0 = until finished.
+ *
+ * One unit is about one device access: freeing a cluster or reading
+ * a directory entry (delete), clearing a sector (format), or reading
+ * 32 FAT entries (free scan).
+ *
+ * Other calls on the volume may be made between steps, but not on
+ * the files being deleted.
+ *
+ * Returns true if the job is not finished yet.
+ */
+bool ff_step(FFJOB* job, uint32_t budget);
+
+
+
+#if FF_USE_JOURNAL
+
+// -------- JOURNAL (FF_USE_JOURNAL) -----------
+
+/**
+ * Create the journal file (FFJOURNL.SYS in root, hidden + system),
+ * about FF_JOURNAL_SIZE bytes in one contiguous run of clusters.
+ * An existing journal is found and replayed by ff_init().
+ *
+ * Returns true if the volume has a journal (created or existing).
+ */
+bool ff_journal_create(const FAT16* fat);
+
+
+/**
+ * Begin a transaction.
+ *
+ * Until ff_tx_commit(), metadata writes (FAT, directory entries)
+ * are collected in memory instead of going to the device.
+ * File contents are written directly, like without the journal,
+ * so they are on the device before the metadata pointing at them
+ * (overwriting existing data is not undone by a crash).
+ *
+ * A transaction that outgrows the journal is committed in parts,
+ * and only each part is atomic - keep transactions small.
+ *
+ * Returns false if there is no journal, or not enough memory.
+ */
+bool ff_tx_begin(const FAT16* fat);
+
+
+/**
+ * Commit the open transaction: write it to the journal, then apply it.
+ * Either all of it, or none of it is on the device after a power loss
+ * (an interrupted commit is finished by ff_init()).
+ *
+ * Takes two device flushes. Returns false if no transaction is open.
+ */
+bool ff_tx_commit(const FAT16* fat);
+
+#endif
+
+
+
+#if FF_USE_SIDECAR
+
+// -------- MOUNT SIDECAR (FF_USE_SIDECAR) -----------
+
+/**
+ * Store the mount sidecar, and mark the volume clean.
+ *
+ * The sidecar is a hidden system file in the root directory
+ * ("FFMOUNT.SYS", created on first use, in one contiguous run).
+ * It holds the free space hints and the found entries of the
+ * directory entry cache, with a volume stamp and a CRC.
+ * Pending file sizes are stored first (ff_sync_all()), and the free
+ * clusters are counted if that's not known yet.
+ *
+ * ff_init() loads it back, if the clean bit in FAT[1] is still set
+ * and the stamp and CRC match; otherwise the free count is rebuilt by
+ * a FAT scan (ff_statfs()). The first FAT change after mounting clears
+ * the clean bit, so call this again before shutdown.
+ *
+ * Other drivers may set the clean bit again when they unmount. The
+ * stamp catches their changes: on FAT32 it covers the FSInfo hints,
+ * which such drivers keep up to date, and the load is one read more.
+ * Without FSInfo (FAT16) it covers the whole FAT, which ff_init() then
+ * reads once; only the cache entries and the CPU side of the scan are
+ * saved there.
+ *
+ * Returns false in a transaction, or if the file can't be created.
+ */
+bool ff_sidecar_save(const FAT16* fat);
+
+#endif
+
+
+
+#if FF_USE_STATS
+
+// -------- STATISTICS (FF_USE_STATS) -----------
+
+/**
+ * Get access counters.
+ *
+ * op ... FF_OP_NONE for volume totals, or an operation to get
+ *        counters accumulated over all calls of that operation.
+ *        Nested calls (eg. ff_next in ff_find) count towards
+ *        the outermost call.
+ */
+void ff_get_stats(const FAT16* fat, FF_OP op, FFSTATS* out);
+
+
+/** Get counters of the most recent public call, and its operation. */
+FF_OP ff_get_last_stats(const FAT16* fat, FFSTATS* out);
+
+
+/** Clear all counters of the volume */
+void ff_reset_stats(FAT16* fat);
+
+
+/**
+ * Print a text table of all counters into a buffer.
+ * Returns the passed char*.
+ */
+char* ff_dump_stats(const FAT16* fat, char* buf, uint16_t len);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,476 @@
+#pragma once
+
+//
+// C++17 layer over the FAT16 library (header only).
+//
+// ff::Volume<Device> mounts a volume on a device class with the I/O
+// members of a BLOCKDEV, no function table needed. The library still
+// calls the device through a BLOCKDEV, made of static thunks that
+// forward to the members - one indirect call per access, as in C.
+// ff::Volume<BLOCKDEV> is the type-erased variant, over any BLOCKDEV.
+//
+// Files are move-only handles, flushed when they go out of scope,
+// and directories can be walked with range-for:
+//
+//   MyDevice dev;
+//   ff::Volume<MyDevice> vol(dev);
+//
+//   for (const FFILE& f : vol.root()) { ... }
+//
+//   ff::File log = vol.root().create("log.txt");
+//   log.write(ff::span<const uint8_t>(buf, len));
+//
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#if __cplusplus > 201703L && __has_include(<span>)
+#include <span>
+#endif
+
+#include "fat16.h"
+
+
+namespace ff
+{
+
+#ifdef __cpp_lib_span
+
+template<class T> using span = std::span<T>;
+
+#else
+
+/** Stand-in for std::span before C++20 (pointer and length) */
+template<class T>
+class span
+{
+public:
+	constexpr span() noexcept : ptr(nullptr), len(0) {}
+	constexpr span(T* data, std::size_t size) noexcept : ptr(data), len(size) {}
+
+	template<std::size_t N>
+	constexpr span(T (&arr)[N]) noexcept : ptr(arr), len(N) {}
+
+	/** From a container with data() and size(), or another span */
+	template<class C, class = std::enable_if_t<
+				 std::is_convertible_v<decltype(std::data(std::declval<C&>())), T*>>>
+	constexpr span(C&& c) noexcept : ptr(std::data(c)), len(std::size(c)) {}
+
+	constexpr T* data() const noexcept { return ptr; }
+	constexpr std::size_t size() const noexcept { return len; }
+	constexpr bool empty() const noexcept { return len == 0; }
+	constexpr T* begin() const noexcept { return ptr; }
+	constexpr T* end() const noexcept { return ptr + len; }
+	constexpr T& operator[](std::size_t i) const noexcept { return ptr[i]; }
+
+private:
+	T* ptr;
+	std::size_t len;
+};
+
+#endif
+
+
+class File;
+
+
+/**
+ * A directory, iterable with range-for.
+ *
+ * Iteration yields the regular entries (see ff_is_regular()),
+ * including "." and ".." of subdirectories.
+ */
+class Dir
+{
+public:
+	class iterator
+	{
+	public:
+		using iterator_category = std::input_iterator_tag;
+		using value_type = FFILE;
+		using difference_type = std::ptrdiff_t;
+		using pointer = const FFILE*;
+		using reference = const FFILE&;
+
+		/** End of the directory */
+		iterator() : at_end(true) {}
+
+		/** Start at the given entry (skipped if it's not regular) */
+		explicit iterator(const FFILE& first) : cur(first), at_end(false)
+		{
+			if (!ff_is_regular(&cur)) advance();
+		}
+
+		reference operator*() const { return cur; }
+		pointer operator->() const { return &cur; }
+
+		iterator& operator++()
+		{
+			advance();
+			return *this;
+		}
+
+		bool operator==(const iterator& o) const
+		{
+			if (at_end || o.at_end) return at_end == o.at_end;
+			return cur.clu == o.cur.clu && cur.num == o.cur.num;
+		}
+
+		bool operator!=(const iterator& o) const { return !(*this == o); }
+
+	private:
+		void advance()
+		{
+			do
+			{
+				if (!ff_next(&cur))
+				{
+					at_end = true;
+					return;
+				}
+			}
+			while (!ff_is_regular(&cur));
+		}
+
+		FFILE cur = {};
+		bool at_end;
+	};
+
+
+	/** No directory */
+	Dir() : valid(false) {}
+
+	/** Directory of the given handle (any entry in it) */
+	explicit Dir(const FFILE& entry) : dir(entry), valid(true) {}
+
+	explicit operator bool() const { return valid; }
+
+	iterator begin() const
+	{
+		if (!valid) return iterator();
+
+		FFILE f = dir;
+		ff_first(&f);
+		return iterator(f);
+	}
+
+	iterator end() const { return iterator(); }
+
+	/** Open a file in the directory; empty handle if not found */
+	inline File open(const char* name) const;
+
+	/** Create a file in the directory, and open it */
+	inline File create(const char* name) const;
+
+	/** Open a subdirectory */
+	Dir subdir(const char* name) const
+	{
+		FFILE f = dir;
+		if (!valid || !ff_find(&f, name) || !ff_opendir(&f)) return Dir();
+		return Dir(f);
+	}
+
+	/** Create a subdirectory, and open it */
+	Dir mkdir(const char* name) const
+	{
+		FFILE f = dir;
+		if (!valid || !ff_mkdir(&f, name)) return Dir();
+		return Dir(f);
+	}
+
+	/** The underlying handle */
+	const FFILE& raw() const { return dir; }
+
+private:
+	FFILE dir = {};
+	bool valid;
+};
+
+
+/**
+ * An open file (or directory entry) - move-only.
+ * The size is stored when the handle is closed or destroyed.
+ */
+class File
+{
+public:
+	/** No file */
+	File() : valid(false), written(false) {}
+
+	explicit File(const FFILE& f) : file(f), valid(true), written(false) {}
+
+	File(const File&) = delete;
+	File& operator=(const File&) = delete;
+
+	File(File&& o) noexcept : file(o.file), valid(o.valid), written(o.written)
+	{
+		o.valid = false;
+		o.written = false;
+	}
+
+	File& operator=(File&& o) noexcept
+	{
+		if (this != &o)
+		{
+			close();
+			file = o.file;
+			valid = o.valid;
+			written = o.written;
+			o.valid = false;
+			o.written = false;
+		}
+
+		return *this;
+	}
+
+	~File() { close(); }
+
+	explicit operator bool() const { return valid; }
+
+	/** Store the size if written, and release the handle */
+	void close()
+	{
+		flush();
+		valid = false;
+	}
+
+	/** Store the size, if written since the last flush */
+	void flush()
+	{
+		if (valid && written) ff_flush_file(&file);
+		written = false;
+	}
+
+	/** Read at the cursor; returns the number of bytes read */
+	std::size_t read(span<uint8_t> buf)
+	{
+		std::size_t done = 0;
+
+		while (valid && done < buf.size())
+		{
+			const std::size_t left = buf.size() - done;
+			const uint16_t chunk = (left > 0xFFFF) ? 0xFFFF : (uint16_t) left;
+			const uint16_t got = ff_read(&file, buf.data() + done, chunk);
+
+			done += got;
+			if (got < chunk) break; // end of file
+		}
+
+		return done;
+	}
+
+	/** Write at the cursor, extending the file if needed */
+	bool write(span<const uint8_t> buf)
+	{
+		if (!valid) return false;
+
+		written = true;
+		return ff_write(&file, buf.data(), (uint32_t) buf.size());
+	}
+
+	bool seek(uint32_t pos) { return valid && ff_seek(&file, pos); }
+	uint32_t tell() const { return file.cur_rel; }
+	uint32_t size() const { return file.size; }
+	bool is_dir() const { return file.attribs & FA_DIR; }
+
+	/** Long name if there is one, display name otherwise */
+	std::string name() const
+	{
+#if FF_USE_LFN
+		char buf[FF_LFN_MAX * 3 + 1];
+		if (!valid || ff_longname(&file, buf, sizeof(buf)) == NULL) return std::string();
+#else
+		char buf[13];
+		if (!valid || ff_dispname(&file, buf) == NULL) return std::string();
+#endif
+		return std::string(buf);
+	}
+
+	/** Open as a directory */
+	Dir dir() const
+	{
+		FFILE f = file;
+		if (!valid || !ff_opendir(&f)) return Dir();
+		return Dir(f);
+	}
+
+	/** Rename, or move into another directory (see ff_rename()) */
+	bool rename(const Dir& target, const char* new_name)
+	{
+		flush();
+		return valid && ff_rename(&file, &target.raw(), new_name);
+	}
+
+	/** Delete the file (directories with their contents); closes the handle */
+	bool remove()
+	{
+		if (!valid) return false;
+
+		written = false;
+		valid = false;
+		return ff_delete(&file);
+	}
+
+	/** The underlying handle */
+	FFILE& raw() { return file; }
+	const FFILE& raw() const { return file; }
+
+private:
+	FFILE file = {};
+	bool valid;
+	bool written;
+};
+
+
+File Dir::open(const char* name) const
+{
+	FFILE f = dir;
+	if (!valid || !ff_find(&f, name)) return File();
+	return File(f);
+}
+
+
+File Dir::create(const char* name) const
+{
+	FFILE f = dir;
+	if (!valid || !ff_newfile(&f, name)) return File();
+	return File(f);
+}
+
+
+/** Mounted volume, common part of all Volume types */
+class VolumeBase
+{
+public:
+	VolumeBase(const VolumeBase&) = delete;
+	VolumeBase& operator=(const VolumeBase&) = delete;
+
+	/** Pending sizes are stored when the volume goes away */
+	~VolumeBase()
+	{
+		if (mounted) ff_sync_all(&fat);
+	}
+
+	explicit operator bool() const { return mounted; }
+
+	/** The root directory */
+	Dir root() const
+	{
+		FFILE f;
+		ff_root(&fat, &f);
+		return Dir(f);
+	}
+
+	/** Open a file by its path (see ff_open_path()); empty handle if not found */
+	File open(const char* path) const
+	{
+		FFILE f;
+		if (!mounted || !ff_open_path(&fat, path, &f)) return File();
+		return File(f);
+	}
+
+	std::string label() const
+	{
+		char buf[12];
+		return std::string(ff_disk_label(&fat, buf));
+	}
+
+	/** Store pending file sizes and flush the device */
+	uint16_t sync() const { return ff_sync_all(&fat); }
+
+	bool check(FFCHECK& result, bool repair = false) const
+	{
+		return ff_check(&fat, &result, repair);
+	}
+
+	/** The underlying handle, for the C API */
+	const FAT16* raw() const { return &fat; }
+
+protected:
+	VolumeBase() = default;
+
+	void mount(const BLOCKDEV* dev, int partition)
+	{
+		mounted = (partition < 0) ? ff_init(dev, &fat) : ff_init_part(dev, &fat, (uint8_t) partition);
+	}
+
+	FAT16 fat = {};
+	bool mounted = false;
+};
+
+
+/**
+ * Binds the I/O members of a device class to a BLOCKDEV.
+ *
+ * A BLOCKDEV carries no context pointer, so this points at one device
+ * object per class - one volume per device class can be mounted at a time
+ * (as with the C backends, which have a single image each).
+ */
+template<class Device>
+struct DeviceOps
+{
+	static inline Device* dev = nullptr;
+
+	static void load(void* dest, const uint16_t len) { dev->load(dest, len); }
+	static void store(const void* src, const uint16_t len) { dev->store(src, len); }
+	static void write(const uint8_t b) { dev->write(b); }
+	static uint8_t read(void) { return dev->read(); }
+	static void seek(const uint32_t addr) { dev->seek(addr); }
+	static void rseek(const int16_t offset) { dev->rseek(offset); }
+	static void flush(void) { dev->flush(); }
+	static void discard(const uint32_t addr, const uint32_t len) { dev->discard(addr, len); }
+
+	/** Device with a discard member (optional) */
+	template<class D, class = void>
+	struct has_discard : std::false_type {};
+
+	template<class D>
+	struct has_discard<D, std::void_t<decltype(std::declval<D&>().discard(uint32_t(), uint32_t()))>> : std::true_type {};
+
+	using discard_fn = void (*)(const uint32_t, const uint32_t);
+
+	static constexpr discard_fn discard_ptr()
+	{
+		if constexpr (has_discard<Device>::value) return &discard;
+		else return nullptr;
+	}
+
+	static constexpr BLOCKDEV ops = { &load, &store, &write, &read, &seek, &rseek, &flush, discard_ptr() };
+};
+
+
+/**
+ * Volume on a device class with the BLOCKDEV operations as members:
+ * load, store, write, read, seek, rseek and flush, optionally discard.
+ *
+ * The device must outlive the volume.
+ */
+template<class Device>
+class Volume : public VolumeBase
+{
+public:
+	/** Mount the first FAT partition, or one by index (see ff_init_part()) */
+	explicit Volume(Device& dev, int partition = -1)
+	{
+		DeviceOps<Device>::dev = &dev;
+		mount(&DeviceOps<Device>::ops, partition);
+	}
+};
+
+
+/** Type-erased volume, over any BLOCKDEV (eg. pio_open()) */
+template<>
+class Volume<BLOCKDEV> : public VolumeBase
+{
+public:
+	explicit Volume(const BLOCKDEV* dev, int partition = -1)
+	{
+		mount(dev, partition);
+	}
+};
+
+} // namespace ff
@@ -0,0 +1,162 @@
+#pragma once
+
+//
+// Compile-time options of the FAT16 library.
+//
+// Each option can be overridden by defining it before
+// this file is included (eg. with -D on the command line).
+//
+
+
+/**
+ * Count device and FAT accesses, per volume and per public call.
+ * See ff_get_stats(). Compiles to nothing when disabled.
+ */
+#ifndef FF_USE_STATS
+#define FF_USE_STATS 0
+#endif
+
+
+/**
+ * Support VFAT long file names (reading, creating and lookup).
+ * See ff_longname().
+ */
+#ifndef FF_USE_LFN
+#define FF_USE_LFN 1
+#endif
+
+
+/**
+ * Size of the long name index (entries), used by ff_find().
+ * The index holds name hashes of one directory, so repeated
+ * lookups don't need to reassemble every long name.
+ * 0 = no index, always scan the directory.
+ */
+#ifndef FF_LFN_INDEX
+#define FF_LFN_INDEX 64
+#endif
+
+
+/**
+ * Size of the directory entry cache (entries), used by ff_open_path().
+ * It maps (directory, name) to the entry location, or to "not found".
+ * 0 = no cache.
+ */
+#ifndef FF_DCACHE_SIZE
+#define FF_DCACHE_SIZE 32
+#endif
+
+
+/**
+ * Longest name (bytes) whose "not found" result is cached.
+ * The cache keeps these names, as a hash match alone can't tell
+ * a missing name from another one. 0 = cache found entries only.
+ */
+#ifndef FF_DCACHE_NAME
+#define FF_DCACHE_NAME 16
+#endif
+
+
+/**
+ * Number of written files whose size is tracked by the volume,
+ * to be stored together by ff_sync_all(). If more files are written,
+ * the pending sizes are stored early (without a device flush).
+ * 0 = no tracking, sizes are stored only by ff_flush_file().
+ */
+#ifndef FF_MAX_DIRTY
+#define FF_MAX_DIRTY 32
+#endif
+
+
+/**
+ * Size of the device's logical blocks in bytes -
+ * the unit of addresses in the partition table.
+ */
+#ifndef FF_LBA_SIZE
+#define FF_LBA_SIZE 512
+#endif
+
+
+/**
+ * Physical block size of the device in bytes (up to 32768).
+ * FAT sectors written back in bulk and the journal records are
+ * aligned to it, and ff_format() starts the FATs, root directory
+ * and clusters on a block, so that the device doesn't need to
+ * read-modify-write.
+ */
+#ifndef FF_PHYS_BLOCK
+#define FF_PHYS_BLOCK 512
+#endif
+
+
+/**
+ * Allocation window, in clusters. When a file grows and the cluster
+ * after its last one is taken, it continues this far into a free run
+ * twice as long, leaving room to the file that ends before it.
+ * Files written at the same time then come out in long fragments,
+ * instead of interleaved cluster by cluster.
+ * 0 = continue at the first free cluster.
+ */
+#ifndef FF_ALLOC_WINDOW
+#define FF_ALLOC_WINDOW 64
+#endif
+
+
+/**
+ * Freed cluster ranges remembered for discarding, when the device
+ * has a discard function (TRIM, hole punching). Neighbouring clusters
+ * are merged into one range, and the ranges are discarded by
+ * ff_flush_file() and ff_sync_all(), once the FAT is flushed.
+ * When all are taken, the shortest range is forgotten (not discarded).
+ * 0 = never discard.
+ */
+#ifndef FF_DISCARD_RANGES
+#define FF_DISCARD_RANGES 16
+#endif
+
+
+/**
+ * Directory levels an incremental delete (ff_job_delete) remembers.
+ * Deeper trees still work, but returning from a level past this
+ * depth re-scans the parent directory.
+ */
+#ifndef FF_JOB_DEPTH
+#define FF_JOB_DEPTH 8
+#endif
+
+
+/**
+ * Metadata journal. With a journal file on the volume (ff_journal_create),
+ * FAT and directory changes made in a transaction (ff_tx_begin) are
+ * written to the journal first, and an interrupted commit is completed
+ * by ff_init().
+ */
+#ifndef FF_USE_JOURNAL
+#define FF_USE_JOURNAL 0
+#endif
+
+
+/** Size of the journal file in bytes, also the RAM used by a transaction */
+#ifndef FF_JOURNAL_SIZE
+#define FF_JOURNAL_SIZE 16384
+#endif
+
+
+/**
+ * Vector instructions in FAT scans (ff_statfs). SSE2 or AVX2 kernels
+ * are used when the compiler targets them (eg. -mavx2).
+ * 0 = portable code only.
+ */
+#ifndef FF_USE_SIMD
+#define FF_USE_SIMD 1
+#endif
+
+
+/**
+ * Mount sidecar. ff_sidecar_save() stores the free space hints and the
+ * directory entry cache in a hidden file on the volume and marks the
+ * volume clean, and ff_init() loads them back while it's still clean.
+ */
+#ifndef FF_USE_SIDECAR
+#define FF_USE_SIDECAR 0
+#endif
@@ -9,28 +9,93 @@
 /** Boot Sector structure */
 typedef struct __attribute__((packed))
 {
-	// Fields loaded directly from disk:
+	// Fields of the BIOS parameter block (parsed by read_bs):
 
-	// 13 bytes skipped
+	uint16_t bytes_per_sector;
 	uint8_t sectors_per_cluster;
 	uint16_t reserved_sectors;
 	uint8_t num_fats;
-	uint16_t root_entries;
-	// 3 bytes skipped
-	uint16_t fat_size_sectors;
-	// 8 bytes skipped
-	uint32_t total_sectors; // if "short size sectors" is used, it's copied here too
-	// 7 bytes skipped
-	char volume_label[11]; // space padded, no terminator
+	uint16_t root_entries;     // 0 on FAT32
+	uint32_t fat_size_sectors; // 16-bit field on FAT16, 32-bit on FAT32
+	uint32_t total_sectors;    // if "short size sectors" is used, it's copied here too
+	uint32_t root_cluster;     // first cluster of the root directory (FAT32)
+	uint16_t fsinfo_sector;    // FSInfo sector, relative to the boot sector (FAT32)
+	char volume_label[11];     // space padded, no terminator
 
 	// Added fields:
 
 	uint32_t bytes_per_cluster;
+	bool fat32; // FAT32 volume (decided by the number of clusters)
 
 }
 Fat16BootSector;
 
 
+#if FF_USE_LFN && FF_LFN_INDEX > 0
+
+/** Long name index slot */
+typedef struct __attribute__((packed))
+{
+	uint16_t hash; // hash of the case-folded long name
+	uint16_t num;  // entry number of the short name entry
+} FFLFNSLOT;
+
+#endif
+
+
+#if FF_DCACHE_SIZE > 0
+
+/** Directory entry cache slot */
+typedef struct __attribute__((packed))
+{
+	uint32_t hash;    // hash of the name, 0 = unused slot
+	uint32_t dir;     // directory cluster
+	uint16_t num;     // entry number, 0xFFFF = name not found
+	uint32_t ent_clu; // directory cluster holding the entry
+	uint16_t used;    // LRU stamp
+	uint16_t len;     // length of the name
+#if FF_DCACHE_NAME > 0
+	char name[FF_DCACHE_NAME]; // the name, for "not found" results
+#endif
+} FFDENTRY;
+
+#endif
+
+
+#if FF_MAX_DIRTY > 0
+
+/** Pending metadata of a written file */
+typedef struct __attribute__((packed))
+{
+	uint32_t entry; // address of the directory entry
+	uint32_t size;  // file size to store
+	uint32_t tail;  // cluster holding the last byte
+} FFDIRTY;
+
+#endif
+
+
+#if FF_DISCARD_RANGES > 0
+
+/** Freed clusters, not yet discarded */
+typedef struct __attribute__((packed))
+{
+	uint32_t start; // first cluster
+	uint32_t count; // number of clusters
+} FFDISCARD;
+
+#endif
+
+
+/** Position in a directory walked by an incremental job */
+typedef struct __attribute__((packed))
+{
+	uint32_t dir; // directory start cluster
+	uint32_t ent; // cluster holding the entry
+	uint16_t num; // entry number
+} FFJOBDIR;
+
+
 /** FAT filesystem handle */
 typedef struct __attribute__((packed))
 {
@@ -48,6 +113,68 @@ typedef struct __attribute__((packed))
 
 	// Boot sector data struct
 	Fat16BootSector bs;
+
+	// Free space hints (runtime state, kept in the FSInfo sector on FAT32)
+	uint32_t free_count; // free clusters, 0xFFFFFFFF = unknown
+	uint32_t next_free;  // where to start looking for a free cluster
+	uint32_t next_run;   // where to start looking for a free run (end of the last one)
+	uint32_t fsi_addr;   // FSInfo sector address, 0 = none
+	bool fsi_dirty;      // hints changed since they were stored
+	bool no_window;      // no free run for a new allocation window (see FF_ALLOC_WINDOW)
+
+#if FF_USE_STATS
+	// Access counters (runtime state)
+	FFSTATS stats;                 // volume totals
+	FFSTATS op_stats[FF_OP_COUNT]; // per operation
+	FFSTATS last_stats;            // the last public call
+	uint8_t op;                    // operation being counted
+	uint8_t last_op;               // operation of last_stats
+#endif
+
+#if FF_USE_LFN && FF_LFN_INDEX > 0
+	// Long name index of one directory (runtime state)
+	uint32_t lfn_dir;                    // indexed directory, 0xFFFFFFFF = none
+	uint16_t lfn_used;                   // slots in use
+	bool lfn_partial;                    // some names did not fit
+	uint16_t lfn_next;                   // first entry not indexed (lfn_partial)
+	FFLFNSLOT lfn_index[FF_LFN_INDEX];
+#endif
+
+#if FF_DCACHE_SIZE > 0
+	// Directory entry cache (runtime state)
+	FFDENTRY dcache[FF_DCACHE_SIZE];
+	uint16_t dcache_clock; // LRU stamp source
+#endif
+
+#if FF_MAX_DIRTY > 0
+	// Written files, not yet synced (runtime state)
+	FFDIRTY dirty[FF_MAX_DIRTY];
+	uint16_t dirty_count;
+#endif
+
+#if FF_DISCARD_RANGES > 0
+	// Freed clusters, to be discarded (runtime state)
+	FFDISCARD discard[FF_DISCARD_RANGES];
+	uint16_t discard_count;
+#endif
+
+#if FF_USE_SIDECAR
+	// Mount sidecar (runtime state)
+	uint32_t sc_gen; // generation of the stored sidecar
+	bool sc_clean;   // volume marked clean, the first FAT change clears it
+#endif
+
+#if FF_USE_JOURNAL
+	// Metadata journal (runtime state)
+	uint32_t jr_addr;  // journal file start, 0 = no journal
+	uint32_t jr_size;  // journal file size
+	uint32_t jr_seq;   // number of the last commit
+	uint8_t* jr_buf;   // pending records, NULL = no transaction
+	uint32_t jr_used;  // bytes used in jr_buf
+	uint32_t jr_last;  // offset of the last record in jr_buf
+	uint32_t jr_pos;   // device cursor, tracked during a transaction
+	bool jr_bypass;    // writing file contents, not journaled
+#endif
 }
 FAT16;
 
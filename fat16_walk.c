@@ -0,0 +1,367 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "fat16_walk.h"
+
+
+
+/** A directory waiting to be walked */
+typedef struct
+{
+	uint32_t clu; // first cluster of the directory
+	char* path;   // path of the directory (owned by the job)
+} WalkJob;
+
+
+/**
+ * Double-ended job queue of one worker.
+ * The owner works at the tail (depth-first), thieves take from the head.
+ */
+typedef struct
+{
+	pthread_mutex_t lock;
+	WalkJob* jobs;
+	uint32_t head;
+	uint32_t tail;
+	uint32_t cap;
+} WalkDeque;
+
+
+/** Shared walk state */
+typedef struct
+{
+	const FAT16* fat;
+	FF_WALK_CB cb;
+	void* arg;
+
+	WalkDeque* deques;
+	uint8_t count; // number of workers
+
+	uint32_t pending; // jobs queued or being processed
+	bool abort;
+
+	// Idle workers sleep here until there's a new job, or the walk ends
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+	uint32_t wakeups; // bumped on every wake-up, so none is missed
+} WalkPool;
+
+
+/** Worker context */
+typedef struct
+{
+	WalkPool* pool;
+	uint8_t id;
+} WalkWorker;
+
+
+
+static bool deque_push(WalkDeque* dq, const WalkJob* job)
+{
+	pthread_mutex_lock(&dq->lock);
+
+	if (dq->tail == dq->cap)
+	{
+		// compact & grow
+		const uint32_t used = dq->tail - dq->head;
+		if (used > 0) memmove(dq->jobs, dq->jobs + dq->head, used * sizeof(WalkJob));
+		dq->head = 0;
+		dq->tail = used;
+
+		if (used * 2 >= dq->cap)
+		{
+			const uint32_t cap = dq->cap ? dq->cap * 2 : 16;
+			WalkJob* jobs = realloc(dq->jobs, cap * sizeof(WalkJob));
+			if (jobs == NULL)
+			{
+				pthread_mutex_unlock(&dq->lock);
+				return false;
+			}
+
+			dq->jobs = jobs;
+			dq->cap = cap;
+		}
+	}
+
+	dq->jobs[dq->tail++] = *job;
+
+	pthread_mutex_unlock(&dq->lock);
+	return true;
+}
+
+
+/** Take a job from the tail (owner) */
+static bool deque_pop(WalkDeque* dq, WalkJob* job)
+{
+	bool ok = false;
+	pthread_mutex_lock(&dq->lock);
+
+	if (dq->tail > dq->head)
+	{
+		*job = dq->jobs[--dq->tail];
+		ok = true;
+	}
+
+	pthread_mutex_unlock(&dq->lock);
+	return ok;
+}
+
+
+/** Take a job from the head (thief) */
+static bool deque_steal(WalkDeque* dq, WalkJob* job)
+{
+	bool ok = false;
+
+	if (pthread_mutex_trylock(&dq->lock) != 0)
+		return false; // busy, try someone else
+
+	if (dq->tail > dq->head)
+	{
+		*job = dq->jobs[dq->head++];
+		ok = true;
+	}
+
+	pthread_mutex_unlock(&dq->lock);
+	return ok;
+}
+
+
+/** Wake one idle worker (new job), or all of them (walk done or aborted) */
+static void pool_wake(WalkPool* pool, const bool all)
+{
+	pthread_mutex_lock(&pool->idle_lock);
+
+	__atomic_add_fetch(&pool->wakeups, 1, __ATOMIC_SEQ_CST);
+	if (all) pthread_cond_broadcast(&pool->idle_cond);
+	else pthread_cond_signal(&pool->idle_cond);
+
+	pthread_mutex_unlock(&pool->idle_lock);
+}
+
+
+/** Sleep until pool_wake(), unless it was called since "seen" was read */
+static void pool_idle(WalkPool* pool, const uint32_t seen)
+{
+	pthread_mutex_lock(&pool->idle_lock);
+
+	while (__atomic_load_n(&pool->wakeups, __ATOMIC_SEQ_CST) == seen)
+		pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+
+	pthread_mutex_unlock(&pool->idle_lock);
+}
+
+
+static char* path_join(const char* dir, const char* name)
+{
+	const size_t dl = strlen(dir);
+	const size_t nl = strlen(name);
+
+	char* p = malloc(dl + nl + 2);
+	if (p == NULL) return NULL;
+
+	memcpy(p, dir, dl);
+	p[dl] = '/';
+	memcpy(p + dl + 1, name, nl + 1);
+
+	return p;
+}
+
+
+/** Walk one directory, queueing its subdirectories */
+static bool walk_dir(WalkPool* pool, WalkDeque* own, const FAT16* fat, const WalkJob* job)
+{
+	FFILE file;
+	file.fat = fat;
+
+	const FSAVEPOS pos = { .clu = job->clu, .num = 0, .cur_rel = 0 };
+	ff_reopen(&file, &pos);
+
+#if FF_USE_LFN
+	char name[FF_LFN_MAX * 3 + 1];
+#else
+	char name[13];
+#endif
+
+	do
+	{
+		if (__atomic_load_n(&pool->abort, __ATOMIC_RELAXED))
+			return false;
+
+		if (file.type != FT_FILE && file.type != FT_SUBDIR)
+			continue;
+
+		if (!pool->cb(&file, job->path, pool->arg))
+			return false;
+
+		if (file.type == FT_SUBDIR && file.clu_start != 0)
+		{
+			WalkJob sub;
+			sub.clu = file.clu_start;
+#if FF_USE_LFN
+			sub.path = path_join(job->path, ff_longname(&file, name, sizeof(name)));
+#else
+			sub.path = path_join(job->path, ff_dispname(&file, name));
+#endif
+
+			if (sub.path == NULL)
+				return false;
+
+			__atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+
+			if (!deque_push(own, &sub))
+			{
+				__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+				free(sub.path);
+				return false;
+			}
+
+			pool_wake(pool, false);
+		}
+	}
+	while (ff_next(&file));
+
+	return true;
+}
+
+
+static void* walk_worker(void* arg)
+{
+	WalkWorker* w = arg;
+	WalkPool* pool = w->pool;
+	WalkDeque* own = &pool->deques[w->id];
+
+	// Private copy of the volume handle
+	FAT16 fat = *pool->fat;
+
+	uint8_t victim = w->id;
+
+	while (!__atomic_load_n(&pool->abort, __ATOMIC_RELAXED))
+	{
+		const uint32_t seen = __atomic_load_n(&pool->wakeups, __ATOMIC_SEQ_CST);
+
+		WalkJob job;
+		bool got = deque_pop(own, &job);
+
+		// Own queue empty, try to steal
+		for (uint8_t i = 1; !got && i < pool->count; i++)
+		{
+			victim = (victim + 1) % pool->count;
+			if (victim == w->id) continue;
+			got = deque_steal(&pool->deques[victim], &job);
+		}
+
+		if (!got)
+		{
+			if (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0)
+				break; // all done
+
+			pool_idle(pool, seen);
+			continue;
+		}
+
+		bool wake_all = false;
+		if (!walk_dir(pool, own, &fat, &job))
+		{
+			__atomic_store_n(&pool->abort, true, __ATOMIC_RELAXED);
+			wake_all = true;
+		}
+
+		free(job.path);
+		if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) == 0)
+			wake_all = true;
+
+		if (wake_all) pool_wake(pool, true);
+	}
+
+	return NULL;
+}
+
+
+bool ff_walk(const FAT16* fat, FF_WALK_CB cb, void* arg, uint8_t threads)
+{
+	if (threads == 0) threads = 1;
+
+	WalkPool pool;
+	pool.fat = fat;
+	pool.cb = cb;
+	pool.arg = arg;
+	pool.count = threads;
+	pool.pending = 1;
+	pool.abort = false;
+	pool.wakeups = 0;
+	pthread_mutex_init(&pool.idle_lock, NULL);
+	pthread_cond_init(&pool.idle_cond, NULL);
+
+	pool.deques = calloc(threads, sizeof(WalkDeque));
+	WalkWorker* workers = calloc(threads, sizeof(WalkWorker));
+	pthread_t* tids = calloc(threads, sizeof(pthread_t));
+
+	bool ok = (pool.deques != NULL && workers != NULL && tids != NULL);
+
+	for (uint8_t i = 0; pool.deques != NULL && i < threads; i++)
+	{
+		pthread_mutex_init(&pool.deques[i].lock, NULL);
+	}
+
+	for (uint8_t i = 0; workers != NULL && i < threads; i++)
+	{
+		workers[i].pool = &pool;
+		workers[i].id = i;
+	}
+
+	// Seed with the root directory (a cluster chain on FAT32)
+	FFILE first;
+	ff_root(fat, &first);
+
+	WalkJob root = { .clu = first.clu, .path = calloc(1, 1) };
+	ok = ok && root.path != NULL && deque_push(&pool.deques[0], &root);
+
+	if (ok)
+	{
+		// Worker 0 runs in the calling thread
+		uint8_t started = 1;
+		for (; started < threads; started++)
+		{
+			if (pthread_create(&tids[started], NULL, &walk_worker, &workers[started]) != 0)
+				break;
+		}
+
+		walk_worker(&workers[0]);
+
+		for (uint8_t i = 1; i < started; i++)
+		{
+			pthread_join(tids[i], NULL);
+		}
+
+		ok = !pool.abort;
+	}
+	else
+	{
+		free(root.path);
+	}
+
+	// Discard leftover jobs (after abort)
+	for (uint8_t i = 0; pool.deques != NULL && i < threads; i++)
+	{
+		WalkDeque* dq = &pool.deques[i];
+		for (uint32_t j = dq->head; j < dq->tail; j++)
+		{
+			free(dq->jobs[j].path);
+		}
+
+		free(dq->jobs);
+		pthread_mutex_destroy(&dq->lock);
+	}
+
+	pthread_cond_destroy(&pool.idle_cond);
+	pthread_mutex_destroy(&pool.idle_lock);
+
+	free(pool.deques);
+	free(workers);
+	free(tids);
+
+	return ok;
+}
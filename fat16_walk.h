@@ -0,0 +1,46 @@
+#pragma once
+
+//
+// Whole-tree walker for the FAT16 library (POSIX hosts, uses pthreads).
+//
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "fat16.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/**
+ * Walk callback, called once for every file and subdirectory.
+ *
+ * file ... the entry (valid only during the call)
+ * path ... path of the containing directory, "" for root
+ * arg  ... user argument passed to ff_walk()
+ *
+ * Return false to abort the walk.
+ */
+typedef bool (*FF_WALK_CB)(const FFILE* file, const char* path, void* arg);
+
+
+/**
+ * Walk the whole directory tree, starting at the root directory.
+ *
+ * With threads > 1, subdirectories are distributed over a pool
+ * of work-stealing workers. The callback is then called concurrently,
+ * and the block device must support access from multiple threads
+ * (eg. the positional-I/O backend, blockdev_pio.h).
+ *
+ * The volume must not be modified while the walk is running.
+ *
+ * Returns false if the walk was aborted by the callback,
+ * or on allocation failure.
+ */
+bool ff_walk(const FAT16* fat, FF_WALK_CB cb, void* arg, uint8_t threads);
+
+#ifdef __cplusplus
+}
+#endif
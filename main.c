@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "fat16.h"
 
@@ -52,6 +53,11 @@ uint8_t test_read()
 	return a;
 }
 
+void test_flush()
+{
+	fflush(testf);
+}
+
 void test_open()
 {
 	test.read = &test_read;
@@ -63,7 +69,21 @@ void test_open()
 	test.seek = &test_seek;
 	test.rseek = &test_rseek;
 
+	test.flush = &test_flush;
+
 	testf = fopen("imgs/hamlet.img", "rb+");
+
+	if (testf == NULL)
+	{
+		// No image yet, make a fresh one
+		const uint32_t size = 16 * 1024 * 1024;
+
+		testf = fopen("imgs/hamlet.img", "wb+");
+		ftruncate(fileno(testf), size);
+
+		const FFORMAT fmt = { .label = "HAMLET" };
+		ff_format(&test, size, &fmt);
+	}
 }
 
 void test_close()
@@ -0,0 +1,362 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blockdev_trace.h"
+#include "blockdev_pio.h"
+#include "blockdev_mmap.h"
+#include "blockdev_direct.h"
+
+//
+// Replay a block device trace (see blockdev_trace.h) against an image,
+// report timing, and optionally check the trace against I/O budgets.
+//
+
+
+/** Decoded trace record */
+typedef struct
+{
+	uint8_t op;
+	int32_t arg;   // address / offset / length
+	uint32_t len;  // length of a discard
+	uint32_t data; // offset of write data in the trace, or 0
+} Rec;
+
+
+/** I/O counts of a trace */
+typedef struct
+{
+	uint32_t ops;
+	uint32_t seeks;
+	uint32_t loaded;
+	uint32_t stored;
+	uint32_t flushes;
+} Counts;
+
+
+static uint8_t* trace;
+static size_t trace_len;
+static size_t pos;
+
+
+static bool get_varint(uint32_t* out)
+{
+	uint32_t v = 0;
+	for (uint8_t shift = 0; shift < 35; shift += 7)
+	{
+		if (pos >= trace_len) return false;
+
+		const uint8_t b = trace[pos++];
+		v |= (uint32_t)(b & 0x7F) << shift;
+
+		if (!(b & 0x80))
+		{
+			*out = v;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+static bool get_zigzag(int32_t* out)
+{
+	uint32_t v;
+	if (!get_varint(&v)) return false;
+
+	*out = (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+	return true;
+}
+
+
+/** Decode the trace into records, and count what it does */
+static Rec* decode(uint32_t* count, Counts* cnt)
+{
+	if (trace_len < 6 || memcmp(trace, "FFTR", 4) != 0 || trace[4] == 0 || trace[4] > TRACE_VERSION)
+	{
+		fprintf(stderr, "Not a trace file.\n");
+		return NULL;
+	}
+
+	const bool with_data = trace[5] & TRACE_DATA;
+	pos = 6;
+
+	uint32_t cap = 1024;
+	uint32_t n = 0;
+	Rec* recs = malloc(cap * sizeof(Rec));
+
+	// absolute cursor, seeks are stored relative to it
+	uint32_t cur = 0;
+
+	while (pos < trace_len)
+	{
+		if (n == cap)
+		{
+			cap *= 2;
+			recs = realloc(recs, cap * sizeof(Rec));
+		}
+
+		Rec* r = &recs[n];
+		r->op = trace[pos++];
+		r->arg = 0;
+		r->data = 0;
+		r->len = 0;
+
+		uint32_t len;
+		bool ok = true;
+
+		switch (r->op)
+		{
+			case 's':
+				ok = get_zigzag(&r->arg);
+				cur += r->arg;
+				r->arg = cur;
+				cnt->seeks++;
+				break;
+
+			case 'r':
+				ok = get_zigzag(&r->arg);
+				cur += r->arg;
+				cnt->seeks++;
+				break;
+
+			case 'l':
+				ok = get_varint(&len);
+				r->arg = len;
+				cur += len;
+				cnt->loaded += len;
+				break;
+
+			case 't':
+				ok = get_varint(&len);
+				r->arg = len;
+				cur += len;
+				cnt->stored += len;
+
+				if (with_data)
+				{
+					r->data = pos;
+					pos += len;
+				}
+				break;
+
+			case 'g':
+				cur++;
+				cnt->loaded++;
+				break;
+
+			case 'p':
+				cur++;
+				cnt->stored++;
+
+				if (with_data)
+				{
+					r->data = pos++;
+				}
+				break;
+
+			case 'f':
+				cnt->flushes++;
+				break;
+
+			case 'd':
+				ok = get_varint(&len) && get_varint(&r->len);
+				r->arg = len;
+				break;
+
+			default:
+				ok = false;
+		}
+
+		if (!ok || pos > trace_len)
+		{
+			fprintf(stderr, "Corrupt trace at byte %zu.\n", pos);
+			free(recs);
+			return NULL;
+		}
+
+		n++;
+	}
+
+	cnt->ops = n;
+	*count = n;
+	return recs;
+}
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+static void run(const BLOCKDEV* dev, const Rec* recs, uint32_t n)
+{
+	static uint8_t buf[65536];
+
+	for (uint32_t i = 0; i < n; i++)
+	{
+		const Rec* r = &recs[i];
+
+		switch (r->op)
+		{
+			case 's': dev->seek(r->arg); break;
+			case 'r': dev->rseek(r->arg); break;
+			case 'l': dev->load(buf, r->arg); break;
+			case 't': dev->store(r->data ? trace + r->data : buf, r->arg); break;
+			case 'g': dev->read(); break;
+			case 'p': dev->write(r->data ? trace[r->data] : 0); break;
+			case 'f': dev->flush(); break;
+			case 'd': if (dev->discard != NULL) dev->discard(r->arg, r->len); break;
+		}
+	}
+}
+
+
+/**
+ * Check counts against a budget, given as "key=max,key=max,..."
+ * Keys: ops, seeks, loaded, stored, flushes
+ */
+static bool check_budget(const Counts* cnt, char* spec)
+{
+	bool ok = true;
+
+	for (char* tok = strtok(spec, ","); tok != NULL; tok = strtok(NULL, ","))
+	{
+		char* eq = strchr(tok, '=');
+		if (eq == NULL) continue;
+		*eq = 0;
+
+		const uint32_t max = strtoul(eq + 1, NULL, 10);
+		uint32_t val;
+
+		if (strcmp(tok, "ops") == 0) val = cnt->ops;
+		else if (strcmp(tok, "seeks") == 0) val = cnt->seeks;
+		else if (strcmp(tok, "loaded") == 0) val = cnt->loaded;
+		else if (strcmp(tok, "stored") == 0) val = cnt->stored;
+		else if (strcmp(tok, "flushes") == 0) val = cnt->flushes;
+		else
+		{
+			fprintf(stderr, "Unknown budget key: %s\n", tok);
+			ok = false;
+			continue;
+		}
+
+		if (val > max)
+		{
+			printf("OVER BUDGET: %s = %u (max %u)\n", tok, val, max);
+			ok = false;
+		}
+	}
+
+	return ok;
+}
+
+
+static void usage(const char* prog)
+{
+	fprintf(stderr,
+			"Usage: %s [-m|-d] [-n repeat] [-b budget] trace image\n"
+			"  -m  use the mmap backend (default: pread/pwrite)\n"
+			"  -d  use the O_DIRECT backend\n"
+			"  -n  replay the trace N times\n"
+			"  -b  I/O budget, eg. seeks=100,loaded=4096 (exit code 2 if exceeded)\n"
+			"      keys: ops, seeks, loaded, stored, flushes\n", prog);
+}
+
+
+int main(int argc, char** argv)
+{
+	bool use_mmap = false;
+	bool use_direct = false;
+	uint32_t repeat = 1;
+	char* budget = NULL;
+
+	int c;
+	while ((c = getopt(argc, argv, "mdn:b:h")) != -1)
+	{
+		switch (c)
+		{
+			case 'm': use_mmap = true; break;
+			case 'd': use_direct = true; break;
+			case 'n': repeat = atoi(optarg); break;
+			case 'b': budget = optarg; break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (argc - optind != 2)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	// Load the trace
+	FILE* f = fopen(argv[optind], "rb");
+	if (f == NULL)
+	{
+		perror(argv[optind]);
+		return 1;
+	}
+
+	fseek(f, 0, SEEK_END);
+	trace_len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	trace = malloc(trace_len);
+	trace_len = fread(trace, 1, trace_len, f);
+	fclose(f);
+
+	Counts cnt = { 0 };
+	uint32_t n;
+	Rec* recs = decode(&n, &cnt);
+	if (recs == NULL) return 1;
+
+	printf("trace: %u ops, %u seeks, %u B loaded, %u B stored, %u flushes\n",
+		   cnt.ops, cnt.seeks, cnt.loaded, cnt.stored, cnt.flushes);
+
+	// Budget check needs no image
+	const bool in_budget = (budget == NULL) || check_budget(&cnt, budget);
+
+	const BLOCKDEV* dev;
+	if (use_mmap) dev = mmap_open(argv[optind + 1]);
+	else if (use_direct) dev = direct_open(argv[optind + 1]);
+	else dev = pio_open(argv[optind + 1]);
+
+	if (dev == NULL)
+	{
+		fprintf(stderr, "Could not open image %s\n", argv[optind + 1]);
+		return 1;
+	}
+
+	const uint64_t t0 = now_ns();
+	for (uint32_t i = 0; i < repeat; i++)
+	{
+		run(dev, recs, n);
+	}
+	const uint64_t dt = now_ns() - t0;
+
+	if (use_mmap) mmap_close();
+	else if (use_direct) direct_close();
+	else pio_close();
+
+	const double sec = dt / 1e9;
+	printf("replay (%s, %u x): %.2f ms, %.3f us/op, %.2f MB/s\n",
+		   use_mmap ? "mmap" : use_direct ? "direct" : "pio", repeat, dt / 1e6,
+		   dt / 1e3 / ((double) n * repeat),
+		   ((double)(cnt.loaded + cnt.stored) * repeat / 1048576.0) / sec);
+
+	free(recs);
+	free(trace);
+
+	return in_budget ? 0 : 2;
+}
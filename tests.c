@@ -0,0 +1,2141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <setjmp.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "fat16.h"
+#include "fat16_walk.h"
+#include "blockdev_trace.h"
+#include "blockdev_direct.h"
+#include "blockdev_pio.h"
+
+//
+// Tests of the library on a volume in RAM.
+// Build & run with "make check".
+//
+
+
+// ------------- RAM block device ----------------
+
+static uint8_t* ram;
+static uint32_t ram_size;
+static __thread uint32_t ram_pos; // per thread, for the walker
+
+
+/** Device access counters */
+typedef struct
+{
+	uint32_t loads;   // load() calls
+	uint32_t stores;  // store() calls
+	uint32_t writes;  // write() calls
+	uint32_t bulk;    // loads of 512 bytes or more
+	uint32_t loaded;  // bytes read
+	uint32_t stored;  // bytes written
+	uint32_t seeks;   // seek() and rseek() calls
+	uint32_t flushes; // flush() calls
+} RamCount;
+
+static RamCount ram_count;
+
+// the walker uses the device from more threads
+#define COUNT(field, n) __atomic_add_fetch(&ram_count.field, (n), __ATOMIC_RELAXED)
+
+
+static void ram_load(void* dest, const uint16_t len)
+{
+	memcpy(dest, ram + ram_pos, len);
+	ram_pos += len;
+	COUNT(loads, 1);
+	COUNT(loaded, len);
+	if (len >= 512) COUNT(bulk, 1);
+}
+
+static void ram_store(const void* source, const uint16_t len)
+{
+	memcpy(ram + ram_pos, source, len);
+	ram_pos += len;
+	COUNT(stores, 1);
+	COUNT(stored, len);
+}
+
+static void ram_write(const uint8_t b)
+{
+	ram[ram_pos++] = b;
+	COUNT(writes, 1);
+	COUNT(stored, 1);
+}
+
+static uint8_t ram_read(void)
+{
+	COUNT(loaded, 1);
+	return ram[ram_pos++];
+}
+
+static void ram_seek(const uint32_t addr)
+{
+	ram_pos = addr;
+	COUNT(seeks, 1);
+}
+
+static void ram_rseek(const int16_t offset)
+{
+	ram_pos += offset;
+	COUNT(seeks, 1);
+}
+
+
+
+// Simulated power loss: the flush number "ram_crash_at" jumps to "ram_crash"
+static int ram_crash_at = -1;
+static jmp_buf ram_crash;
+
+static void ram_flush(void)
+{
+	COUNT(flushes, 1);
+
+	if (ram_crash_at >= 0 && ram_count.flushes >= (uint32_t) ram_crash_at)
+		longjmp(ram_crash, 1);
+}
+
+static const BLOCKDEV ram_dev = {
+	&ram_load, &ram_store, &ram_write, &ram_read,
+	&ram_seek, &ram_rseek, &ram_flush
+};
+
+
+/** Allocate a new blank device */
+static void ram_new(const uint32_t size)
+{
+	free(ram);
+	ram = calloc(size, 1);
+	ram_size = size;
+}
+
+
+
+static void put16(uint8_t* p, const uint16_t v)
+{
+	p[0] = v & 0xFF;
+	p[1] = v >> 8;
+}
+
+
+static void put32(uint8_t* p, const uint32_t v)
+{
+	put16(p, v & 0xFFFF);
+	put16(p + 2, v >> 16);
+}
+
+
+
+// ------------- helpers ----------------
+
+static int failures;
+
+#define CHECK(cond) do { \
+		if (!(cond)) \
+		{ \
+			printf("  FAILED %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+
+/** Allocate a new device with a blank volume */
+static void ram_blank(const uint32_t size)
+{
+	ram_new(size);
+	CHECK(ff_format(&ram_dev, ram_size, NULL));
+}
+
+
+/** Read a FAT entry straight from the device, not through the library */
+static uint32_t ram_fat(const FAT16* fat, const uint32_t clu)
+{
+	const uint8_t* p = ram + fat->fat_addr;
+
+	if (fat->bs.fat32)
+	{
+		p += clu * 4;
+		return (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24)) & 0x0FFFFFFF;
+	}
+
+	p += clu * 2;
+	return p[0] | (p[1] << 8);
+}
+
+
+/** Number of data clusters, from the layout of the volume */
+static uint32_t ram_clusters(const FAT16* fat)
+{
+	const uint32_t bps = fat->bs.bytes_per_sector;
+	const uint32_t base = fat->fat_addr - fat->bs.reserved_sectors * bps;
+	return (base + fat->bs.total_sectors * bps - fat->data_addr) / fat->bs.bytes_per_cluster;
+}
+
+
+/** Count free clusters in the FAT */
+static uint32_t ram_free(const FAT16* fat)
+{
+	const uint32_t end = ram_clusters(fat) + 2;
+	uint32_t count = 0;
+
+	for (uint32_t clu = 2; clu < end; clu++)
+	{
+		if (ram_fat(fat, clu) == 0) count++;
+	}
+
+	return count;
+}
+
+
+/** Check for an end of chain mark */
+static bool ram_end(const FAT16* fat, const uint32_t value)
+{
+	if (fat->bs.fat32) return value >= 0x0FFFFFF8;
+	return value >= 0xFFF8;
+}
+
+
+/** Length of a cluster chain, and the number of its contiguous pieces */
+static uint32_t ram_chain(const FAT16* fat, uint32_t clu, uint32_t* pieces)
+{
+	const uint32_t end = ram_clusters(fat) + 2;
+	uint32_t len = 0;
+	*pieces = 0;
+
+	for (uint32_t prev = 0; clu >= 2 && clu < end && len < end; len++)
+	{
+		if (clu != prev + 1) (*pieces)++;
+
+		prev = clu;
+		clu = ram_fat(fat, clu);
+		if (ram_end(fat, clu)) return len + 1;
+	}
+
+	return len;
+}
+
+
+/** Content of test files */
+static uint8_t pattern(const uint32_t seed, const uint32_t pos)
+{
+	return (uint8_t) (seed * 31 + pos * 7 + (pos >> 9));
+}
+
+
+/** Create a file in the directory, and fill it */
+static bool make_file(const FFILE* dir, const char* name, const uint32_t size, const uint32_t seed)
+{
+	FFILE f = *dir;
+	if (!ff_newfile(&f, name)) return false;
+
+	uint8_t buf[1000];
+	for (uint32_t pos = 0; pos < size; pos += sizeof(buf))
+	{
+		const uint32_t n = (size - pos < sizeof(buf)) ? size - pos : sizeof(buf);
+
+		for (uint32_t i = 0; i < n; i++)
+			buf[i] = pattern(seed, pos + i);
+
+		if (!ff_write(&f, buf, n)) return false;
+	}
+
+	ff_flush_file(&f);
+	return true;
+}
+
+
+/** Find a file in the directory, and compare its contents */
+static bool verify_file(const FFILE* dir, const char* name, const uint32_t size, const uint32_t seed)
+{
+	FFILE f = *dir;
+	if (!ff_find(&f, name)) return false;
+	if (f.size != size) return false;
+
+	uint8_t buf[1000];
+	for (uint32_t pos = 0; pos < size; pos += sizeof(buf))
+	{
+		const uint16_t n = (size - pos < sizeof(buf)) ? size - pos : sizeof(buf);
+
+		if (ff_read(&f, buf, n) != n) return false;
+
+		for (uint16_t i = 0; i < n; i++)
+		{
+			if (buf[i] != pattern(seed, pos + i)) return false;
+		}
+	}
+
+	return true;
+}
+
+
+/** Open a directory of the root directory */
+static bool open_dir(const FAT16* fat, const char* name, FFILE* dir)
+{
+	ff_root(fat, dir);
+	return ff_find(dir, name) && ff_opendir(dir);
+}
+
+
+
+/** Check the volume, expecting no problems */
+static void check_clean(const FAT16* fat, FFCHECK* ck)
+{
+	CHECK(ff_check(fat, ck, false));
+	CHECK(ck->bad_chains == 0);
+	CHECK(ck->cross_linked == 0);
+	CHECK(ck->lost_clusters == 0);
+	CHECK(ck->size_mismatch == 0);
+	CHECK(ck->free_start == 0);
+}
+
+
+#define POP_DIRS 4
+#define POP_FILES 25
+
+static uint32_t pop_size(const uint16_t d, const uint16_t i)
+{
+	return (d * 7919 + i * 2111) % 20000;
+}
+
+
+/** Fill the volume with a few directories of files */
+static bool populate(const FAT16* fat)
+{
+	char name[16];
+
+	for (uint16_t d = 0; d < POP_DIRS; d++)
+	{
+		FFILE dir;
+		ff_root(fat, &dir);
+		sprintf(name, "DIR%u", d);
+		if (!ff_mkdir(&dir, name)) return false;
+
+		for (uint16_t i = 0; i < POP_FILES; i++)
+		{
+			sprintf(name, "F%02u.BIN", i);
+			if (!make_file(&dir, name, pop_size(d, i), d * 100 + i)) return false;
+		}
+	}
+
+	return true;
+}
+
+
+/** Verify what populate() wrote */
+static bool verify_population(const FAT16* fat)
+{
+	char name[16];
+
+	for (uint16_t d = 0; d < POP_DIRS; d++)
+	{
+		FFILE dir;
+		sprintf(name, "DIR%u", d);
+		if (!open_dir(fat, name, &dir)) return false;
+
+		for (uint16_t i = 0; i < POP_FILES; i++)
+		{
+			sprintf(name, "F%02u.BIN", i);
+			if (!verify_file(&dir, name, pop_size(d, i), d * 100 + i)) return false;
+		}
+	}
+
+	return true;
+}
+
+
+/**
+ * Make a chain of nested directories "SUB" in the directory,
+ * each with a few files. Returns the number of files.
+ */
+static uint32_t make_tree(const FFILE* dir, const uint8_t depth)
+{
+	FFILE d = *dir;
+	char name[16];
+	uint32_t files = 0;
+
+	for (uint8_t i = 0; i < depth; i++)
+	{
+		FFILE parent = d;
+		if (!ff_mkdir(&d, "SUB")) return files;
+
+		for (uint8_t j = 0; j < 5; j++)
+		{
+			sprintf(name, "T%u.BIN", j);
+			if (make_file(&parent, name, j * 1500, i)) files++;
+		}
+	}
+
+	return files;
+}
+
+
+
+// ------------- tests ----------------
+
+typedef struct
+{
+	uint32_t files;
+	uint32_t dirs;
+	uint32_t bytes;
+	uint32_t in_dirs; // files under /DIRn
+	uint32_t calls;
+	uint32_t stop_at; // abort after this many calls, 0 = never
+} WalkCount;
+
+
+static bool walk_count(const FFILE* file, const char* path, void* arg)
+{
+	WalkCount* wc = arg;
+
+	if (file->type == FT_SUBDIR)
+	{
+		__atomic_add_fetch(&wc->dirs, 1, __ATOMIC_RELAXED);
+	}
+	else
+	{
+		__atomic_add_fetch(&wc->files, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&wc->bytes, file->size, __ATOMIC_RELAXED);
+		if (strncmp(path, "/DIR", 4) == 0)
+			__atomic_add_fetch(&wc->in_dirs, 1, __ATOMIC_RELAXED);
+	}
+
+	const uint32_t calls = __atomic_add_fetch(&wc->calls, 1, __ATOMIC_RELAXED);
+	return wc->stop_at == 0 || calls < wc->stop_at;
+}
+
+
+/** Walk the tree, with one and with more threads */
+static void test_walk(void)
+{
+	ram_blank(8 << 20);
+
+	FAT16 fat;
+	CHECK(ff_init(&ram_dev, &fat));
+	CHECK(populate(&fat));
+
+	FFILE dir;
+	CHECK(open_dir(&fat, "DIR1", &dir));
+	const uint32_t tree_files = make_tree(&dir, 6);
+	CHECK(tree_files == 6 * 5);
+
+	uint32_t bytes = 6 * (0 + 1500 + 3000 + 4500 + 6000);
+	for (uint16_t d = 0; d < POP_DIRS; d++)
+	{
+		for (uint16_t i = 0; i < POP_FILES; i++)
+			bytes += pop_size(d, i);
+	}
+
+	for (uint8_t threads = 1; threads <= 4; threads += 3)
+	{
+		WalkCount wc = { 0 };
+		CHECK(ff_walk(&fat, &walk_count, &wc, threads));
+		CHECK(wc.dirs == POP_DIRS + 6);
+		CHECK(wc.files == POP_DIRS * POP_FILES + tree_files);
+		CHECK(wc.in_dirs == wc.files);
+		CHECK(wc.bytes == bytes);
+
+		// aborted by the callback
+		WalkCount stop = { .stop_at = 10 };
+		CHECK(!ff_walk(&fat, &walk_count, &stop, threads));
+	}
+
+	CHECK(verify_population(&fat));
+
+	// the same tree from an image file, through the positional-I/O backend
+	char path[] = "/var/tmp/fftestXXXXXX";
+	const int fd = mkstemp(path);
+	CHECK(fd >= 0);
+	if (fd < 0) return;
+
+	CHECK(write(fd, ram, ram_size) == (ssize_t) ram_size);
+	close(fd);
+
+	const BLOCKDEV* dev = pio_open(path);
+	CHECK(dev != NULL);
+	if (dev == NULL)
+	{
+		unlink(path);
+		return;
+	}
+
+	FAT16 pfat;
+	CHECK(ff_init(dev, &pfat));
+
+	WalkCount wc = { 0 };
+	CHECK(ff_walk(&pfat, &walk_count, &wc, 4));
+	CHECK(wc.files == POP_DIRS * POP_FILES + tree_files);
+	CHECK(wc.bytes == bytes);
+
+	// past the end of the image reads as zeros
+	uint8_t tail[64];
+	memset(tail, 0xAA, sizeof(tail));
+	dev->seek(ram_size - 32);
+	dev->load(tail, sizeof(tail));
+	CHECK(memcmp(tail, ram + ram_size - 32, 32) == 0);
+	CHECK(tail[32] == 0 && tail[63] == 0);
+	CHECK(!pio_failed_io());
+
+	pio_close();
+	unlink(path);
+}
+
+
+
+#if FF_USE_STATS
+
+/** The counters agree with the device, in total and per call */
+static void test_stats(void)
+{
+	ram_blank(8 << 20);
+
+	FAT16 fat;
+	CHECK(ff_init(&ram_dev, &fat));
+	CHECK(populate(&fat));
+
+	CHECK(ff_init(&ram_dev, &fat));
+	ff_reset_stats(&fat);
+	ram_count = (RamCount) { 0 };
+
+	CHECK(verify_population(&fat));
+
+	FFSTATS st;
+	ff_get_stats(&fat, FF_OP_NONE, &st);
+	CHECK(st.bytes_loaded == ram_count.loaded);
+	CHECK(st.bytes_stored == 0 && ram_count.stored == 0);
+	CHECK(st.seeks == ram_count.seeks);
+	CHECK(st.chain_steps > 0 && st.fat_reads > 0);
+
+	// every ff_read() of verify_file()
+	uint32_t reads = 0;
+	for (uint16_t d = 0; d < POP_DIRS; d++)
+	{
+		for (uint16_t i = 0; i < POP_FILES; i++)
+			reads += (pop_size(d, i) + 999) / 1000;
+	}
+
+	ff_get_stats(&fat, FF_OP_READ, &st);
+	CHECK(st.calls == reads);
+
+	// only the last call
+	FFILE f;
+	CHECK(open_dir(&fat, "DIR3", &f) && ff_find(&f, "F07.BIN"));
+
+	uint8_t buf[100];
+	ram_count = (RamCount) { 0 };
+	CHECK(ff_read(&f, buf, sizeof(buf)) == sizeof(buf));
+
+	CHECK(ff_get_last_stats(&fat, &st) == FF_OP_READ);
+	CHECK(st.bytes_loaded == ram_count.loaded);
+	CHECK(st.seeks == ram_count.seeks);
+	CHECK(st.fat_reads == 0);
+
+	// a write, in a new file
+	ff_reset_stats(&fat);
+	ram_count = (RamCount) { 0 };
+	CHECK(make_file(&f, "NEW.BIN", 5000, 1));
+
+	ff_get_stats(&fat, FF_OP_NONE, &st);
+	CHECK(st.bytes_stored == ram_count.stored);
+	CHECK(st.bytes_stored >= 5000);
+
+	ff_get_stats(&fat, FF_OP_NEWFILE, &st);
+	CHECK(st.calls == 1);
+}
+
+#endif
+
+
+static uint8_t* trace_out;
+static uint32_t trace_len;
+
+static void trace_sink(const void* data, const uint16_t len)
+{
+	trace_out = realloc(trace_out, trace_len + len);
+	memcpy(trace_out + trace_len, data, len);
+	trace_len += len;
+}
+
+
+static uint32_t trace_varint(uint32_t* pos)
+{
+	uint32_t v = 0;
+	uint8_t b;
+
+	for (uint8_t shift = 0; shift < 35; shift += 7)
+	{
+		b = trace_out[(*pos)++];
+		v |= (uint32_t) (b & 0x7F) << shift;
+		if (!(b & 0x80)) break;
+	}
+
+	return v;
+}
+
+
+static int32_t trace_zigzag(uint32_t* pos)
+{
+	const uint32_t v = trace_varint(pos);
+	return (int32_t) (v >> 1) ^ -(int32_t) (v & 1);
+}
+
+
+/** Replay the recorded trace on the RAM device. Returns false if it's malformed. */
+static bool trace_replay(void)
+{
+	static uint8_t buf[65536];
+
+	if (trace_len < 6 || memcmp(trace_out, "FFTR", 4) != 0) return false;
+	if (trace_out[4] != TRACE_VERSION || !(trace_out[5] & TRACE_DATA)) return false;
+
+	uint32_t pos = 6;
+	uint32_t cur = 0; // seeks are relative to the cursor
+	int32_t offset;
+	uint32_t len;
+
+	while (pos < trace_len)
+	{
+		switch (trace_out[pos++])
+		{
+			case 's':
+				cur += trace_zigzag(&pos);
+				ram_dev.seek(cur);
+				break;
+
+			case 'r':
+				offset = trace_zigzag(&pos);
+				cur += offset;
+				ram_dev.rseek(offset);
+				break;
+
+			case 'l':
+				len = trace_varint(&pos);
+				ram_dev.load(buf, len);
+				cur += len;
+				break;
+
+			case 't':
+				len = trace_varint(&pos);
+				ram_dev.store(trace_out + pos, len);
+				pos += len;
+				cur += len;
+				break;
+
+			case 'g':
+				ram_dev.read();
+				cur++;
+				break;
+
+			case 'p':
+				ram_dev.write(trace_out[pos++]);
+				cur++;
+				break;
+
+			case 'f':
+				ram_dev.flush();
+				break;
+
+			case 'd':
+				trace_varint(&pos);
+				trace_varint(&pos);
+				break;
+
+			default:
+				return false;
+		}
+	}
+
+	return pos == trace_len;
+}
+
+
+/** Trace a workload, and replay it from the same image */
+static void test_trace(void)
+{
+	ram_blank(8 << 20);
+
+	uint8_t* start = malloc(ram_size);
+	memcpy(start, ram, ram_size);
+
+	trace_len = 0;
+	const BLOCKDEV* dev = trace_wrap(&ram_dev, &trace_sink, TRACE_DATA);
+
+	ram_count = (RamCount) { 0 };
+
+	FAT16 fat;
+	CHECK(ff_init(dev, &fat));
+	CHECK(populate(&fat));
+	CHECK(verify_population(&fat));
+	trace_flush();
+
+	const RamCount traced = ram_count;
+	CHECK(trace_len > traced.stored); // with the data
+
+	uint8_t* end = malloc(ram_size);
+	memcpy(end, ram, ram_size);
+
+	// the same calls, the same result
+	memcpy(ram, start, ram_size);
+	ram_count = (RamCount) { 0 };
+	CHECK(trace_replay());
+
+	CHECK(memcmp(&ram_count, &traced, sizeof(RamCount)) == 0);
+	CHECK(memcmp(ram, end, ram_size) == 0);
+
+	free(start);
+	free(end);
+	free(trace_out);
+	trace_out = NULL;
+}
+
+
+/** Format a volume, fill it, remount and check it */
+static void test_format(void)
+{
+	ram_new(8 << 20);
+
+	const FFORMAT opts = { .label = "TESTVOL" };
+	CHECK(ff_format(&ram_dev, ram_size, &opts));
+
+	FAT16 fat;
+	CHECK(ff_init(&ram_dev, &fat));
+
+	char label[12];
+	CHECK(strcmp(ff_disk_label(&fat, label), "TESTVOL") == 0);
+	CHECK(ram_free(&fat) == ram_clusters(&fat));
+
+	FFCHECK ck;
+	check_clean(&fat, &ck);
+	CHECK(ck.files == 0 && ck.dirs == 0);
+
+	CHECK(populate(&fat));
+
+	// remount, nothing may be left in the handle only
+	CHECK(ff_init(&ram_dev, &fat));
+	CHECK(verify_population(&fat));
+
+	check_clean(&fat, &ck);
+	CHECK(ck.dirs == POP_DIRS);
+	CHECK(ck.files == POP_DIRS * POP_FILES);
+
+	// FAT16 needs at least 4085 clusters, also with a given cluster size
+	const FFORMAT big_clusters = { .sectors_per_cluster = 8, .fat_type = 16 };
+	CHECK(!ff_format(&ram_dev, ram_size, &big_clusters));
+
+	const FFORMAT small_clusters = { .sectors_per_cluster = 2, .fat_type = 16 };
+	CHECK(ff_format(&ram_dev, ram_size, &small_clusters));
+
+	ram_new(1 << 20);
+	CHECK(!ff_format(&ram_dev, ram_size, NULL));
+}
+
+
+/** Fragment a file by filling holes, and defragment the volume */
+static void test_defrag(void)
+{
+	ram_blank(8 << 20);
+
+	FAT16 fat;
+	CHECK(ff_init(&ram_dev, &fat));
+
+	FFILE dir;
+	ff_root(&fat, &dir);
+	CHECK(ff_mkdir(&dir, "FILL"));
+	CHECK(open_dir(&fat, "FILL", &dir));
+
+	// the volume full of 16 KiB files, every other one deleted
+	char name[16];
+	uint16_t files = 0;
+	while (files < 1000)
+	{
+		sprintf(name, "F%03u.BIN", files);
+		if (!make_file(&dir, name, 16384, files)) break;
+		files++;
+	}
+
+	CHECK(files > 100);
+
+	for (uint16_t i = 0; i < files; i += 2)
+	{
+		FFILE f = dir;
+		sprintf(name, "F%03u.BIN", i);
+		CHECK(ff_find(&f, name) && ff_rmfile(&f));
+	}
+
+	// a file through the holes
+	FFILE root;
+	ff_root(&fat, &root);
+	CHECK(make_file(&root, "FRAG.BIN", 200000, 7));
+
+	FFILE frag = root;
+	CHECK(ff_find(&frag, "FRAG.BIN"));
+
+	uint32_t pieces;
+	ram_chain(&fat, frag.clu_start, &pieces);
+	CHECK(pieces > 5);
+
+	// room for it in one piece
+	FFILE fill = root;
+	CHECK(ff_find(&fill, "FILL") && ff_delete(&fill));
+
+	CHECK(ff_defrag(&fat, 0) >= 1);
+
+	frag = root;
+	CHECK(ff_find(&frag, "FRAG.BIN"));
+	ram_chain(&fat, frag.clu_start, &pieces);
+	CHECK(pieces == 1);
+
+	CHECK(ff_init(&ram_dev, &fat));
+	ff_root(&fat, &root);
+	CHECK(verify_file(&root, "FRAG.BIN", 200000, 7));
+
+	FFCHECK ck;
+	check_clean(&fat, &ck);
+	CHECK(ck.files == 1);
+
+	// nothing left to do
+	CHECK(ff_defrag(&fat, 0) == 0);
+}
+
+
+/** Delete most files of a directory, and compact it */
+static void test_compact(void)
+{
+	ram_blank(8 << 20);
+
+	FAT16 fat;
+	CHECK(ff_init(&ram_dev, &fat));
+
+	FFILE dir;
+	ff_root(&fat, &dir);
+	CHECK(ff_mkdir(&dir, "MANY"));
+	CHECK(open_dir(&fat, "MANY", &dir));
+
+	char name[16];
+	for (uint16_t i = 0; i < 200; i++)
+	{
+		sprintf(name, "M%03u.TXT", i);
+		CHECK(make_file(&dir, name, i * 37, i));
+	}
+
+	FFILE many;
+	ff_root(&fat, &many);
+	CHECK(ff_find(&many, "MANY"));
+
+	uint32_t pieces;
+	const uint32_t before = ram_chain(&fat, many.clu_start, &pieces);
+
+	for (uint16_t i = 0; i < 200; i++)
+	{
+		if (i % 10 == 0) continue;
+
+		FFILE f = dir;
+		sprintf(name, "M%03u.TXT", i);
+		CHECK(ff_find(&f, name) && ff_rmfile(&f));
+	}
+
+	CHECK(ff_compact_dir(&dir) == 180);
+	CHECK(ram_chain(&fat, many.clu_start, &pieces) < before);
+
+	CHECK(ff_init(&ram_dev, &fat));
+	CHECK(open_dir(&fat, "MANY", &dir));
+
+	for (uint16_t i = 0; i < 200; i += 10)
+	{
+		sprintf(name, "M%03u.TXT", i);
+		CHECK(verify_file(&dir, name, i * 37, i));
+	}
+
+	CHECK(!ff_find(&dir, "M001.TXT"));
+
+	FFCHECK ck;
+	check_clean(&fat, &ck);
+	CHECK(ck.files == 20);
+
+	// nothing to reclaim now
+	CHECK(ff_compact_dir(&dir) == 0);
+}
+
+
+/** Long names, more of them than the lookup index holds */
+static void test_lfn(void)
+{
+	ram_blank(8 << 20);
+
+	FAT16 fat;
+	CHECK(ff_init(&ram_dev, &fat));
+
+	FFILE dir;
+	ff_root(&fat, &dir);
+	CHECK(ff_mkdir(&dir, "LONG"));
+	CHECK(open_dir(&fat, "LONG", &dir));
+
+	const uint16_t count = FF_LFN_INDEX + 36;
+	char name[FF_LFN_MAX + 1];
+
+	for (uint16_t i = 0; i < count; i++)
+	{
+		sprintf(name, "Long file name number %03u.txt", i);
+		CHECK(make_file(&dir, name, i, i));
+	}
+
+	CHECK(ff_init(&ram_dev, &fat));
+	CHECK(open_dir(&fat, "LONG", &dir));
+
+	for (uint16_t i = count; i-- > 0;)
+	{
+		sprintf(name, "Long file name number %03u.txt", i);
+		CHECK(verify_file(&dir, name, i, i));
+	}
+
+	// any case, and the long name read back
+	FFILE f = dir;
+	CHECK(ff_find(&f, "LONG FILE NAME NUMBER 007.TXT"));
+
+	char back[FF_LFN_MAX + 1];
+	CHECK(strcmp(ff_longname(&f, back, sizeof(back)), "Long file name number 007.txt") == 0);
+
+	f = dir;
+	sprintf(name, "Long file name number %03u.txt", count);
+	CHECK(!ff_find(&f, name));
+
+#if FF_LFN_INDEX > 0
+	// misses read only the names past the full index
+	CHECK(ff_init(&ram_dev, &fat));
+	CHECK(open_dir(&fat, "LONG", &dir));
+
+	ram_count = (RamCount) { 0 };
+	f = dir;
+	CHECK(!ff_find(&f, name));
+	const uint32_t scan = ram_count.loads;
+
+	ram_count = (RamCount) { 0 };
+	f = dir;
+	CHECK(!ff_find(&f, name));
+	CHECK(ram_count.loads * 2 < scan);
+#endif
+
+	// lower case 8.3 names: upper case on disk, with the case bits
+	static const struct
+	{
+		const char* name;
+		const char* raw;
+		uint8_t lcase; // byte 12
+	}
+	short_names[] = {
+		{ "readme.txt", "README  TXT", 0x18 },
+		{ "NOTES.md", "NOTES   MD ", 0x10 },
+		{ "build.SH", "BUILD   SH ", 0x08 },
+		{ "Makefile", "MAKEFI~1   ", 0x00 }, // mixed case - long name
+	};
+
+	for (uint8_t i = 0; i < 4; i++)
+	{
+		f = dir;
+		CHECK(ff_newfile(&f, short_names[i].name));
+		CHECK(memcmp(f.name, short_names[i].raw, 11) == 0);
+
+		const uint16_t per_clu = fat.bs.bytes_per_cluster / 32;
+		const uint8_t* ent = ram + fat.data_addr + (f.ent_clu - 2) * fat.bs.bytes_per_cluster + (f.num % per_clu) * 32;
+		CHECK(ent[12] == short_names[i].lcase);
+		CHECK(strcmp(ff_longname(&f, back, sizeof(back)), short_names[i].name) == 0);
+	}
+
+	f = dir;
+	CHECK(ff_find(&f, "README.TXT"));
+	CHECK(strcmp(ff_longname(&f, back, sizeof(back)), "readme.txt") == 0);
+	CHECK(!ff_newfile(&f, "ReadMe.txt"));
+
+	const char* const again[] = { "NOTES.MD", "Build.sh" };
+	f = dir;
+	CHECK(ff_newfiles(&f, again, 2, NULL) == 0);
+
+	f = dir;
+	CHECK(ff_find(&f, "README.TXT"));
+
+	CHECK(ff_rename(&f, NULL, "README.txt"));
+	CHECK(strcmp(ff_longname(&f, back, sizeof(back)), "README.txt") == 0);
+
+	FFCHECK ck;
+	check_clean(&fat, &ck);
+	CHECK(ck.files == count + 4);
+}
+
+
+/** Create files in a batch, with the directory handle on a free slot */
+static void test_newfiles(void)
+{
+	ram_blank(8 << 20);
+
+	FAT16 fat;
+	CHECK(ff_init(&ram_dev, &fat));
+
+	static const char* const names[] = {
+		"A.TXT", "B.TXT", "C.TXT", "B.TXT", "A long file name.txt", "D.TXT",
+	};
+	const uint16_t n = sizeof(names) / sizeof(names[0]);
+	FSAVEPOS pos[sizeof(names) / sizeof(names[0])];
+
+	FFILE dir;
+
+	// the cursor of a free slot is not set up, make it a stale one
+	memset(&dir, 0x5A, sizeof(dir));
+
+	ff_root(&fat, &dir); // blank volume - the first free slot
+	CHECK(dir.type == FT_NONE);
+
+	CHECK(ff_newfiles(&dir, names, n, pos) == n - 1);
+
+	// the handle is back at the slot, now the first new file
+	CHECK(dir.num == 0 && dir.type == FT_FILE);
+	CHECK(dir.size == 0);
+	CHECK(pos[3].num == 0xFFFF); // duplicate
+
+	// no clusters may have been allocated into the files
+	FFCHECK ck;
+	check_clean(&fat, &ck);
+	CHECK(ck.files == n - 1);
+
+	// again, with all names taken
+	ff_root(&fat, &dir);
+	CHECK(ff_newfiles(&dir, names, n, NULL) == 0);
+	check_clean(&fat, &ck);
+
+	FFILE f = dir;
+	ff_reopen(&f, &pos[4]);
+	CHECK(f.type == FT_FILE && f.size == 0);
+}
+
+
+/** Long name entries in the root directory, not deleted */
+static uint16_t root_lfn_entries(const FAT16* fat)
+{
+	uint16_t count = 0;
+
+	for (uint16_t i = 0; i < fat->bs.root_entries; i++)
+	{
+		const uint8_t* ent = ram + fat->rd_addr + i * 32;
+		if (ent[0] == 0x00) break;
+		if (ent[11] == 0x0F && ent[0] != 0xE5) count++;
+	}
+
+	return count;
+}
+
+
+/** Nothing is created on a full disk, and no slots are left taken */
+static void test_full(void)
+{
+	ram_blank(8 << 20);
+
+	FAT16 fat;
+	CHECK(ff_init(&ram_dev, &fat));
+
+	FFILE dir;
+	ff_root(&fat, &dir);
+
+	FFILE fill = dir;
+	CHECK(ff_newfile(&fill, "FILL.BIN"));
+
+	uint8_t buf[2048] = { 0 };
+	while (ff_write(&fill, buf, sizeof(buf)));
+	while (ff_write(&fill, buf, 1));
+	ff_flush_file(&fill);
+	CHECK(ram_free(&fat) == 0);
+
+	FFILE f = dir;
+	CHECK(!ff_newfile(&f, "X.TXT"));
+	CHECK(!ff_newfile(&f, "A long name on a full disk.txt"));
+	CHECK(!ff_mkdir(&f, "SUBDIR"));
+	CHECK(!ff_mkdir(&f, "A long directory name"));
+	CHECK(f.clu == dir.clu && f.num == dir.num); // left where it was
+
+	static const char* const names[] = { "A.TXT", "Another long name.txt", "C.TXT" };
+	FSAVEPOS pos[3];
+	CHECK(ff_newfiles(&dir, names, 3, pos) == 0);
+	CHECK(pos[0].num == 0xFFFF && pos[1].num == 0xFFFF);
+
+	FFCHECK ck;
+	check_clean(&fat, &ck);
+	CHECK(ck.files == 1);
+	CHECK(root_lfn_entries(&fat) == 0);
+
+	// room for one file - the batch stops after it
+	ff_root(&fat, &f);
+	CHECK(ff_find(&f, "FILL.BIN"));
+	CHECK(ff_seek(&f, fill.size - fat.bs.bytes_per_cluster));
+	f.size = f.cur_rel;
+	ff_flush_file(&f);
+	CHECK(ram_free(&fat) == 1);
+
+	ff_root(&fat, &dir);
+	CHECK(ff_newfiles(&dir, names + 1, 2, pos) == 1);
+	CHECK(pos[0].num != 0xFFFF && pos[1].num == 0xFFFF);
+
+	check_clean(&fat, &ck);
+	CHECK(ck.files == 2);
+	CHECK(root_lfn_entries(&fat) == 2);
+	CHECK(verify_file(&dir, "Another long name.txt", 0, 0));
+}
+
+
+/** Open files by path, with the entry cache kept up to date */
+static void test_open_path(void)
+{
+	ram_blank(8 << 20);
+
+	FAT16 fat;
+	CHECK(ff_init(&ram_dev, &fat));
+	CHECK(populate(&fat));
+
+	FFILE f, dir;
+	CHECK(ff_open_path(&fat, "DIR2/F05.BIN", &f) && f.size == pop_size(2, 5));
+	CHECK(ff_open_path(&fat, "DIR2/F05.BIN", &f) && f.size == pop_size(2, 5));
+	CHECK(ff_open_path(&fat, "DIR3\\F24.BIN", &f) && f.size == pop_size(3, 24));
+
+	// not found, and then created
+	CHECK(!ff_open_path(&fat, "DIR2/NEW.BIN", &f));
+	CHECK(!ff_open_path(&fat, "DIR2/NEW.BIN", &f));
+	CHECK(!ff_open_path(&fat, "DIR9/F05.BIN", &f));
+
+	CHECK(open_dir(&fat, "DIR2", &dir));
+	CHECK(make_file(&dir, "NEW.BIN", 100, 1));
+	CHECK(ff_open_path(&fat, "DIR2/NEW.BIN", &f) && f.size == 100);
+
+	// deleted, also with the directory
+	CHECK(ff_rmfile(&f));
+	CHECK(!ff_open_path(&fat, "DIR2/NEW.BIN", &f));
+
+	// names with the same hash and length: a miss doesn't hide the other
+	CHECK(make_file(&dir, "ZVMHIA", 200, 2));
+	CHECK(!ff_open_path(&fat, "DIR2/EJDAPA", &f));
+	CHECK(ff_open_path(&fat, "DIR2/ZVMHIA", &f) && f.size == 200);
+	CHECK(!ff_open_path(&fat, "DIR2/EJDAPA", &f));
+
+	ff_root(&fat, &dir);
+	CHECK(ff_find(&dir, "DIR1") && ff_delete(&dir));
+	CHECK(!ff_open_path(&fat, "DIR1/F03.BIN", &f));
+	CHECK(ff_open_path(&fat, "DIR0/F03.BIN", &f) && f.size == pop_size(0, 3));
+}
+
+
+#if FF_MAX_DIRTY > 0
+
+/** Sync many written files at once, trimming clusters past their ends */
+static void test_sync(void)
+{
+	ram_blank(8 << 20);
+
+	FAT16 fat;
+	CHECK(ff_init(&ram_dev, &fat));
+
+	const uint32_t free_before = ram_free(&fat);
+
+	FFILE dir;
+	ff_root(&fat, &dir);
+
+	FFILE files[FF_MAX_DIRTY];
+	char name[16];
+
+	for (uint16_t i = 0; i < FF_MAX_DIRTY; i++)
+	{
+		files[i] = dir;
+		sprintf(name, "S%02u.LOG", i);
+		CHECK(ff_newfile(&files[i], name));
+	}
+
+	// seeking past the end allocates, the chains grow interleaved
+	for (uint32_t pos = 4096; pos <= 32768; pos += 4096)
+	{
+		for (uint16_t i = 0; i < FF_MAX_DIRTY; i++)
+			CHECK(ff_seek(&files[i], pos));
+	}
+
+	for (uint16_t i = 0; i < FF_MAX_DIRTY; i++)
+	{
+		CHECK(ff_seek(&files[i], 0));
+		CHECK(ff_write(&files[i], "log line\n", 9));
+	}
+
+	ram_count = (RamCount) { 0 };
+	CHECK(ff_sync_all(&fat) == FF_MAX_DIRTY);
+	CHECK(ram_count.flushes == 1);
+
+	// one cluster is left of each
+	CHECK(ram_free(&fat) == free_before - FF_MAX_DIRTY);
+
+	CHECK(ff_init(&ram_dev, &fat));
+
+	FFCHECK ck;
+	check_clean(&fat, &ck);
+	CHECK(ck.files == FF_MAX_DIRTY);
+
+	ff_root(&fat, &dir);
+	CHECK(ff_find(&dir, "S07.LOG") && dir.size == 9);
+}
+
+#endif
+
+
+/** Writes across the end of files that fill their last cluster */
+static void test_eof(void)
+{
+	ram_new(8 << 20);
+	const FFORMAT opts = { .sectors_per_cluster = 1 };
+	CHECK(ff_format(&ram_dev, ram_size, &opts));
+
+	FAT16 fat;
+	CHECK(ff_init(&ram_dev, &fat));
+
+	FFILE dir;
+	ff_root(&fat, &dir);
+	CHECK(make_file(&dir, "A.BIN", 512, 1));
+	CHECK(make_file(&dir, "B.BIN", 1024, 2));
+	CHECK(make_file(&dir, "C.BIN", 100, 3));
+
+	// from the last byte into the next cluster
+	FFILE a = dir;
+	CHECK(ff_find(&a, "A.BIN"));
+	CHECK(ff_seek(&a, 511));
+	CHECK(ff_write(&a, "YZ", 2));
+
+	// from EOF, where the cursor stays in the last cluster
+	FFILE b = dir;
+	CHECK(ff_find(&b, "B.BIN"));
+	CHECK(ff_seek(&b, 1024));
+	CHECK(ff_write(&b, "YZ", 2));
+
+#if FF_MAX_DIRTY > 0
+	CHECK(ff_sync_all(&fat) == 2);
+#else
+	ff_flush_file(&a);
+	ff_flush_file(&b);
+#endif
+
+	CHECK(ff_init(&ram_dev, &fat));
+
+	FFCHECK ck;
+	check_clean(&fat, &ck);
+	CHECK(ck.files == 3);
+
+	ff_root(&fat, &dir);
+	CHECK(verify_file(&dir, "C.BIN", 100, 3));
+
+	char buf[3];
+	a = dir;
+	CHECK(ff_find(&a, "A.BIN") && a.size == 513);
+	CHECK(ff_seek(&a, 510) && ff_read(&a, buf, 3) == 3);
+	CHECK(buf[0] == (char) pattern(1, 510) && buf[1] == 'Y' && buf[2] == 'Z');
+
+	b = dir;
+	CHECK(ff_find(&b, "B.BIN") && b.size == 1026);
+	CHECK(ff_seek(&b, 1023) && ff_read(&b, buf, 3) == 3);
+	CHECK(buf[0] == (char) pattern(2, 1023) && buf[1] == 'Y' && buf[2] == 'Z');
+}
+
+
+#if FF_USE_JOURNAL
+
+#define TX_FILES 20
+
+/** One transaction creating TX_FILES files. Returns false on power loss. */
+static bool tx_files(const int crash_at)
+{
+	FAT16 fat;
+	CHECK(ff_init(&ram_dev, &fat));
+
+	ram_count.flushes = 0;
+	ram_crash_at = crash_at;
+
+	if (setjmp(ram_crash) != 0)
+	{
+		ram_crash_at = -1;
+		return false;
+	}
+
+	CHECK(ff_tx_begin(&fat));
+
+	FFILE dir;
+	ff_root(&fat, &dir);
+
+	char name[16];
+	for (uint16_t i = 0; i < TX_FILES; i++)
+	{
+		sprintf(name, "TX%02u.DAT", i);
+		CHECK(make_file(&dir, name, i * 731 + 1, i));
+	}
+
+	CHECK(ff_tx_commit(&fat));
+
+	ram_crash_at = -1;
+	return true;
+}
+
+
+/** Count the files of tx_files() on the volume, and verify them */
+static uint16_t tx_count(const FAT16* fat)
+{
+	FFILE dir;
+	ff_root(fat, &dir);
+
+	uint16_t count = 0;
+	char name[16];
+	for (uint16_t i = 0; i < TX_FILES; i++)
+	{
+		sprintf(name, "TX%02u.DAT", i);
+		if (verify_file(&dir, name, i * 731 + 1, i)) count++;
+	}
+
+	return count;
+}
+
+
+/** Cut the power at every flush of a transaction, and replay the journal */
+static void test_journal(void)
+{
+	ram_blank(16 << 20);
+
+	FAT16 fat;
+	CHECK(ff_init(&ram_dev, &fat));
+	CHECK(ff_journal_create(&fat));
+
+	uint8_t* base = malloc(ram_size);
+	memcpy(base, ram, ram_size);
+
+	// without a crash, to count the flushes
+	CHECK(tx_files(-1));
+	const int total = ram_count.flushes;
+
+	CHECK(ff_init(&ram_dev, &fat));
+	CHECK(tx_count(&fat) == TX_FILES);
+
+	for (int crash_at = 1; crash_at <= total; crash_at++)
+	{
+		memcpy(ram, base, ram_size);
+		tx_files(crash_at);
+
+		// mounting replays the journal
+		CHECK(ff_init(&ram_dev, &fat));
+
+		FFCHECK ck;
+		check_clean(&fat, &ck);
+
+		// all of it, or nothing
+		const uint16_t count = tx_count(&fat);
+		CHECK(count == 0 || count == TX_FILES);
+	}
+
+	free(base);
+}
+
+#endif
+
+
+/** Make a directory "BIG" in root with a deep tree, and open its entry */
+static void make_big(const FAT16* fat, FFILE* big)
+{
+	ff_root(fat, big);
+	CHECK(ff_mkdir(big, "BIG"));
+	CHECK(make_tree(big, FF_JOB_DEPTH + 4) == (FF_JOB_DEPTH + 4) * 5);
+
+	ff_root(fat, big);
+	CHECK(ff_find(big, "BIG"));
+}
+
+
+/** Delete a directory tree, at once and in steps */
+static void test_delete(void)
+{
+	ram_blank(8 << 20);
+
+	FAT16 fat;
+	CHECK(ff_init(&ram_dev, &fat));
+	CHECK(populate(&fat));
+
+	const uint32_t free_before = ram_free(&fat);
+
+	FFILE big;
+	FFCHECK ck;
+
+	// at once
+	make_big(&fat, &big);
+	CHECK(ff_delete(&big));
+
+	CHECK(ram_free(&fat) == free_before);
+	check_clean(&fat, &ck);
+
+	// in small steps
+	make_big(&fat, &big);
+
+	FFJOB job;
+	CHECK(ff_job_delete(&job, &big));
+
+	ff_root(&fat, &big);
+	CHECK(!ff_find(&big, "BIG")); // gone right away
+
+	uint32_t steps = 0;
+	while (ff_step(&job, 5)) steps++;
+	CHECK(steps > 10);
+
+	CHECK(ram_free(&fat) == free_before);
+	check_clean(&fat, &ck);
+
+	// interrupted, only lost clusters are left
+	make_big(&fat, &big);
+	CHECK(ff_job_delete(&job, &big));
+	for (uint8_t i = 0; i < 10; i++) ff_step(&job, 5);
+
+	CHECK(ff_init(&ram_dev, &fat));
+	CHECK(!ff_check(&fat, &ck, false));
+	CHECK(ck.lost_clusters > 0);
+	CHECK(ck.bad_chains == 0 && ck.cross_linked == 0 && ck.size_mismatch == 0);
+
+	CHECK(ff_check(&fat, &ck, true));
+	check_clean(&fat, &ck);
+
+	CHECK(ram_free(&fat) == free_before);
+	CHECK(verify_population(&fat));
+}
+
+
+/** Rename files and directories, and move them to other directories */
+static void test_rename(void)
+{
+	ram_blank(8 << 20);
+
+	FAT16 fat;
+	CHECK(ff_init(&ram_dev, &fat));
+	CHECK(populate(&fat));
+
+	FFILE f, dir, dir0;
+	CHECK(open_dir(&fat, "DIR1", &f));
+	CHECK(open_dir(&fat, "DIR2", &dir));
+
+	// in place, to a long name
+	CHECK(ff_find(&f, "F02.BIN"));
+	CHECK(ff_rename(&f, NULL, "Second file.bin"));
+
+	// to another directory, with a new name
+	CHECK(open_dir(&fat, "DIR1", &f) && ff_find(&f, "F03.BIN"));
+	CHECK(ff_rename(&f, &dir, "MOVED.BIN"));
+	CHECK(verify_file(&dir, "MOVED.BIN", pop_size(1, 3), 103));
+
+	// the name is taken
+	CHECK(open_dir(&fat, "DIR1", &f) && ff_find(&f, "F04.BIN"));
+	CHECK(!ff_rename(&f, &dir, "F04.BIN"));
+
+	// a directory into another one, its ".." must follow
+	CHECK(open_dir(&fat, "DIR0", &dir0));
+	ff_root(&fat, &f);
+	CHECK(ff_find(&f, "DIR3"));
+	CHECK(ff_rename(&f, &dir0, "SUB3"));
+
+	ff_root(&fat, &f);
+	CHECK(!ff_find(&f, "DIR3"));
+
+	CHECK(open_dir(&fat, "DIR0", &f) && ff_find(&f, "SUB3") && ff_opendir(&f));
+	CHECK(verify_file(&f, "F05.BIN", pop_size(3, 5), 305));
+	CHECK(ff_parent(&f));
+	CHECK(verify_file(&f, "F05.BIN", pop_size(0, 5), 5));
+
+	// not into itself
+	FFILE sub3;
+	CHECK(open_dir(&fat, "DIR0", &sub3) && ff_find(&sub3, "SUB3") && ff_opendir(&sub3));
+	ff_root(&fat, &f);
+	CHECK(ff_find(&f, "DIR0"));
+	CHECK(!ff_rename(&f, &sub3, "LOOP"));
+
+	CHECK(ff_init(&ram_dev, &fat));
+	CHECK(open_dir(&fat, "DIR1", &f));
+	CHECK(verify_file(&f, "Second file.bin", pop_size(1, 2), 102));
+	CHECK(!ff_find(&f, "F02.BIN") && !ff_find(&f, "F03.BIN"));
+
+	FFCHECK ck;
+	check_clean(&fat, &ck);
+	CHECK(ck.dirs == POP_DIRS);
+	CHECK(ck.files == POP_DIRS * POP_FILES);
+}
+
+
+/** Format a volume into the image at sector "at", as a scratch image would have it */
+static uint32_t format_part(uint8_t* image, const uint32_t at, const char* label)
+{
+	uint8_t* const keep = ram;
+	const uint32_t keep_size = ram_size;
+
+	ram = NULL;
+	ram_new(8 << 20);
+
+	const FFORMAT opts = { .label = label };
+	CHECK(ff_format(&ram_dev, ram_size, &opts));
+
+	FFPART part;
+	CHECK(ff_list_partitions(&ram_dev, &part, 1) == 1);
+	memcpy(image + at * 512, ram + part.start * 512, part.sectors * 512);
+
+	free(ram);
+	ram = keep;
+	ram_size = keep_size;
+
+	return part.sectors;
+}
+
+
+/** Fill in a partition table entry */
+static void put_part(uint8_t* table, const uint8_t type, const uint32_t start, const uint32_t sectors)
+{
+	table[4] = type;
+	put32(table + 8, start);
+	put32(table + 12, sectors);
+}
+
+
+/** A primary partition and two logical ones in an extended partition */
+static void test_partitions(void)
+{
+	ram_new(32 << 20);
+
+	const uint32_t ext = 20480;       // extended partition start
+	const uint32_t ebr2 = 20480 * 2;  // second EBR
+
+	const uint32_t len0 = format_part(ram, 2048, "PRIMARY");
+	const uint32_t len4 = format_part(ram, ext + 2048, "LOGICAL1");
+	const uint32_t len5 = format_part(ram, ebr2 + 2048, "LOGICAL2");
+
+	put_part(ram + 0x1BE, 6, 2048, len0);
+	put_part(ram + 0x1CE, 5, ext, ram_size / 512 - ext);
+	put16(ram + 510, 0xAA55);
+
+	// EBRs: the logical partition relative to the EBR, the next EBR to the extended partition
+	put_part(ram + ext * 512 + 0x1BE, 6, 2048, len4);
+	put_part(ram + ext * 512 + 0x1CE, 5, ebr2 - ext, 2048 + len5);
+	put16(ram + ext * 512 + 510, 0xAA55);
+
+	put_part(ram + ebr2 * 512 + 0x1BE, 6, 2048, len5);
+	put16(ram + ebr2 * 512 + 510, 0xAA55);
+
+	FFPART parts[8];
+	CHECK(ff_list_partitions(&ram_dev, parts, 8) == 3);
+	CHECK(parts[0].index == 0 && parts[0].start == 2048 && parts[0].sectors == len0);
+	CHECK(parts[1].index == 4 && parts[1].start == ext + 2048 && parts[1].sectors == len4);
+	CHECK(parts[2].index == 5 && parts[2].start == ebr2 + 2048 && parts[2].sectors == len5);
+
+	static const char* const labels[] = { "PRIMARY", "LOGICAL1", "LOGICAL2" };
+
+	FAT16 fat;
+	FFILE root;
+	char label[12];
+
+	// ff_init() takes the first one
+	CHECK(ff_init(&ram_dev, &fat));
+	CHECK(strcmp(ff_disk_label(&fat, label), "PRIMARY") == 0);
+
+	for (uint8_t i = 0; i < 3; i++)
+	{
+		CHECK(ff_init_part(&ram_dev, &fat, parts[i].index));
+		CHECK(strcmp(ff_disk_label(&fat, label), labels[i]) == 0);
+
+		ff_root(&fat, &root);
+		CHECK(make_file(&root, labels[i], 30000 + i, i));
+	}
+
+	for (uint8_t i = 0; i < 3; i++)
+	{
+		CHECK(ff_init_part(&ram_dev, &fat, parts[i].index));
+
+		ff_root(&fat, &root);
+		CHECK(verify_file(&root, labels[i], 30000 + i, i));
+
+		FFCHECK ck;
+		check_clean(&fat, &ck);
+		CHECK(ck.files == 1);
+	}
+
+	CHECK(!ff_init_part(&ram_dev, &fat, 1));
+	CHECK(!ff_init_part(&ram_dev, &fat, 6));
+}
+
+
+/** A volume with 4 KiB sectors */
+static void test_sectors(void)
+{
+	ram_new(32 << 20);
+
+	const FFORMAT opts = { .bytes_per_sector = 4096, .label = "BIGSECT" };
+	CHECK(ff_format(&ram_dev, ram_size, &opts));
+
+	FAT16 fat;
+	CHECK(ff_init(&ram_dev, &fat));
+	CHECK(fat.bs.bytes_per_sector == 4096);
+	CHECK(fat.fat_addr % 4096 == 0 && fat.rd_addr % 4096 == 0 && fat.data_addr % 4096 == 0);
+
+	char label[12];
+	CHECK(strcmp(ff_disk_label(&fat, label), "BIGSECT") == 0);
+
+	CHECK(populate(&fat));
+
+	CHECK(ff_init(&ram_dev, &fat));
+	CHECK(verify_population(&fat));
+
+	FFCHECK ck;
+	check_clean(&fat, &ck);
+	CHECK(ck.files == POP_DIRS * POP_FILES);
+
+	// a sector size the FAT type can't use
+	const FFORMAT odd = { .bytes_per_sector = 768 };
+	CHECK(!ff_format(&ram_dev, ram_size, &odd));
+}
+
+
+/** Contiguous clusters are read in one device access, also with O_DIRECT */
+static void test_runs(void)
+{
+	ram_blank(8 << 20);
+
+	FAT16 fat;
+	CHECK(ff_init(&ram_dev, &fat));
+
+	FFILE root;
+	ff_root(&fat, &root);
+	CHECK(make_file(&root, "RUN.BIN", 60000, 3));
+
+	FFILE f = root;
+	CHECK(ff_find(&f, "RUN.BIN"));
+
+	uint8_t* buf = malloc(60000);
+
+	ram_count = (RamCount) { 0 };
+	CHECK(ff_read(&f, buf, 60000) == 60000);
+	CHECK(ram_count.bulk == 1);
+
+	bool same = true;
+	for (uint32_t i = 0; i < 60000; i++)
+		same &= (buf[i] == pattern(3, i));
+	CHECK(same);
+
+	free(buf);
+
+	// the same image through the O_DIRECT backend
+	char path[] = "/var/tmp/fftestXXXXXX";
+	const int fd = mkstemp(path);
+	CHECK(fd >= 0);
+	if (fd < 0) return;
+
+	CHECK(write(fd, ram, ram_size) == (ssize_t) ram_size);
+	close(fd);
+
+	const BLOCKDEV* dev = direct_open(path);
+	if (dev == NULL)
+	{
+		printf("  no O_DIRECT on /var/tmp, skipped\n");
+		unlink(path);
+		return;
+	}
+
+	FAT16 dfat;
+	CHECK(ff_init(dev, &dfat));
+	ff_root(&dfat, &root);
+	CHECK(verify_file(&root, "RUN.BIN", 60000, 3));
+	CHECK(make_file(&root, "ODD.BIN", 12345, 4));
+	dev->flush();
+
+	// past the end of the image reads as zeros, not stale bounce data
+	uint32_t busy = 0;
+	while (busy + 2 * 4096 < ram_size && ram[busy + 50] == 0)
+		busy += 4096;
+
+	static uint8_t tail[200];
+	dev->seek(busy + 1); // unaligned, fills the bounce buffer
+	dev->load(tail, sizeof(tail));
+	CHECK(tail[49] != 0);
+
+	dev->seek(ram_size + 1);
+	dev->load(tail, sizeof(tail));
+	bool zeros = true;
+	for (uint16_t i = 0; i < sizeof(tail); i++)
+		zeros &= (tail[i] == 0);
+	CHECK(zeros);
+	CHECK(!direct_failed_io());
+	direct_close();
+
+	const int rfd = open(path, O_RDONLY);
+	CHECK(read(rfd, ram, ram_size) == (ssize_t) ram_size);
+	close(rfd);
+	unlink(path);
+
+	CHECK(ff_init(&ram_dev, &fat));
+	ff_root(&fat, &root);
+	CHECK(verify_file(&root, "ODD.BIN", 12345, 4));
+
+	FFCHECK ck;
+	check_clean(&fat, &ck);
+	CHECK(ck.files == 2);
+}
+
+
+/** The same on a FAT32 volume, with a root directory that grows */
+static void test_fat32(void)
+{
+	ram_new(40 << 20);
+
+	const FFORMAT opts = { .fat_type = 32, .label = "BIGVOL" };
+	CHECK(ff_format(&ram_dev, ram_size, &opts));
+
+	FAT16 fat;
+	CHECK(ff_init(&ram_dev, &fat));
+	CHECK(fat.bs.fat32);
+	CHECK(ram_clusters(&fat) >= 65525);
+	CHECK(fat.free_count == ram_free(&fat));
+
+	char label[12];
+	CHECK(strcmp(ff_disk_label(&fat, label), "BIGVOL") == 0);
+
+	CHECK(populate(&fat));
+
+	// more entries than fit in a cluster of the root directory
+	const uint16_t root_files = fat.bs.bytes_per_cluster / 32 * 3;
+	char name[16];
+
+	FFILE root;
+	ff_root(&fat, &root);
+	for (uint16_t i = 0; i < root_files; i++)
+	{
+		sprintf(name, "R%03u.TXT", i);
+		CHECK(make_file(&root, name, i * 10, i));
+	}
+
+	CHECK(ff_init(&ram_dev, &fat));
+	CHECK(verify_population(&fat));
+
+	ff_root(&fat, &root);
+	for (uint16_t i = 0; i < root_files; i++)
+	{
+		sprintf(name, "R%03u.TXT", i);
+		CHECK(verify_file(&root, name, i * 10, i));
+	}
+
+	FFCHECK ck;
+	check_clean(&fat, &ck);
+	CHECK(ck.files == POP_DIRS * POP_FILES + root_files);
+
+	// free count kept in FSInfo across a remount
+	const uint32_t free_before = ram_free(&fat);
+
+	FFILE big;
+	make_big(&fat, &big);
+	CHECK(ff_delete(&big));
+	ff_sync_all(&fat);
+
+	CHECK(ff_init(&ram_dev, &fat));
+	CHECK(fat.free_count == free_before);
+	CHECK(ram_free(&fat) == free_before);
+	check_clean(&fat, &ck);
+}
+
+
+/** A write past the end fills the gap with zeros, in few device calls */
+static void test_holes(void)
+{
+	ram_blank(8 << 20);
+
+	FAT16 fat;
+	CHECK(ff_init(&ram_dev, &fat));
+
+	// old data in the free clusters
+	memset(ram + fat.data_addr, 0xEE, ram_size - fat.data_addr);
+
+	FFILE f;
+	ff_root(&fat, &f);
+	CHECK(ff_newfile(&f, "HOLE.BIN"));
+	CHECK(ff_write(&f, "head", 4));
+
+	ram_count = (RamCount) { 0 };
+	CHECK(ff_seek(&f, 100000));
+	CHECK(ff_write(&f, "tail", 4));
+	CHECK(ram_count.stored >= 100000 - 4);
+	CHECK(ram_count.writes < 100);
+	ff_flush_file(&f);
+
+	CHECK(ff_init(&ram_dev, &fat));
+	ff_root(&fat, &f);
+	CHECK(ff_find(&f, "HOLE.BIN") && f.size == 100004);
+
+	uint8_t buf[1000];
+	bool zeros = true;
+	CHECK(ff_read(&f, buf, 4) == 4 && memcmp(buf, "head", 4) == 0);
+	for (uint32_t pos = 4; pos < 100000; pos += sizeof(buf))
+	{
+		const uint16_t n = (100000 - pos < sizeof(buf)) ? 100000 - pos : sizeof(buf);
+		CHECK(ff_read(&f, buf, n) == n);
+		for (uint16_t i = 0; i < n; i++)
+			zeros &= (buf[i] == 0);
+	}
+	CHECK(zeros);
+	CHECK(ff_read(&f, buf, 4) == 4 && memcmp(buf, "tail", 4) == 0);
+
+	FFCHECK ck;
+	check_clean(&fat, &ck);
+}
+
+
+/** Compare ff_statfs() and the free scan job with a plain count of the FAT */
+static void statfs_check(const FAT16* fat)
+{
+	FFSTATFS st;
+	ff_statfs(fat, &st);
+
+	const uint32_t clusters = ram_clusters(fat);
+	CHECK(st.clusters == clusters);
+	CHECK(st.free_clusters == ram_free(fat));
+	CHECK(st.bad_clusters == 0);
+
+	uint32_t largest = 0, run = 0;
+	for (uint32_t clu = 2; clu < clusters + 2; clu++)
+	{
+		run = (ram_fat(fat, clu) == 0) ? run + 1 : 0;
+		if (run > largest) largest = run;
+	}
+	CHECK(st.largest_free == largest);
+	CHECK(st.fragments >= st.chains);
+
+	FFJOB job;
+	ff_job_free_scan(&job, fat);
+	while (ff_step(&job, 7));
+	CHECK(job.result == st.free_clusters);
+}
+
+
+/** Volume statistics on FAT16 and FAT32, with fragmented free space */
+static void test_statfs(void)
+{
+	for (uint8_t type = 16; type <= 32; type += 16)
+	{
+		ram_new(type == 16 ? 8 << 20 : 40 << 20);
+
+		const FFORMAT opts = { .fat_type = type };
+		CHECK(ff_format(&ram_dev, ram_size, &opts));
+
+		FAT16 fat;
+		CHECK(ff_init(&ram_dev, &fat));
+		statfs_check(&fat);
+
+		CHECK(populate(&fat));
+
+		FFILE dir;
+		char name[16];
+		CHECK(open_dir(&fat, "DIR1", &dir));
+		for (uint16_t i = 0; i < POP_FILES; i += 3)
+		{
+			FFILE f = dir;
+			sprintf(name, "F%02u.BIN", i);
+			CHECK(ff_find(&f, name) && ff_rmfile(&f));
+		}
+
+		statfs_check(&fat);
+	}
+}
+
+
+/** Files growing at the same time stay in few pieces */
+static void test_append(void)
+{
+	ram_blank(8 << 20);
+
+	FAT16 fat;
+	CHECK(ff_init(&ram_dev, &fat));
+
+	const uint32_t bpc = fat.bs.bytes_per_cluster;
+	uint8_t* buf = malloc(bpc);
+
+	FFILE root, files[4];
+	char name[16];
+	ff_root(&fat, &root);
+
+	for (uint8_t i = 0; i < 4; i++)
+	{
+		files[i] = root;
+		sprintf(name, "LOG%u.TXT", i);
+		CHECK(ff_newfile(&files[i], name));
+	}
+
+	// a cluster to each file in turn
+	const uint16_t rounds = 200;
+	for (uint16_t r = 0; r < rounds; r++)
+	{
+		for (uint8_t i = 0; i < 4; i++)
+		{
+			for (uint32_t b = 0; b < bpc; b++)
+				buf[b] = pattern(i, r * bpc + b);
+
+			CHECK(ff_write(&files[i], buf, bpc));
+		}
+	}
+
+	free(buf);
+
+	for (uint8_t i = 0; i < 4; i++)
+	{
+		ff_flush_file(&files[i]);
+
+		uint32_t pieces;
+		CHECK(ram_chain(&fat, files[i].clu_start, &pieces) == rounds);
+		CHECK(pieces <= rounds / FF_ALLOC_WINDOW + 2);
+
+		sprintf(name, "LOG%u.TXT", i);
+		CHECK(verify_file(&root, name, rounds * bpc, i));
+	}
+
+	FFCHECK ck;
+	check_clean(&fat, &ck);
+}
+
+
+#if FF_USE_SIDECAR
+
+/** Mount, and return the bytes read. The free count must be right. */
+static uint32_t sc_mount(FAT16* fat)
+{
+	ram_count = (RamCount) { 0 };
+	CHECK(ff_init(&ram_dev, fat));
+	const uint32_t loaded = ram_count.loaded;
+
+	CHECK(fat->free_count == ram_free(fat));
+
+	return loaded;
+}
+
+
+/** Bytes read to open a file by path, the entry cache may know it */
+static uint32_t sc_lookup(const FAT16* fat)
+{
+	ram_count = (RamCount) { 0 };
+	FFILE f;
+	CHECK(ff_open_path(fat, "DIR2/F05.BIN", &f));
+	return ram_count.loaded;
+}
+
+
+/** Change a FAT entry like another driver would, with FSInfo kept up to date */
+static void sc_foreign(const FAT16* fat, const uint32_t clu, const uint32_t val)
+{
+	const uint32_t fat_bytes = fat->bs.fat_size_sectors * fat->bs.bytes_per_sector;
+
+	for (uint8_t i = 0; i < fat->bs.num_fats; i++)
+	{
+		uint8_t* p = ram + fat->fat_addr + i * fat_bytes;
+		if (fat->bs.fat32)
+			put32(p + clu * 4, val);
+		else
+			put16(p + clu * 2, val);
+	}
+
+	if (fat->fsi_addr != 0) put32(ram + fat->fsi_addr + 488, ram_free(fat));
+}
+
+
+/** Remount from the sidecar, and fall back when it's stale */
+static void sidecar_case(const bool fat32)
+{
+	if (fat32)
+	{
+		ram_new(40 << 20);
+		const FFORMAT opts = { .fat_type = 32 };
+		CHECK(ff_format(&ram_dev, ram_size, &opts));
+	}
+	else
+	{
+		ram_blank(8 << 20);
+	}
+
+	FAT16 fat;
+	CHECK(ff_init(&ram_dev, &fat));
+	CHECK(populate(&fat));
+
+	FFILE f;
+	CHECK(ff_open_path(&fat, "DIR2/F05.BIN", &f));
+	CHECK(ff_sidecar_save(&fat));
+
+	// clean - the free count and the cached entries are loaded
+	const uint32_t fast = sc_mount(&fat);
+	const uint32_t cached = sc_lookup(&fat);
+	CHECK(verify_population(&fat));
+
+	// a check that repairs nothing keeps it clean
+	FFCHECK ck;
+	check_clean(&fat, &ck);
+	CHECK(sc_mount(&fat) == fast);
+
+	// changed after saving - the clean bit is gone
+	FFILE root;
+	ff_root(&fat, &root);
+	CHECK(make_file(&root, "NEW.BIN", 30000, 1));
+
+	const uint32_t slow = sc_mount(&fat);
+	CHECK(sc_lookup(&fat) > cached);
+
+	// on FAT32, one read instead of a FAT scan
+	if (fat32) CHECK(slow > fast * 4);
+
+	// changed by another driver, which set the clean bit again
+	CHECK(ff_sidecar_save(&fat));
+	sc_mount(&fat);
+	CHECK(sc_lookup(&fat) == cached);
+
+	uint32_t clu = ram_clusters(&fat) + 1;
+	while (ram_fat(&fat, clu) != 0) clu--;
+
+	sc_foreign(&fat, clu, fat32 ? 0x0FFFFFFF : 0xFFFF);
+	sc_mount(&fat);
+	CHECK(sc_lookup(&fat) > cached);
+
+	sc_foreign(&fat, clu, 0);
+
+	// saved again, but damaged
+	CHECK(ff_sidecar_save(&fat));
+
+	ff_root(&fat, &f);
+	CHECK(ff_find(&f, "FFMOUNT.SYS"));
+	CHECK(ff_seek(&f, 20));
+	CHECK(ff_write(&f, "X", 1));
+	ff_flush_file(&f);
+
+	sc_mount(&fat);
+	CHECK(sc_lookup(&fat) > cached);
+
+	check_clean(&fat, &ck);
+	CHECK(verify_population(&fat));
+}
+
+
+/** The sidecar on FAT16 and on FAT32 */
+static void test_sidecar(void)
+{
+	sidecar_case(false);
+	sidecar_case(true);
+}
+
+#endif
+
+
+static uint32_t discards;  // discard() calls
+static uint32_t discarded; // bytes discarded
+
+static void ram_discard(const uint32_t addr, const uint32_t len)
+{
+	memset(ram + addr, 0xDD, len); // may read back as anything
+	discards++;
+	discarded += len;
+}
+
+static const BLOCKDEV ram_trim_dev = {
+	&ram_load, &ram_store, &ram_write, &ram_read,
+	&ram_seek, &ram_rseek, &ram_flush, &ram_discard
+};
+
+
+/** Freed clusters are discarded once the FAT is flushed */
+static void test_discard(void)
+{
+	ram_blank(8 << 20);
+
+	FAT16 fat;
+	CHECK(ff_init(&ram_trim_dev, &fat));
+	CHECK(populate(&fat));
+
+	const uint32_t bpc = fat.bs.bytes_per_cluster;
+	FFILE dir, f;
+	CHECK(open_dir(&fat, "DIR2", &dir));
+
+	// two neighbouring files - one range
+	CHECK(make_file(&dir, "A.BIN", 10 * bpc, 1));
+	CHECK(make_file(&dir, "B.BIN", 6 * bpc, 2));
+
+	discards = discarded = 0;
+
+	f = dir;
+	CHECK(ff_find(&f, "A.BIN") && ff_rmfile(&f));
+	f = dir;
+	CHECK(ff_find(&f, "B.BIN") && ff_rmfile(&f));
+
+	// not before the FAT is flushed
+	CHECK(discards == 0);
+
+	ff_sync_all(&fat);
+	CHECK(discards == 1);
+	CHECK(discarded == 16 * bpc);
+
+	CHECK(ff_init(&ram_trim_dev, &fat));
+	CHECK(verify_population(&fat));
+
+	FFCHECK ck;
+	check_clean(&fat, &ck);
+}
+
+
+
+// ------------- main ----------------
+
+typedef struct
+{
+	const char* name;
+	void (*fn)(void);
+} Test;
+
+static const Test tests[] = {
+	{ "walk", &test_walk },
+#if FF_USE_STATS
+	{ "stats", &test_stats },
+#endif
+	{ "trace", &test_trace },
+	{ "format", &test_format },
+	{ "defrag", &test_defrag },
+	{ "compact", &test_compact },
+	{ "lfn", &test_lfn },
+	{ "newfiles", &test_newfiles },
+	{ "full", &test_full },
+	{ "open_path", &test_open_path },
+#if FF_MAX_DIRTY > 0
+	{ "sync", &test_sync },
+#endif
+	{ "eof", &test_eof },
+#if FF_USE_JOURNAL
+	{ "journal", &test_journal },
+#endif
+	{ "delete", &test_delete },
+	{ "rename", &test_rename },
+	{ "partitions", &test_partitions },
+	{ "sectors", &test_sectors },
+	{ "runs", &test_runs },
+	{ "fat32", &test_fat32 },
+	{ "holes", &test_holes },
+	{ "statfs", &test_statfs },
+	{ "append", &test_append },
+#if FF_USE_SIDECAR
+	{ "sidecar", &test_sidecar },
+#endif
+	{ "discard", &test_discard },
+};
+
+
+int main(void)
+{
+	const uint16_t count = sizeof(tests) / sizeof(tests[0]);
+
+	for (uint16_t i = 0; i < count; i++)
+	{
+		const int before = failures;
+		printf("%s\n", tests[i].name);
+		tests[i].fn();
+		if (failures != before) printf("  %d failed\n", failures - before);
+	}
+
+	free(ram);
+
+	printf("%s\n", failures ? "FAILED" : "OK");
+	return failures ? 1 : 0;
+}